@@ -3,8 +3,8 @@
  *
  *	It's really simple to write in C, but hard to write in the shell...
  *
- *	This code is dependent on IPV4 addressing conventions...
- *		Sorry.
+ *	Both IPv4 and IPv6 addresses are handled; the answer and the
+ *	exit codes are the same as those of heartbeat/findif.sh.
  *
  * Copyright (C) 2000 Alan Robertson <alanr@unix.sh>
  * Copyright (C) 2001 Matt Soffen <matt@soffen.com>
@@ -38,10 +38,10 @@
  *	the route we selected.
  *
  *	If the broadcast address was omitted, we assume the highest address
- *	in the subnet.
+ *	in the subnet.  IPv6 has no broadcast; whatever was passed is echoed.
  *
  *	If the interface is omitted, we choose the interface associated with
- *	the route we selected.
+ *	the route we selected.  A link-local IPv6 address needs an interface.
  *
  *
  *	See http://www.doom.net/docs/netmask.html for a table explaining
@@ -67,6 +67,7 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <time.h>
 #ifdef __linux__
 #undef __OPTIMIZE__
 /*
@@ -78,12 +79,19 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif /* __linux__ */
 #include <agent_config.h>
 #include <config.h>
 
+#include "findif_lpm.h"
+
 #define DEBUG 0
 #define	EOS			'\0'
 #define	PROCROUTE	"/proc/net/route"
+#define	PROCROUTE6	"/proc/net/ipv6_route"
 #define ROUTEPARM	"-n get"
 
 #ifndef HAVE_STRNLEN
@@ -109,6 +117,18 @@
 #endif
 
 static int OutputInCIDR=0;
+static int BatchMode=0;
+
+/*
+ * An address of either family, as given in OCF_RESKEY_ip.
+ */
+struct findif_addr {
+	int	family;
+	union {
+		struct in_addr	in4;
+		struct in6_addr	in6;
+	} u;
+};
 
 
 /*
@@ -120,18 +140,26 @@ static int OutputInCIDR=0;
  *	Return code:
  *		<0:	mechanism invalid, so try next mechanism
  *		0:	mechanism worked: good answer
- *		>0:	mechanism worked: bad answer
+ *		>0:	mechanism worked: bad answer, final as well
  *	On non-zero, errmsg may have been filled with an error message
+ *
+ *	If if_specified is set, only routes through that interface count.
+ *	The prefix length of the route is returned in best_prefix.
  */
-typedef int SearchRoute (char *address, struct in_addr *in
-,        struct in_addr *addr_out, char *best_if, size_t best_iflen
-,        unsigned long *best_netmask, char *errmsg
-,	int errmsglen);
+typedef int SearchRoute (const char *address, const struct findif_addr *in
+,	const char *if_specified, char *best_if, size_t best_iflen
+,	int *best_prefix, char *errmsg, int errmsglen);
 
+#ifdef __linux__
+static SearchRoute SearchUsingNetlink;
+#endif
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
 
 static SearchRoute *search_mechs[] = {
+#ifdef __linux__
+	&SearchUsingNetlink,
+#endif
 	&SearchUsingProcRoute,
 	&SearchUsingRouteCmd,
 	NULL
@@ -142,7 +170,7 @@ void GetAddress (char **address, char **netmaskbits
 
 int ConvertNetmaskBitsToInt(char *netmaskbits);
 
-void ValidateNetmaskBits(int bits, unsigned long *netmask);
+int ValidateNetmaskBits(int bits, int family);
 
 int ValidateIFName (const char *ifname, struct ifreq *ifr);
 
@@ -154,6 +182,10 @@ char * get_ifname(char * buf, char * ifname);
 
 int ConvertQuadToInt(char *dest);
 
+int FindIF(const char *address, const char *netmaskbits
+,	const char *bcast_arg, const char *if_specified
+,	char *out, size_t outlen);
+
 static const char *cmdname = "findif";
 #define OCF_SUCCESS             0
 #define OCF_ERR_GENERIC         1
@@ -170,73 +202,313 @@ void usage(int ec);
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+#ifdef __linux__
+/*
+ * Ask the kernel which route it would actually use for the address.
+ *
+ * RTM_GETROUTE with RTM_F_FIB_MATCH returns the matching FIB entry
+ * (not a /32 cache entry), so rtm_dst_len is the prefix length of the
+ * route and policy routing rules are honoured.  Kernels which predate
+ * RTM_F_FIB_MATCH (< 4.13) silently ignore it and answer with a cloned
+ * route; we can't get the netmask from that, so let the next mechanism
+ * have a go.  IPv6 doesn't flag such an answer, so a full-length one
+ * is left to the table scan as well.  The same goes for local
+ * addresses: the answer would be the host route from the local table,
+ * not the subnet it lives in.  But when the kernel says there is no
+ * route, that is the answer: the table scan knows nothing of policy
+ * routing and could come up with an interface the kernel won't use.
+ */
+#ifndef RTM_F_FIB_MATCH
+#define RTM_F_FIB_MATCH	0x2000
+#endif
+
 static int
-SearchUsingProcRoute (char *address, struct in_addr *in
-, 	struct in_addr *addr_out, char *best_if, size_t best_iflen
-,	unsigned long *best_netmask
-,	char *errmsg, int errmsglen)
+SearchUsingNetlink (const char *address, const struct findif_addr *in
+,	const char *if_specified, char *best_if, size_t best_iflen
+,	int *best_prefix, char *errmsg, int errmsglen)
 {
-	unsigned long	flags, refcnt, use, gw, mask;
-	unsigned long   dest;
-	long		metric = LONG_MAX;
-	long		best_metric = LONG_MAX;
-	int		rc = OCF_SUCCESS;
-	
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rt;
+		char		attrs[RTA_SPACE(sizeof(struct in6_addr))
+				+	RTA_SPACE(sizeof(int))];
+	} req;
+	struct sockaddr_nl	nladdr;
+	struct nlmsghdr	*nh;
+	struct rtmsg	*rt;
+	struct rtattr	*rta;
+	char	buf[4096];
+	char	ifname[IF_NAMESIZE];
+	int	sock, len, rtlen;
+	int	addrlen, oif = 0;
+	int	rc = -1;
+
+	/* A batch answers from the route snapshot, see LoadRoutes() */
+	if (BatchMode) {
+		return(-1);
+	}
+
+	addrlen = in->family == AF_INET6
+	?	sizeof(in->u.in6) : sizeof(in->u.in4);
+	if (if_specified) {
+		oif = if_nametoindex(if_specified);
+		if (oif == 0) {
+			return(-1);
+		}
+	}
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sock < 0) {
+		return(-1);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = 1;
+	req.rt.rtm_family = in->family;
+	req.rt.rtm_dst_len = addrlen * 8;
+	req.rt.rtm_flags = RTM_F_FIB_MATCH;
+
+	rta = (struct rtattr *)((char *)&req + NLMSG_ALIGN(req.nh.nlmsg_len));
+	rta->rta_type = RTA_DST;
+	rta->rta_len = RTA_LENGTH(addrlen);
+	memcpy(RTA_DATA(rta), &in->u, addrlen);
+	req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	if (oif) {
+		rta = (struct rtattr *)((char *)&req + req.nh.nlmsg_len);
+		rta->rta_type = RTA_OIF;
+		rta->rta_len = RTA_LENGTH(sizeof(oif));
+		memcpy(RTA_DATA(rta), &oif, sizeof(oif));
+		req.nh.nlmsg_len += RTA_ALIGN(rta->rta_len);
+		oif = 0;
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(sock, &req, req.nh.nlmsg_len, 0
+	,	(struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		goto out;
+	}
+
+	do {
+		len = recv(sock, buf, sizeof(buf), 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0) {
+		goto out;
+	}
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len)
+	;	nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_seq != req.nh.nlmsg_seq) {
+			continue;
+		}
+		if (nh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+
+			/*
+			 * The kernel won't route there (policy rules
+			 * included): that is final, the table scan
+			 * must not find an interface anyway.
+			 */
+			if (err->error == -ENETUNREACH
+			||	err->error == -EHOSTUNREACH
+			||	err->error == -EACCES) {
+				snprintf(errmsg, errmsglen
+				,	"No route to %s\n", address);
+				rc = OCF_ERR_GENERIC;
+			}
+			goto out;
+		}
+		if (nh->nlmsg_type != RTM_NEWROUTE) {
+			continue;
+		}
+
+		rt = NLMSG_DATA(nh);
+		/* IPv6 answers with the reject route instead of an error */
+		if (rt->rtm_type == RTN_UNREACHABLE
+		||	rt->rtm_type == RTN_PROHIBIT
+		||	rt->rtm_type == RTN_BLACKHOLE) {
+			snprintf(errmsg, errmsglen
+			,	"No route to %s\n", address);
+			rc = OCF_ERR_GENERIC;
+			goto out;
+		}
+		if ((rt->rtm_flags & RTM_F_CLONED)
+		||	rt->rtm_type == RTN_LOCAL
+		||	rt->rtm_dst_len > addrlen * 8
+		||	(in->family == AF_INET6
+		&&	rt->rtm_dst_len == addrlen * 8)) {
+			goto out;
+		}
+		rtlen = RTM_PAYLOAD(nh);
+		for (rta = RTM_RTA(rt); RTA_OK(rta, rtlen)
+		;	rta = RTA_NEXT(rta, rtlen)) {
+			if (rta->rta_type == RTA_OIF) {
+				memcpy(&oif, RTA_DATA(rta), sizeof(oif));
+			}
+		}
+		if (oif == 0 || if_indextoname(oif, ifname) == NULL) {
+			goto out;
+		}
+
+		*best_prefix = rt->rtm_dst_len;
+		strncpy(best_if, ifname, best_iflen);
+		rc = OCF_SUCCESS;
+		break;
+	}
+
+  out:
+	close(sock);
+	return(rc);
+}
+#endif /* __linux__ */
+
+/*
+ * The routing tables from /proc are read once into a snapshot and kept
+ * for the life of the process, so that a batch of lookups (-b) doesn't
+ * re-read them for every address.  Lookups go through a longest prefix
+ * match trie built over the snapshot (findif_lpm.c).
+ *
+ * /proc/net/ipv6_route lists every table, the local one included.  Its
+ * host routes for our own addresses would always win the longest prefix
+ * match, so they are skipped like "ip route list" (table main) does.
+ */
+#define	PROC_RTF_REJECT	0x00000200
+#define	PROC_RTF_LOCAL	0x80000000
+
+static struct findif_routes route_snapshot[2];	/* IPv4, IPv6 */
+
+static int
+LoadRoutes(int family, struct findif_routes *rt, char *errmsg, int errmsglen)
+{
+	const char *path = family == AF_INET6 ? PROCROUTE6 : PROCROUTE;
+	struct findif_route *r;
 	char	buf[2048];
 	char	interface[MAXSTR];
+	int	rc = OCF_SUCCESS;
 	FILE *routefd = NULL;
 
-	if ((routefd = fopen(PROCROUTE, "r")) == NULL) {
+	if ((routefd = fopen(path, "r")) == NULL) {
+		/* no /proc: leave it to the next mechanism */
 		snprintf(errmsg, errmsglen
 		,	"Cannot open %s for reading"
-		,	PROCROUTE);
-		rc = OCF_ERR_GENERIC; goto out;
+		,	path);
+		rc = -1; goto out;
 	}
 
 	/* Skip first (header) line */
-	if (fgets(buf, sizeof(buf), routefd) == NULL) {
+	if (family == AF_INET && fgets(buf, sizeof(buf), routefd) == NULL) {
 		snprintf(errmsg, errmsglen
 		,	"Cannot skip first line from %s"
-		,	PROCROUTE);
+		,	path);
 		rc = OCF_ERR_GENERIC; goto out;
 	}
-	*best_netmask = 0;
 	while (fgets(buf, sizeof(buf), routefd) != NULL) {
-		if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
-		,	interface, &dest, &gw, &flags, &refcnt, &use
-		,	&metric, &mask)
-		!= 8) {
-			snprintf(errmsg, errmsglen, "Bad line in %s: %s"
-			,	PROCROUTE, buf);
-			rc = OCF_ERR_GENERIC; goto out;
-		}
-		if ( (in->s_addr&mask) == (in_addr_t)(dest&mask)
-		&&	metric <= best_metric && mask >= *best_netmask) {
-			best_metric = metric;
-			*best_netmask = mask;
-			strncpy(best_if, interface, best_iflen);
+		if (family == AF_INET) {
+			unsigned long	flags, refcnt, use, gw, mask;
+			unsigned long	dest, metric;
+			uint32_t	d;
+
+			if (sscanf(buf, "%[^\t]\t%lx%lx%lx%lx%lx%lx%lx"
+			,	interface, &dest, &gw, &flags, &refcnt, &use
+			,	&metric, &mask)
+			!= 8) {
+				goto bad;
+			}
+			if (flags & PROC_RTF_REJECT) {
+				continue;
+			}
+			if ((r = LPMAddRoute(rt)) == NULL) {
+				goto nomem;
+			}
+			d = dest & mask;
+			memcpy(r->dest, &d, sizeof(d));
+			r->plen = netmask_bits(ntohl(mask));
+			r->metric = metric;
+		}else{
+			char	dest[33];
+			unsigned int	plen, metric, refcnt, use, flags;
+			unsigned int	i, byte;
+
+			if (sscanf(buf, "%32s %x %*s %*x %*s %x %x %x %x %127s"
+			,	dest, &plen, &metric, &refcnt, &use, &flags
+			,	interface)
+			!= 7 || strlen(dest) != 32 || plen > 128) {
+				goto bad;
+			}
+			if (flags & (PROC_RTF_REJECT|PROC_RTF_LOCAL)) {
+				continue;
+			}
+			if ((r = LPMAddRoute(rt)) == NULL) {
+				goto nomem;
+			}
+			for (i = 0; i < 16; i++) {
+				sscanf(dest + 2 * i, "%2x", &byte);
+				r->dest[i] = byte;
+			}
+			r->plen = plen;
+			r->metric = metric;
 		}
+		snprintf(r->ifname, sizeof(r->ifname), "%.*s"
+		,	(int)sizeof(r->ifname) - 1, interface);
 	}
-
-	if (best_metric == LONG_MAX) {
-		snprintf(errmsg, errmsglen, "No route to %s\n", address);
-		rc = OCF_ERR_GENERIC; 
+	if (LPMBuild(rt, family == AF_INET6 ? 128 : 32) < 0) {
+		goto nomem;
 	}
-
+	rt->loaded = 1;
+	goto out;
+
+  bad:
+	snprintf(errmsg, errmsglen, "Bad line in %s: %s", path, buf);
+	rc = OCF_ERR_GENERIC; goto out;
+  nomem:
+	snprintf(errmsg, errmsglen, "Out of memory reading %s", path);
+	rc = OCF_ERR_GENERIC;
   out:
 	if (routefd) {
 		fclose(routefd);
 	}
-
 	return(rc);
 }
 
 static int
-SearchUsingRouteCmd (char *address, struct in_addr *in
-,	struct in_addr *addr_out, char *best_if, size_t best_iflen
-,	unsigned long *best_netmask
-,	char *errmsg, int errmsglen)
+SearchUsingProcRoute (const char *address, const struct findif_addr *in
+,	const char *if_specified, char *best_if, size_t best_iflen
+,	int *best_prefix, char *errmsg, int errmsglen)
 {
+	struct findif_routes *rt;
+	const struct findif_route *best;
+	const unsigned char *a;
+	int	rc;
+
+	rt = &route_snapshot[in->family == AF_INET6];
+	if (!rt->loaded) {
+		rc = LoadRoutes(in->family, rt, errmsg, errmsglen);
+		if (rc != OCF_SUCCESS) {
+			return(rc);
+		}
+	}
+
+	a = in->family == AF_INET6
+	?	in->u.in6.s6_addr : (const unsigned char *)&in->u.in4;
+	best = LPMLookup(rt, a, if_specified);
+	if (best == NULL) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	*best_prefix = best->plen;
+	strncpy(best_if, best->ifname, best_iflen);
+	return(OCF_SUCCESS);
+}
+
+static int
+SearchUsingRouteCmd (const char *address, const struct findif_addr *in
+,	const char *if_specified, char *best_if, size_t best_iflen
+,	int *best_prefix, char *errmsg, int errmsglen)
+{
+	struct in_addr	addr_out;
 	char	mask[20];
 	char	routecmd[MAXSTR];
 	int	best_metric = INT_MAX;	
@@ -247,7 +519,10 @@ SearchUsingRouteCmd (char *address, struct in_addr *in
 	FILE *routefd = NULL;
 	uint32_t maskbits;
 
-	
+	if (in->family != AF_INET) {
+		return(-1);
+	}
+
 	/* Open route and get the information */
 	snprintf (routecmd, sizeof(routecmd), "%s %s %s"
 	,	ROUTE, ROUTEPARM, address);
@@ -330,19 +605,24 @@ SearchUsingRouteCmd (char *address, struct in_addr *in
 		return(OCF_ERR_CONFIGURED);
 	}
 
-	if (inet_pton(AF_INET, address, addr_out) <= 0) {
+	if (inet_pton(AF_INET, address, &addr_out) <= 0) {
 		snprintf(errmsg, errmsglen
 		,	"IP address [%s] not valid.", address);
 		return(OCF_ERR_CONFIGURED);
 	}
 
-	if ((in->s_addr & maskbits) == (addr_out->s_addr & maskbits)) {
+	if ((in->u.in4.s_addr & maskbits) == (addr_out.s_addr & maskbits)) {
 		if (interface[0] == EOS) {
 			snprintf(errmsg, errmsglen, "No interface found.");
 			return(OCF_ERR_GENERIC);
 		}
+		if (if_specified && strcmp(interface, if_specified) != 0) {
+			snprintf(errmsg, errmsglen, "No route to %s via %s\n"
+			,	address, if_specified);
+			return(OCF_ERR_GENERIC);
+		}
 		best_metric = 0;
-		*best_netmask = maskbits;
+		*best_prefix = netmask_bits(ntohl(maskbits));
 		strncpy(best_if, interface, best_iflen);
 	}
 
@@ -383,34 +663,29 @@ GetAddress (char **address, char **netmaskbits
 int
 ConvertNetmaskBitsToInt(char *netmaskbits)
 {
-	size_t	nmblen = strnlen(netmaskbits, 3);
+	size_t	nmblen = strnlen(netmaskbits, 4);
 
-	/* Maximum netmask is 32 */
+	/* Maximum netmask is 128 (IPv6) */
 
-	if (nmblen > 2 || nmblen == 0
+	if (nmblen > 3 || nmblen == 0
 	||	(strspn(netmaskbits, "0123456789") != nmblen))
 		return -1;
 	else
 		return atoi(netmaskbits);
 }
 
-void
-ValidateNetmaskBits(int bits, unsigned long *netmask)
+int
+ValidateNetmaskBits(int bits, int family)
 {
-	/* Maximum netmask is 32 */
+	/* Maximum netmask is 32, or 128 for IPv6 */
 
-	if (bits < 1 || bits > 32) {
+	if (bits < 1 || bits > (family == AF_INET6 ? 128 : 32)) {
 		fprintf(stderr
-		,	"Invalid netmask specification [%d]"
+		,	"Invalid netmask specification [%d]\n"
 		,	bits);
-		usage(OCF_ERR_CONFIGURED);
-		/*not reached */
+		return -1;
 	}
-
-	bits = 32 - bits;
-	*netmask = (1L<<(bits))-1L;
-	*netmask = ((~(*netmask))&0xffffffffUL);
-	*netmask = htonl(*netmask);
+	return 0;
 }
 
 int
@@ -451,7 +726,7 @@ netmask_bits(unsigned long netmask)
 
 	netmask = netmask & 0xFFFFFFFFUL;
 
-	for (j=0; j <= 32; ++j) {
+	for (j=0; j < 32; ++j) {
 		if ((netmask >> j)&0x1) {
 			break;
 		}
@@ -559,203 +834,327 @@ int ConvertQuadToInt(char *dest)
 	return netmask_bits(ntohl(ad.s_addr));
 }
 
+/*
+ * FindIF works out the interface, netmask and broadcast address for one
+ * address, and leaves the answer line (as printed by findif) in out.
+ * Problems are reported on stderr; the return code is an OCF one, with
+ * OCF_ERR_CONFIGURED meaning bad parameters.
+ */
 int
-main(int argc, char ** argv) {
-
-	char *	address = NULL;
-	char *	bcast_arg = NULL;
-	char *	netmaskbits = NULL;
-	struct in_addr	in;
-	struct in_addr	addr_out;
-	unsigned long	netmask = 0;
-	char	best_if[MAXSTR];
-	char *	if_specified = NULL;
+FindIF(const char *address, const char *netmaskbits
+,	const char *bcast_arg, const char *if_specified
+,	char *out, size_t outlen)
+{
+	struct findif_addr	in;
 	struct ifreq	ifr;
-	unsigned long	best_netmask = UINT_MAX;
-	int		argerrs	= 0;
-	int		nmbits;
-
-	cmdname=argv[0];
-
+	char	best_if[MAXSTR];
+	char	nmbuf[MAXSTR];
+	int	best_prefix = -1;
+	int	nmbits = -1;
+	int	rc;
 
-	memset(&addr_out, 0, sizeof(addr_out));
 	memset(&in, 0, sizeof(in));
 	memset(&ifr, 0, sizeof(ifr));
 
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
-			argerrs=1;
-		}
-		OutputInCIDR=1;
-		break;
-	default:
-		argerrs=1;
-		break;
-	}
-	if (argerrs) {
-		usage(OCF_ERR_ARGS);
-		/* not reached */
-		return(1);
-	}
-
-	GetAddress (&address, &netmaskbits, &bcast_arg
-	,	 &if_specified);
 	if (address == NULL || *address == EOS) {
-		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+		fprintf(stderr, "ERROR: IP address parameter is mandatory.\n");
+		return(OCF_ERR_CONFIGURED);
 	}
 
 	/* Is the IP address we're supposed to find valid? */
-	 
-	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
-		fprintf(stderr, "IP address [%s] not valid.", address);
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
+
+	in.family = strchr(address, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(in.family, address, (void *)&in.u) <= 0) {
+		fprintf(stderr, "IP address [%s] not valid.\n", address);
+		return(OCF_ERR_CONFIGURED);
+	}
+	if (if_specified != NULL && *if_specified == EOS) {
+		if_specified = NULL;
+	}
+	if (in.family == AF_INET6 && if_specified == NULL
+	&&	IN6_IS_ADDR_LINKLOCAL(&in.u.in6)) {
+		fprintf(stderr, "'nic' parameter is mandatory for a link"
+		" local address [%s].\n", address);
+		return(OCF_ERR_CONFIGURED);
 	}
 
 	if (netmaskbits != NULL && *netmaskbits != EOS) {
-		if (strchr(netmaskbits, '.') != NULL) {
-			nmbits = ConvertQuadToInt(netmaskbits);
+		strncpy(nmbuf, netmaskbits, sizeof(nmbuf) - 1);
+		nmbuf[sizeof(nmbuf) - 1] = EOS;
+		if (in.family == AF_INET && strchr(nmbuf, '.') != NULL) {
+			nmbits = ConvertQuadToInt(nmbuf);
 			fprintf(stderr, "Converted dotted-quad netmask to CIDR as: %d\n", nmbits);
 		}else{
-			nmbits = ConvertNetmaskBitsToInt(netmaskbits);
+			nmbits = ConvertNetmaskBitsToInt(nmbuf);
 		}
 
 		if (nmbits < 0) {
 			fprintf(stderr, "Invalid netmask specification"
-			" [%s]", netmaskbits);
-			usage(OCF_ERR_CONFIGURED);
-			/*not reached */
+			" [%s]\n", netmaskbits);
+			return(OCF_ERR_CONFIGURED);
 		}
 
 		/* Validate the netmaskbits field */
-		ValidateNetmaskBits (nmbits, &netmask);
+		if (ValidateNetmaskBits(nmbits, in.family) < 0) {
+			return(OCF_ERR_CONFIGURED);
+		}
 	}
 
+	/* Did they tell us the broadcast address? */
 
-	if (if_specified != NULL && *if_specified != EOS) {
+	if (in.family == AF_INET && bcast_arg && *bcast_arg != EOS
+	&&	strcmp(bcast_arg, "+") != 0 && strcmp(bcast_arg, "-") != 0) {
+		/* Yes, they gave us a broadcast address.
+		 * It at least should be a valid IP address
+		 */
+ 		struct in_addr bcast_addr;
+ 		if (inet_pton(AF_INET, bcast_arg, (void *)&bcast_addr) <= 0) {
+ 			fprintf(stderr, "Invalid broadcast address [%s].\n", bcast_arg);
+			return(OCF_ERR_CONFIGURED);
+ 		}
+	}
+
+	if (if_specified != NULL) {
 		if(ValidateIFName(if_specified, &ifr) < 0) {
-			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
+			return(OCF_ERR_CONFIGURED);
 		}
 		strncpy(best_if, if_specified, sizeof(best_if) - 1);
 		*(best_if + sizeof(best_if) - 1) = '\0';
-	}else{
-		SearchRoute **sr = search_mechs;
-		char errmsg[MAXSTR] = "No valid mechanisms";
-		int rc = OCF_ERR_GENERIC;
+	}
 
-		strcpy(best_if, "UNKNOWN");
+	/*
+	 * Like findif.sh, the route is looked up (through the given
+	 * interface, if any) unless both the interface and the netmask
+	 * are known already.
+	 */
+	if (if_specified == NULL || nmbits < 0) {
+		SearchRoute **sr;
+		char errmsg[MAXSTR] = "No valid mechanisms";
+		char mecherr[MAXSTR];
+		int mrc;
 
-		while (*sr) {
-			errmsg[0] = '\0';
-			rc = (*sr) (address, &in, &addr_out, best_if
-			,	sizeof(best_if)
-			,	&best_netmask, errmsg, sizeof(errmsg));
-			if (!rc) {		/* Mechanism worked */
-				break;
-			}
-			sr++;
+		if (if_specified == NULL) {
+			strcpy(best_if, "UNKNOWN");
 		}
-		if (rc != 0) {	/* No route, or all mechanisms failed */
-			if (*errmsg) {
-				fprintf(stderr, "%s", errmsg);
+		rc = OCF_ERR_GENERIC;
+		for (sr = search_mechs; *sr; sr++) {
+			mecherr[0] = '\0';
+			mrc = (*sr) (address, &in, if_specified, best_if
+			,	sizeof(best_if)
+			,	&best_prefix, mecherr, sizeof(mecherr));
+			if (mrc < 0) {	/* Mechanism not applicable */
+				continue;
 			}
-			return(rc);
+			/*
+			 * The first mechanism which can answer has the
+			 * last word, "no route" included: a later one
+			 * only knows less (and route(8) is BSD only).
+			 */
+			rc = mrc;
+			strcpy(errmsg, mecherr);
+			break;
 		}
-	}
 
-	if (netmaskbits) {
-		best_netmask = netmask;
-	}else if (best_netmask == 0L) {
 		/*
 		   On some distributions, there is no loopback related route
 		   item, this leads to the error here.
 		   My fix may be not good enough, please FIXME
 		 */
-		if (0 == strncmp(address, "127", 3)) {
-			if (NULL != get_first_loopback_netdev(best_if)) {
-				best_netmask = 0x000000ff;
-			} else {
+		if ((rc != 0 || best_prefix == 0) && if_specified == NULL
+		&&	(in.family == AF_INET6
+		?	IN6_IS_ADDR_LOOPBACK(&in.u.in6)
+		:	(ntohl(in.u.in4.s_addr) >> 24) == 127)) {
+			if (NULL == get_first_loopback_netdev(best_if)) {
 				fprintf(stderr, "No loopback interface found.\n");
 				return(OCF_ERR_GENERIC);
 			}
-		} else {
-			fprintf(stderr
-			,	"ERROR: Cannot use default route w/o netmask [%s]\n"
-			,	 address);
-			return(OCF_ERR_GENERIC);
+			best_prefix = in.family == AF_INET6 ? 128 : 8;
+			rc = 0;
+		}
+		if (rc != 0) {	/* No route, or all mechanisms failed */
+			if (*errmsg) {
+				fprintf(stderr, "%s", errmsg);
+			}
+			return(rc);
 		}
 	}
 
-	/* Did they tell us the broadcast address? */
-
-	if (bcast_arg && *bcast_arg != EOS) {
-		/* Yes, they gave us a broadcast address.
-		 * It at least should be a valid IP address
-		 */
- 		struct in_addr bcast_addr;
- 		if (inet_pton(AF_INET, bcast_arg, (void *)&bcast_addr) <= 0) {
- 			fprintf(stderr, "Invalid broadcast address [%s].", bcast_arg);
- 			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
- 		}
+	if (nmbits >= 0) {
+		best_prefix = nmbits;
+	}else if (best_prefix == 0) {
+		fprintf(stderr
+		,	"ERROR: Cannot use default route w/o netmask [%s]\n"
+		,	 address);
+		return(OCF_ERR_GENERIC);
+	}
 
-		best_netmask = htonl(best_netmask);
+	if (in.family == AF_INET6) {
+		/* No broadcast for IPv6, pass on whatever we were given */
+		snprintf(out, outlen, "%s\tnetmask %d\tbroadcast %s"
+		,	best_if, best_prefix, bcast_arg ? bcast_arg : "");
+	}else{
+		unsigned long	netmask, def_bcast;
+		char	bcast[INET_ADDRSTRLEN];
+		char	mask[INET_ADDRSTRLEN];
+		struct in_addr	a;
+
+		netmask = htonl((uint32_t)(0xffffffffUL << (32 - best_prefix)));
+		if (bcast_arg && *bcast_arg != EOS) {
+			strncpy(bcast, bcast_arg, sizeof(bcast) - 1);
+			bcast[sizeof(bcast) - 1] = EOS;
+		}else{
+			/* No, we use a common broadcast address convention */
+			def_bcast = (in.u.in4.s_addr | (~netmask));
+#if DEBUG
+			fprintf(stderr, "netmask = %08lx, def_bcast = %08lx\n"
+			,	netmask,  def_bcast);
+#endif
+			a.s_addr = (in_addr_t)def_bcast;
+			inet_ntop(AF_INET, &a, bcast, sizeof(bcast));
+		}
 		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
-			,	best_if
-                	,       (int)((best_netmask>>24) & 0xff)
-                	,       (int)((best_netmask>>16) & 0xff)
-                	,       (int)((best_netmask>>8) & 0xff)
-                	,       (int)(best_netmask & 0xff)
-			,	bcast_arg);
+			a.s_addr = (in_addr_t)netmask;
+			inet_ntop(AF_INET, &a, mask, sizeof(mask));
+			snprintf(out, outlen, "%s\tnetmask %s\tbroadcast %s"
+			,	best_if, mask, bcast);
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %s\n"
-			,	best_if
-			,	netmask_bits(best_netmask)
-			,	bcast_arg);
+			snprintf(out, outlen, "%s\tnetmask %d\tbroadcast %s"
+			,	best_if, best_prefix, bcast);
 		}
-	}else{
-		/* No, we use a common broadcast address convention */
-		unsigned long	def_bcast;
+	}
+	return(OCF_SUCCESS);
+}
 
-			/* Common broadcast address */
-		def_bcast = (in.s_addr | (~best_netmask));
-#if DEBUG
-		fprintf(stderr, "best_netmask = %08lx, def_bcast = %08lx\n"
-		,	best_netmask,  def_bcast);
-#endif
+static double
+elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0
+	+	(to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
 
-		/* Make things a bit more machine-independent */
-		best_netmask = htonl(best_netmask);
-		def_bcast = htonl(def_bcast);
-		if (!OutputInCIDR) {
-			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
-			,       best_if
-			,       (int)((best_netmask>>24) & 0xff)
-			,       (int)((best_netmask>>16) & 0xff)
-			,       (int)((best_netmask>>8) & 0xff)
-			,       (int)(best_netmask & 0xff)
-			,       (int)((def_bcast>>24) & 0xff)
-			,       (int)((def_bcast>>16) & 0xff)
-			,       (int)((def_bcast>>8) & 0xff)
-			,       (int)(def_bcast & 0xff));
+/*
+ * Batch mode: each line of stdin is "ip[/mask] [nic] [broadcast]", with
+ * "-" standing for no nic.  One line goes out per address, in order:
+ * the address followed by the usual answer, or by "error <rc>".
+ * The exit code is that of the first failure, if any.
+ */
+static int
+FindIFBatch(int timing)
+{
+	char	line[1024];
+	char	result[2 * MAXSTR];
+	struct timespec	t0, t1, t2;
+	int	naddr = 0, nfail = 0;
+	int	first_rc = OCF_SUCCESS;
+	int	routes;
+	char	errmsg[MAXSTR] = "";
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (LoadRoutes(AF_INET, &route_snapshot[0], errmsg, sizeof(errmsg))
+	||	LoadRoutes(AF_INET6, &route_snapshot[1], errmsg, sizeof(errmsg))) {
+		fprintf(stderr, "%s\n", errmsg);
+	}
+	routes = route_snapshot[0].count + route_snapshot[1].count;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		char	*address, *netmaskbits, *nic, *bcast, *save;
+		int	rc;
+
+		address = strtok_r(line, " \t\r\n", &save);
+		if (address == NULL || *address == '#') {
+			continue;
+		}
+		nic = strtok_r(NULL, " \t\r\n", &save);
+		bcast = strtok_r(NULL, " \t\r\n", &save);
+		if (nic && strcmp(nic, "-") == 0) {
+			nic = NULL;
+		}
+		if ((netmaskbits = strchr(address, DELIM)) != NULL) {
+			*netmaskbits++ = EOS;
+		}
+
+		naddr++;
+		rc = FindIF(address, netmaskbits, bcast, nic
+		,	result, sizeof(result));
+		if (rc == OCF_SUCCESS) {
+			printf("%s\t%s\n", address, result);
 		}else{
-			printf("%s\tnetmask %d\tbroadcast %d.%d.%d.%d\n"
-			,       best_if
-			,	netmask_bits(best_netmask)
-			,       (int)((def_bcast>>24) & 0xff)
-			,       (int)((def_bcast>>16) & 0xff)
-			,       (int)((def_bcast>>8) & 0xff)
-			,       (int)(def_bcast & 0xff));
+			printf("%s\terror %d\n", address, rc);
+			if (nfail++ == 0) {
+				first_rc = rc;
+			}
+		}
+		fflush(stdout);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	if (timing) {
+		fprintf(stderr, "%d addresses (%d failed) in %.3f ms:"
+		" %d routes loaded in %.3f ms, %.1f us per address\n"
+		,	naddr, nfail, elapsed_ms(&t0, &t2)
+		,	routes, elapsed_ms(&t0, &t1)
+		,	naddr ? elapsed_ms(&t1, &t2) * 1000.0 / naddr : 0.0);
+	}
+	return(first_rc);
+}
+
+int
+main(int argc, char ** argv) {
+
+	char *	address = NULL;
+	char *	bcast_arg = NULL;
+	char *	netmaskbits = NULL;
+	char *	if_specified = NULL;
+	char	result[2 * MAXSTR];
+	int		argerrs	= 0;
+	int		timing = 0;
+	int		rc, c;
+
+	cmdname=argv[0];
+
+	while ((c = getopt(argc, argv, "CbT")) != -1) {
+		switch (c) {
+		case 'C':
+			OutputInCIDR=1;
+			break;
+		case 'b':
+			BatchMode=1;
+			break;
+		case 'T':
+			timing=1;
+			break;
+		default:
+			argerrs=1;
+			break;
 		}
 	}
-	return(0);
+	if (optind != argc || (timing && !BatchMode)) {
+		argerrs=1;
+	}
+	if (argerrs) {
+		usage(OCF_ERR_ARGS);
+		/* not reached */
+		return(1);
+	}
+
+	if (BatchMode) {
+		return(FindIFBatch(timing));
+	}
+
+	GetAddress (&address, &netmaskbits, &bcast_arg
+	,	 &if_specified);
+
+	rc = FindIF(address, netmaskbits, bcast_arg, if_specified
+	,	result, sizeof(result));
+	if (rc == OCF_ERR_CONFIGURED) {
+		usage(rc);
+		/* not reached */
+	}
+	if (rc == OCF_SUCCESS) {
+		printf("%s\n", result);
+	}
+	return(rc);
 }
 
 void
@@ -764,12 +1163,17 @@ usage(int ec)
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C] [-b [-T]]\n"
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
-		"Environment variables:\n"
-		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
+		"    -b: Batch mode: read \"ip[/mask] [nic] [broadcast]\" "
+			"lines from stdin\n"
+		"        and print \"ip<TAB>answer\" (or \"ip<TAB>error rc\") "
+			"for each.\n"
+		"    -T: Print a timing summary of the batch on stderr.\n"
+		"Environment variables (unless -b):\n"
+		"OCF_RESKEY_ip		 ip address, IPv4 or IPv6 (mandatory!)\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
 		"OCF_RESKEY_broadcast	 broadcast address for interface\n"
 		"OCF_RESKEY_nic		 interface to assign to\n"
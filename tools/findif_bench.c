@@ -0,0 +1,286 @@
+/*
+ * findif_bench.c:	Benchmark of the findif longest prefix match trie
+ *
+ *	Builds synthetic routing tables of growing size, with a prefix
+ *	length mix roughly like that of a full BGP table, and reports
+ *	the build time, lookups per second and memory use of the trie.
+ *	For comparison it also times the linear scan findif used to do.
+ *	Every table is cross-checked against the linear scan; the exit
+ *	code is 1 if the answers differ.
+ *
+ *	findif_bench [-6] [-n lookups] [routes...]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "findif_lpm.h"
+
+#define	DEFAULT_LOOKUPS	1000000
+#define	SCAN_LOOKUPS	1000
+#define	SCAN_BUDGET	100000000	/* routes checked by the scan */
+
+static uint64_t	rnd_state = 88172645463325252ULL;
+
+static uint32_t
+rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return (uint32_t)(rnd_state >> 16);
+}
+
+static double
+now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Mostly /24s for IPv4 and /48s for IPv6, as in a full BGP table */
+static int
+random_plen(int bits)
+{
+	uint32_t	r = rnd() % 100;
+
+	if (bits == 32) {
+		return r < 55 ? 24 : r < 70 ? 22 + rnd() % 2
+		:	r < 90 ? 16 + rnd() % 6 : r < 98 ? 8 + rnd() % 8
+		:	25 + rnd() % 8;
+	}
+	return r < 50 ? 48 : r < 80 ? 32 + rnd() % 16
+	:	r < 90 ? 29 + rnd() % 3 : 49 + rnd() % 16;
+}
+
+static void
+random_bytes(unsigned char *a, int bits)
+{
+	int	i;
+
+	for (i = 0; i < bits / 8; i++) {
+		a[i] = rnd();
+	}
+}
+
+static void
+mask_bits(unsigned char *a, int plen, int bits)
+{
+	int	i;
+
+	for (i = 0; i < bits / 8; i++) {
+		if (plen >= (i + 1) * 8) {
+			continue;
+		}
+		a[i] &= plen > i * 8 ? 0xff << ((i + 1) * 8 - plen) : 0;
+	}
+}
+
+static void
+make_table(struct findif_routes *rt, int count, int bits)
+{
+	struct findif_route	*r;
+	int	i;
+
+	/* A default route, so that every address has an answer */
+	r = LPMAddRoute(rt);
+	snprintf(r->ifname, sizeof(r->ifname), "eth0");
+	r->metric = 100;
+
+	for (i = 1; i < count; i++) {
+		if ((r = LPMAddRoute(rt)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(2);
+		}
+		r->plen = random_plen(bits);
+		random_bytes(r->dest, bits);
+		if (bits == 128) {
+			r->dest[0] = 0x20;	/* 2000::/3 */
+		}
+		mask_bits(r->dest, r->plen, bits);
+		r->metric = rnd() % 4;
+		snprintf(r->ifname, sizeof(r->ifname), "eth%u", rnd() % 8);
+	}
+}
+
+/* Half of the addresses fall inside a random route, half anywhere */
+static unsigned char *
+make_addrs(const struct findif_routes *rt, int n, int bits)
+{
+	unsigned char	*addrs = malloc((size_t)n * 16);
+	int	i, j;
+
+	if (addrs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	for (i = 0; i < n; i++) {
+		unsigned char	*a = addrs + (size_t)i * 16;
+
+		random_bytes(a, bits);
+		if (i % 2 == 0) {
+			const struct findif_route *r = &rt->r[rnd() % rt->count];
+
+			for (j = 0; j < r->plen; j++) {
+				unsigned char	m = 0x80 >> (j % 8);
+
+				a[j / 8] = (a[j / 8] & ~m) | (r->dest[j / 8] & m);
+			}
+		}
+	}
+	return addrs;
+}
+
+/* What findif did before the trie: check every route */
+static const struct findif_route *
+scan(const struct findif_routes *rt, const unsigned char *a)
+{
+	const struct findif_route *best = NULL;
+	int	i;
+
+	for (i = 0; i < rt->count; i++) {
+		const struct findif_route *r = &rt->r[i];
+		unsigned char	d[16];
+
+		memcpy(d, a, sizeof(d));
+		mask_bits(d, r->plen, rt->bits);
+		if (memcmp(d, r->dest, rt->bits / 8) != 0) {
+			continue;
+		}
+		if (best == NULL || r->plen > best->plen
+		||	(r->plen == best->plen && r->metric < best->metric)) {
+			best = r;
+		}
+	}
+	return best;
+}
+
+static int
+bench(int count, int bits, int nlookups)
+{
+	struct findif_routes	rt;
+	unsigned char	*addrs;
+	const struct findif_route *r;
+	double	t0, t_build, t_lookup, t_scan;
+	unsigned long	sink = 0;
+	int	nscan, i, errors = 0;
+
+	memset(&rt, 0, sizeof(rt));
+	rt.bits = bits;
+	make_table(&rt, count, bits);
+	addrs = make_addrs(&rt, nlookups, bits);
+
+	t0 = now_ms();
+	if (LPMBuild(&rt, bits) < 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	t_build = now_ms() - t0;
+
+	t0 = now_ms();
+	for (i = 0; i < nlookups; i++) {
+		r = LPMLookup(&rt, addrs + (size_t)i * 16, NULL);
+		sink += r ? (unsigned long)r->plen : 0;
+	}
+	t_lookup = now_ms() - t0;
+
+	nscan = SCAN_BUDGET / count;
+	nscan = nscan < 100 ? 100 : nscan > SCAN_LOOKUPS ? SCAN_LOOKUPS : nscan;
+	nscan = nlookups < nscan ? nlookups : nscan;
+	t0 = now_ms();
+	for (i = 0; i < nscan; i++) {
+		const unsigned char *a = addrs + (size_t)i * 16;
+
+		r = scan(&rt, a);
+		if (r != LPMLookup(&rt, a, NULL)) {
+			errors++;
+		}
+	}
+	t_scan = now_ms() - t0;
+
+	printf("IPv%d\t%8d\t%8d\t%9.1f\t%11.0f\t%9.0f\t%9.1f\n"
+	,	bits == 32 ? 4 : 6, count, rt.nnodes, t_build
+	,	nlookups / (t_lookup / 1000.0)
+	,	nscan / (t_scan / 1000.0)
+	,	LPMMemory(&rt) / 1024.0);
+	if (errors) {
+		printf("IPv%d\t%8d\tMISMATCH: %d of %d lookups differ from"
+		" the linear scan\n", bits == 32 ? 4 : 6, count, errors, nscan);
+	}
+	if (sink == 0) {
+		printf("(no routes matched)\n");
+	}
+
+	free(addrs);
+	LPMFree(&rt);
+	return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+	static int	defaults[] = { 1000, 10000, 100000, 1000000 };
+	int	bits = 32;
+	int	nlookups = DEFAULT_LOOKUPS;
+	int	errors = 0;
+	int	c, i;
+
+	while ((c = getopt(argc, argv, "6n:")) != -1) {
+		switch (c) {
+		case '6':
+			bits = 128;
+			break;
+		case 'n':
+			nlookups = atoi(optarg);
+			if (nlookups > 0) {
+				break;
+			}
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-6] [-n lookups]"
+			" [routes...]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	printf("family\t  routes\t   nodes\t build_ms\t  lookups/s"
+	"\t   scan/s\tmemory_KiB\n");
+	if (optind == argc) {
+		for (i = 0; i < (int)(sizeof(defaults) / sizeof(defaults[0])); i++) {
+			errors += bench(defaults[i], bits, nlookups);
+		}
+	}else{
+		for (i = optind; i < argc; i++) {
+			int	count = atoi(argv[i]);
+
+			if (count < 1) {
+				fprintf(stderr, "Invalid number of routes [%s]\n"
+				,	argv[i]);
+				return 2;
+			}
+			errors += bench(count, bits, nlookups);
+		}
+	}
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * findif_lpm.c:	Route snapshot and longest prefix match for findif
+ *
+ *	The routes are read once into an array, and a path-compressed
+ *	binary trie (a PATRICIA trie) is built over it.  A lookup walks
+ *	at most one node per distinct prefix length on the path to the
+ *	address, instead of checking every route, and only compares the
+ *	bits the trie skipped since the previous node.
+ *
+ *	Nodes hold no key bytes of their own: the key of a node is the
+ *	destination of one of the routes below it.  That keeps a node at
+ *	20 bytes, with at most two nodes per route.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "findif_lpm.h"
+
+#define	BIT(a, pos)	(((a)[(pos) / 8] >> (7 - (pos) % 8)) & 1)
+
+struct findif_route *
+LPMAddRoute(struct findif_routes *rt)
+{
+	if (rt->count == rt->alloc) {
+		int n = rt->alloc ? rt->alloc * 2 : 64;
+		struct findif_route *r = realloc(rt->r, n * sizeof(*r));
+
+		if (r == NULL) {
+			return(NULL);
+		}
+		rt->r = r;
+		rt->alloc = n;
+	}
+	memset(&rt->r[rt->count], 0, sizeof(rt->r[0]));
+	rt->r[rt->count].next = -1;
+	return(&rt->r[rt->count++]);
+}
+
+/* Do a and d agree on bits [from, to)? */
+static int
+BitsMatch(const unsigned char *a, const unsigned char *d, int from, int to)
+{
+	int	i;
+
+	for (i = from / 8; i * 8 < to; i++) {
+		unsigned char	m = 0xff;
+
+		if (i == from / 8) {
+			m &= 0xff >> (from % 8);
+		}
+		if ((i + 1) * 8 > to) {
+			m &= 0xff << ((i + 1) * 8 - to);
+		}
+		if ((a[i] ^ d[i]) & m) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Number of leading bits a and d have in common, up to max */
+static int
+CommonBits(const unsigned char *a, const unsigned char *d, int max)
+{
+	int	n = 0;
+
+	while (n < max && a[n / 8] == d[n / 8]) {
+		n += 8;
+	}
+	while (n < max && BIT(a, n) == BIT(d, n)) {
+		n++;
+	}
+	return n < max ? n : max;
+}
+
+static int
+NewNode(struct findif_routes *rt, int key, int plen, int route)
+{
+	struct findif_lpm_node *n;
+
+	if (rt->nnodes == rt->nalloc) {
+		int na = rt->nalloc ? rt->nalloc * 2 : 64;
+
+		n = realloc(rt->nodes, na * sizeof(*n));
+		if (n == NULL) {
+			return -1;
+		}
+		rt->nodes = n;
+		rt->nalloc = na;
+	}
+	n = &rt->nodes[rt->nnodes];
+	n->child[0] = n->child[1] = -1;
+	n->key = key;
+	n->plen = plen;
+	n->route = route;
+	return rt->nnodes++;
+}
+
+/* Chain route i into the node's list, keeping it sorted by metric */
+static void
+ChainRoute(struct findif_routes *rt, struct findif_lpm_node *n, int i)
+{
+	int	*p = &n->route;
+
+	while (*p >= 0 && rt->r[*p].metric <= rt->r[i].metric) {
+		p = &rt->r[*p].next;
+	}
+	rt->r[i].next = *p;
+	*p = i;
+}
+
+static int
+InsertRoute(struct findif_routes *rt, int i)
+{
+	const unsigned char *d = rt->r[i].dest;
+	int	p = rt->r[i].plen;
+	int	parent = -1, side = 0;
+	int	cur = rt->root;
+
+	for (;;) {
+		struct findif_lpm_node *n;
+		int	common, split, leaf;
+
+		if (cur < 0) {
+			if ((leaf = NewNode(rt, i, p, i)) < 0) {
+				return -1;
+			}
+			if (parent < 0) {
+				rt->root = leaf;
+			}else{
+				rt->nodes[parent].child[side] = leaf;
+			}
+			return 0;
+		}
+
+		n = &rt->nodes[cur];
+		common = CommonBits(d, rt->r[n->key].dest
+		,	p < n->plen ? p : n->plen);
+		if (common == n->plen) {
+			if (p == n->plen) {
+				ChainRoute(rt, n, i);
+				return 0;
+			}
+			parent = cur;
+			side = BIT(d, n->plen);
+			cur = n->child[side];
+			continue;
+		}
+
+		/*
+		 * The new prefix leaves the path of this node at bit
+		 * common: put a node for those common bits above it.
+		 */
+		split = NewNode(rt, i, common, common == p ? i : -1);
+		if (split < 0) {
+			return -1;
+		}
+		n = &rt->nodes[cur];
+		rt->nodes[split].child[BIT(rt->r[n->key].dest, common)] = cur;
+		if (common < p) {
+			if ((leaf = NewNode(rt, i, p, i)) < 0) {
+				return -1;
+			}
+			rt->nodes[split].child[BIT(d, common)] = leaf;
+		}
+		if (parent < 0) {
+			rt->root = split;
+		}else{
+			rt->nodes[parent].child[side] = split;
+		}
+		return 0;
+	}
+}
+
+int
+LPMBuild(struct findif_routes *rt, int bits)
+{
+	int	i;
+
+	rt->bits = bits;
+	rt->root = -1;
+	rt->nnodes = 0;
+	for (i = 0; i < rt->count; i++) {
+		if (InsertRoute(rt, i) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+const struct findif_route *
+LPMLookup(const struct findif_routes *rt, const unsigned char *addr
+,	const char *ifname)
+{
+	const struct findif_route *best = NULL;
+	int	checked = 0;
+	int	cur = rt->root;
+
+	while (cur >= 0) {
+		const struct findif_lpm_node *n = &rt->nodes[cur];
+		int	i;
+
+		if (!BitsMatch(addr, rt->r[n->key].dest, checked, n->plen)) {
+			break;
+		}
+		checked = n->plen;
+		for (i = n->route; i >= 0; i = rt->r[i].next) {
+			if (ifname == NULL || strcmp(rt->r[i].ifname, ifname) == 0) {
+				best = &rt->r[i];
+				break;
+			}
+		}
+		if (n->plen >= rt->bits) {
+			break;
+		}
+		cur = n->child[BIT(addr, n->plen)];
+	}
+	return best;
+}
+
+size_t
+LPMMemory(const struct findif_routes *rt)
+{
+	return rt->alloc * sizeof(rt->r[0]) + rt->nalloc * sizeof(rt->nodes[0]);
+}
+
+void
+LPMFree(struct findif_routes *rt)
+{
+	free(rt->r);
+	free(rt->nodes);
+	memset(rt, 0, sizeof(*rt));
+}
@@ -0,0 +1,68 @@
+/*
+ * findif_lpm.h:	Route snapshot and longest prefix match for findif
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef FINDIF_LPM_H
+#define FINDIF_LPM_H
+
+#include <sys/types.h>
+#include <net/if.h>
+
+/*
+ * One route of the snapshot.  Routes with the same prefix are chained
+ * through next, lowest metric first.
+ */
+struct findif_route {
+	unsigned char	dest[16];	/* network byte order, masked */
+	int		plen;
+	unsigned long	metric;
+	int		next;
+	char		ifname[IFNAMSIZ];
+};
+
+/*
+ * A node of the path-compressed binary trie.  Its prefix is the first
+ * plen bits of the destination of route key; route is the head of the
+ * chain of routes for exactly this prefix, or -1 for a branch point.
+ */
+struct findif_lpm_node {
+	int		child[2];
+	int		route;
+	int		key;
+	int		plen;
+};
+
+struct findif_routes {
+	int			loaded;
+	int			bits;	/* 32 or 128 */
+	int			count;
+	int			alloc;
+	struct findif_route	*r;
+	int			root;
+	int			nnodes;
+	int			nalloc;
+	struct findif_lpm_node	*nodes;
+};
+
+struct findif_route *LPMAddRoute(struct findif_routes *rt);
+int LPMBuild(struct findif_routes *rt, int bits);
+const struct findif_route *LPMLookup(const struct findif_routes *rt
+,	const unsigned char *addr, const char *ifname);
+size_t LPMMemory(const struct findif_routes *rt);
+void LPMFree(struct findif_routes *rt);
+
+#endif /* FINDIF_LPM_H */
@@ -38,8 +38,13 @@
 #include <net/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/if_vlan.h>
 #include <net/if_arp.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #ifdef CAPABILITIES
 #include <sys/prctl.h>
 #include <sys/capability.h>
@@ -47,6 +52,7 @@
 
 #include <netdb.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
@@ -103,6 +109,8 @@ int dad, unsolicited, advert;
 int quiet;
 int count=-1;
 int timeout;
+struct timeval interval = { 1, 0 };
+int timer_fd = -1;
 int unicasting;
 int s;
 int broadcast_only;
@@ -115,6 +123,80 @@ struct timeval start, last;
 int sent, brd_sent;
 int received, brd_recv, req_recv;
 
+/*
+ * Multi-target mode: a gratuitous ARP for each of a list of addresses,
+ * each on its own device, or without -U and -A a probe of all of them
+ * that succeeds on the first reply.  The frames are built once, and
+ * every round sends them all with a few sendmmsg() calls on the one
+ * socket.
+ */
+#define SEND_BATCH	1024
+
+struct target {
+	struct in_addr ip;
+	const char *ifname;
+	int dev;			/* in target_devices */
+	struct in_addr src;
+	struct sockaddr_storage he;
+	unsigned char frame[128];
+	int len;
+	int replied;
+	long rtt;			/* usecs from the round to the first reply */
+};
+
+/*
+ * With -L, an announcement on a bond or a VLAN also goes out on each
+ * device below it, with the tags of the VLANs on the way (see
+ * find_fanout()).
+ */
+#define FANOUT_MAX	64
+#define FANOUT_DEPTH	4
+
+struct fanout_dev {
+	char name[IFNAMSIZ];
+	int ifindex;
+	int ntags;
+	unsigned short tags[FANOUT_DEPTH];	/* the innermost first */
+};
+
+struct fanout_frame {
+	struct sockaddr_storage he;
+	unsigned char frame[4 * FANOUT_DEPTH + 128];
+};
+
+/* The link layer addresses of a device the targets are on */
+struct target_device {
+	const char *name;
+	struct sockaddr_storage me, he;
+	struct fanout_dev *lower;
+	int nlower;
+};
+
+char *targets_file;
+struct target *targets;
+int ntargets;
+struct target_device *target_devices;
+int ntarget_devices;
+struct mmsghdr *target_msgs;
+struct iovec *target_iov;
+int nmsgs;
+int fanout;
+struct fanout_frame *fanout_frames;
+
+/*
+ * Conflict watch mode: every ARP claiming our address from another
+ * hardware address is counted, and answered with a burst of count
+ * announcements, one every interval, at most one burst per
+ * BURST_HOLDOFF seconds.
+ */
+#define BURST_DEFAULT	3
+#define BURST_HOLDOFF	1
+
+int watch;
+int conflicts;
+int burst_left;
+struct timeval burst_start;
+
 #ifndef CAPABILITIES
 static uid_t euid;
 #endif
@@ -141,7 +223,7 @@ static char print_usage[]={
 "              device src_ip_addr src_hw_addr broadcast_ip_addr netmask\n"
 "\n"
 "  where:\n"
-"    repeatinterval-ms: ignored\n"
+"    repeatinterval-ms: time between ARP packets, in milliseconds (1000)\n"
 "\n"
 "    repeatcount: how many ARP packets to send.\n"
 "\n"
@@ -158,6 +240,27 @@ static char print_usage[]={
 "\n"
 "    netmask: ignored\n"
 "\n"
+"  usage: send_arp [-U|-A] [-c count] [-w timeout] [-W interval] [-I device] \\\n"
+"              [-s source] [-T file] ip[@device]...\n"
+"\n"
+"    sends gratuitous ARPs (-U, -A) or ARP requests for all the addresses at\n"
+"    once, each on its device or on the -I one.  Requests succeed on the\n"
+"    first reply, and fail when the -w timeout is over for all of them.\n"
+"    -T file (\"-\" for stdin) reads more addresses from a file, separated\n"
+"    by blanks or newlines.  -W is the time between the rounds, in seconds\n"
+"    (1, down to 0.001).\n"
+"\n"
+"    With -L, the announcements also go out on every bond slave and VLAN\n"
+"    parent below the device, VLAN tagged as they need to be.  -L can be\n"
+"    given in the usage above as well.\n"
+"\n"
+"  usage: send_arp -C [-A] [-c count] [-w timeout] [-W interval] [-I device] ip\n"
+"\n"
+"    watches for ARP from other hosts claiming ip, logs each of them, and\n"
+"    answers with count (3) announcements, -W apart, at most a burst a\n"
+"    second.  Runs until -w timeout or SIGINT or SIGTERM, and exits with 1\n"
+"    if there were conflicts.\n"
+"\n"
 "  Notes: Other options of iputils-arping may be accepted but it's not\n"
 "         intended to be supported in this binary.\n"
 "\n"
@@ -174,38 +277,32 @@ void usage(void)
 void usage(void)
 {
 	fprintf(stderr,
-		"Usage: arping [-fqbDUAV] [-c count] [-w timeout] [-I device] [-s source] destination\n"
+		"Usage: arping [-fqbDUACLV] [-c count] [-w timeout] [-W interval] [-I device] [-s source] destination\n"
 		"  -f : quit on first reply\n"
 		"  -q : be quiet\n"
 		"  -b : keep broadcasting, don't go unicast\n"
 		"  -D : duplicate address detection mode\n"
 		"  -U : Unsolicited ARP mode, update your neighbours\n"
 		"  -A : ARP answer mode, update your neighbours\n"
+		"  -C : watch for others claiming destination, answer with count (3) announcements\n"
+		"  -L : with -U or -A, also announce on the bond slaves and VLAN parents of the device\n"
 		"  -V : print version and exit\n"
 		"  -c count : how many packets to send\n"
 		"  -w timeout : how long to wait for a reply\n"
+		"  -W interval : seconds between packets (1, down to 0.001)\n"
 		"  -I device : which ethernet device to use"
 #ifdef DEFAULT_DEVICE_STR
 			" (" DEFAULT_DEVICE_STR ")"
 #endif
 			"\n"
 		"  -s source : source ip address\n"
-		"  destination : ask for what ip address\n"
+		"  -T file : more destinations from a file (- for stdin)\n"
+		"  destination : ask for what ip address; or several ip[@device], done on the first reply\n"
 		);
 	exit(2);
 }
 #endif /* hb_mode */
 
-static void set_signal(int signo, void (*handler)(void))
-{
-	struct sigaction sa;
-
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = (void (*)(int))handler;
-	sa.sa_flags = SA_RESTART;
-	sigaction(signo, &sa, NULL);
-}
-
 #ifdef CAPABILITIES
 static const cap_value_t caps[] = { CAP_NET_RAW, };
 static cap_flag_value_t cap_raw = CAP_CLEAR;
@@ -325,12 +422,9 @@ static void drop_capabilities(void)
 #endif
 }
 
-static int send_pack(int s, struct in_addr src, struct in_addr dst,
+static int build_pack(unsigned char *buf, struct in_addr src, struct in_addr dst,
 	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
 {
-	int err;
-	struct timeval now;
-	unsigned char buf[256];
 	struct arphdr *ah = (struct arphdr*)buf;
 	unsigned char *p = (unsigned char *)(ah+1);
 
@@ -357,9 +451,21 @@ static int send_pack(int s, struct in_addr src, struct in_addr dst,
 	memcpy(p, &dst, 4);
 	p+=4;
 
+	return p-buf;
+}
+
+static int send_pack(int s, struct in_addr src, struct in_addr dst,
+	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	int err, len;
+	struct timeval now;
+	unsigned char buf[256];
+
+	len = build_pack(buf, src, dst, ME, HE);
+
 	gettimeofday(&now, NULL);
-	err = sendto(s, buf, p-buf, 0, (struct sockaddr*)HE, SLL_LEN(ah->ar_hln));
-	if (err == p-buf) {
+	err = sendto(s, buf, len, 0, (struct sockaddr*)HE, SLL_LEN(ME->sll_halen));
+	if (err == len) {
 		last = now;
 		sent++;
 		if (!unicasting)
@@ -368,9 +474,74 @@ static int send_pack(int s, struct in_addr src, struct in_addr dst,
 	return err;
 }
 
+/*
+ * One round of the multi-target mode: the frames are all built, so it
+ * is a sendmmsg() per SEND_BATCH targets.  A frame the kernel refuses
+ * is skipped, and the rest of the round is still sent.
+ */
+static void send_targets(void)
+{
+	struct timeval now;
+	int i, n;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < nmsgs; i += n) {
+		n = sendmmsg(s, target_msgs + i, MIN(nmsgs - i, SEND_BATCH), 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			perror("arping: sendmmsg");
+			n = 1;
+			continue;
+		}
+		sent += n;
+		brd_sent += n;
+	}
+	last = now;
+}
+
+/* Frames the kernel had for us, and dropped as the socket buffer was full */
+static void print_drops(void)
+{
+	struct tpacket_stats st;
+	socklen_t len = sizeof(st);
+
+	if (getsockopt(s, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0 && st.tp_drops)
+		printf("Dropped %u frame(s) in the kernel\n", st.tp_drops);
+}
+
+/* How long each target of a probe took to answer */
+static void print_targets(void)
+{
+	int i;
+
+	for (i = 0; i < ntargets; i++) {
+		struct target *t = &targets[i];
+
+		printf("%s %s ", inet_ntoa(t->ip), t->ifname);
+		if (t->replied)
+			printf("%ld.%03ldms\n", t->rtt / 1000, t->rtt % 1000);
+		else
+			printf("no reply\n");
+	}
+}
+
 static void finish(void)
 {
+	if (watch) {
+		if (!quiet) {
+			printf("Sent %d announcement(s)\n", sent);
+			printf("Detected %d conflict(s)\n", conflicts);
+			print_drops();
+		}
+		fflush(stdout);
+		exit(!!conflicts);
+	}
 	if (!quiet) {
+		if (ntargets && !unsolicited)
+			print_targets();
 		printf("Sent %d probes (%d broadcast(s))\n", sent, brd_sent);
 		printf("Received %d response(s)", received);
 		if (brd_recv || req_recv) {
@@ -384,6 +555,7 @@ static void finish(void)
 			printf(")");
 		}
 		printf("\n");
+		print_drops();
 		fflush(stdout);
 	}
 	fflush(stdout);
@@ -394,7 +566,8 @@ static void finish(void)
 	exit(!received);
 }
 
-static void catcher(void)
+/* Every interval: give up, or send the next probe or round of announcements */
+static void tick(void)
 {
 	struct timeval tv, tv_s, tv_o;
 
@@ -407,19 +580,33 @@ static void catcher(void)
 	tv_o.tv_sec = timeout;
 	tv_o.tv_usec = 500 * 1000;
 
+	if (watch) {
+		if (timeout && timercmp(&tv_s, &tv_o, >))
+			finish();
+		if (burst_left > 0) {
+			send_pack(s, src, dst,
+				  (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
+			burst_left--;
+		}
+		return;
+	}
+
 	if (count-- == 0 || (timeout && timercmp(&tv_s, &tv_o, >)))
 		finish();
 
 	timersub(&tv, &last, &tv_s);
-	tv_o.tv_sec = 0;
+	tv_o.tv_sec = interval.tv_sec / 2;
+	tv_o.tv_usec = (interval.tv_sec % 2 * 1000000 + interval.tv_usec) / 2;
 
 	if (last.tv_sec==0 || timercmp(&tv_s, &tv_o, >)) {
-		send_pack(s, src, dst,
-			  (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
+		if (ntargets)
+			send_targets();
+		else
+			send_pack(s, src, dst,
+				  (struct sockaddr_ll *)&me, (struct sockaddr_ll *)&he);
 		if (count == 0 && unsolicited)
 			finish();
 	}
-	alarm(1);
 }
 
 static void print_hex(unsigned char *p, int len)
@@ -539,6 +726,400 @@ static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 	return 1;
 }
 
+/*
+ * recv_pack() for the probe of several targets: a reply from one of
+ * them, to the address and device we asked from.
+ */
+static int recv_probe(unsigned char *buf, int len, struct sockaddr_ll *FROM)
+{
+	struct timeval tv;
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct in_addr src_ip, dst_ip;
+	struct sockaddr_ll *ME;
+	struct target *t = NULL;
+	int i;
+
+	gettimeofday(&tv, NULL);
+
+	if (FROM->sll_pkttype != PACKET_HOST &&
+	    FROM->sll_pkttype != PACKET_BROADCAST &&
+	    FROM->sll_pkttype != PACKET_MULTICAST)
+		return 0;
+	if (ah->ar_op != htons(ARPOP_REQUEST) &&
+	    ah->ar_op != htons(ARPOP_REPLY))
+		return 0;
+	if (ah->ar_pro != htons(ETH_P_IP) || ah->ar_pln != 4)
+		return 0;
+	if (len < sizeof(*ah) + 2*(4 + ah->ar_hln))
+		return 0;
+	memcpy(&src_ip, p+ah->ar_hln, 4);
+	memcpy(&dst_ip, p+ah->ar_hln+4+ah->ar_hln, 4);
+
+	for (i = 0; i < ntargets; i++) {
+		ME = (struct sockaddr_ll *)&target_devices[targets[i].dev].me;
+		if (targets[i].ip.s_addr == src_ip.s_addr &&
+		    targets[i].src.s_addr == dst_ip.s_addr &&
+		    ME->sll_ifindex == FROM->sll_ifindex) {
+			t = &targets[i];
+			break;
+		}
+	}
+	if (!t)
+		return 0;
+	if (ah->ar_hrd != htons(FROM->sll_hatype) &&
+	    (FROM->sll_hatype != ARPHRD_FDDI || ah->ar_hrd != htons(ARPHRD_ETHER)))
+		return 0;
+	if (ah->ar_hln != ME->sll_halen)
+		return 0;
+	if (memcmp(p+ah->ar_hln+4, ME->sll_addr, ah->ar_hln))
+		return 0;
+
+	if (!t->replied) {
+		t->replied = 1;
+		t->rtt = (tv.tv_sec-last.tv_sec) * 1000000 + tv.tv_usec-last.tv_usec;
+	}
+	if (!quiet) {
+		printf("%s ", FROM->sll_pkttype==PACKET_HOST ? "Unicast" : "Broadcast");
+		printf("%s from ", ah->ar_op == htons(ARPOP_REPLY) ? "reply" : "request");
+		printf("%s [", inet_ntoa(src_ip));
+		print_hex(p, ah->ar_hln);
+		printf("] %s %ld.%03ldms\n", t->ifname, t->rtt / 1000, t->rtt % 1000);
+		fflush(stdout);
+	}
+	received++;
+	if (FROM->sll_pkttype != PACKET_HOST)
+		brd_recv++;
+	if (ah->ar_op == htons(ARPOP_REQUEST))
+		req_recv++;
+	if (quit_on_reply)
+		finish();
+	return 1;
+}
+
+/* Start the interval over from now */
+static void arm_timer(void)
+{
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = interval.tv_sec;
+	its.it_interval.tv_nsec = interval.tv_usec * 1000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		perror("arping: timerfd_settime");
+		exit(2);
+	}
+}
+
+/*
+ * recv_pack() for the conflict watch: a request or reply from another
+ * hardware address, with our address as its sender.  The first
+ * announcement of the burst goes out at once, the others on the timer.
+ */
+static int recv_conflict(unsigned char *buf, int len, struct sockaddr_ll *FROM)
+{
+	struct timeval tv, tv_s;
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct sockaddr_ll *ME = (struct sockaddr_ll *)&me;
+	struct in_addr src_ip;
+
+	gettimeofday(&tv, NULL);
+
+	if (FROM->sll_pkttype != PACKET_HOST &&
+	    FROM->sll_pkttype != PACKET_BROADCAST &&
+	    FROM->sll_pkttype != PACKET_MULTICAST)
+		return 0;
+	if (ah->ar_op != htons(ARPOP_REQUEST) &&
+	    ah->ar_op != htons(ARPOP_REPLY))
+		return 0;
+	if (ah->ar_pro != htons(ETH_P_IP) || ah->ar_pln != 4)
+		return 0;
+	if (ah->ar_hln != ME->sll_halen)
+		return 0;
+	if (len < sizeof(*ah) + 2*(4 + ah->ar_hln))
+		return 0;
+	memcpy(&src_ip, p+ah->ar_hln, 4);
+	if (src_ip.s_addr != dst.s_addr)
+		return 0;
+	if (memcmp(p, ME->sll_addr, ah->ar_hln) == 0)
+		return 0;
+
+	conflicts++;
+	if (!quiet) {
+		printf("Conflict: %s claimed by [", inet_ntoa(src_ip));
+		print_hex(p, ah->ar_hln);
+		printf("] in a %s\n", ah->ar_op == htons(ARPOP_REPLY) ? "reply" : "request");
+		fflush(stdout);
+	}
+
+	timersub(&tv, &burst_start, &tv_s);
+	if (!count || burst_left > 0 || (burst_start.tv_sec && tv_s.tv_sec < BURST_HOLDOFF))
+		return 1;
+	burst_start = tv;
+	send_pack(s, src, dst, ME, (struct sockaddr_ll *)&he);
+	burst_left = count - 1;
+	arm_timer();
+	return 1;
+}
+
+/*
+ * The socket filter: the tests of recv_pack() that do not depend on the
+ * frames received so far, so that the rest of the ARP traffic on the
+ * segment is not even copied to us.  recv_pack() still does them all.
+ * The jumps to DROP are patched once the program is complete.
+ */
+#define FILTER_MAX	160
+#define FILTER_DROP	0xff
+#define FILTER_TARGETS	128	/* jumps over the rest of the list must fit in 8 bits */
+
+static struct sock_filter filter[FILTER_MAX];
+static int filter_len;
+
+static void filter_stmt(unsigned short code, unsigned int k)
+{
+	filter[filter_len++] = (struct sock_filter)BPF_STMT(code, k);
+}
+
+static void filter_jump(unsigned short code, unsigned int k, unsigned char jt, unsigned char jf)
+{
+	filter[filter_len++] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+}
+
+/*
+ * Compare the len bytes at off with addr, a word at a time.  If want is
+ * 1, any difference drops the frame; if 0, all the bytes being the same
+ * does.
+ */
+static void filter_addr(unsigned int off, const unsigned char *addr, int len, int want)
+{
+	int i, n, left, chunks = 0;
+	unsigned int k;
+
+	for (left = len; left > 0; left -= left >= 4 ? 4 : left >= 2 ? 2 : 1)
+		chunks++;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i >= 4 ? 4 : len - i >= 2 ? 2 : 1;
+		for (k = 0, left = 0; left < n; left++)
+			k = k << 8 | addr[i + left];
+		filter_stmt(BPF_LD | (n == 4 ? BPF_W : n == 2 ? BPF_H : BPF_B) | BPF_ABS, off + i);
+		chunks--;
+		if (want)
+			filter_jump(BPF_JMP | BPF_JEQ | BPF_K, k, 0, FILTER_DROP);
+		else if (chunks)
+			filter_jump(BPF_JMP | BPF_JEQ | BPF_K, k, 0, 2 * chunks);
+		else
+			filter_jump(BPF_JMP | BPF_JEQ | BPF_K, k, FILTER_DROP, 0);
+	}
+}
+
+/* Accept what gets to the end, point the jumps to DROP at the drop, and attach */
+static void filter_install(void)
+{
+	struct sock_fprog prog;
+	int i, drop;
+
+	filter_stmt(BPF_RET | BPF_K, 0xffff);
+	drop = filter_len;
+	filter_stmt(BPF_RET | BPF_K, 0);
+
+	for (i = 0; i < drop; i++) {
+		if (BPF_CLASS(filter[i].code) != BPF_JMP)
+			continue;
+		if (filter[i].jt == FILTER_DROP)
+			filter[i].jt = drop - i - 1;
+		if (filter[i].jf == FILTER_DROP)
+			filter[i].jf = drop - i - 1;
+	}
+
+	prog.len = filter_len;
+	prog.filter = filter;
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		perror("WARNING: setsockopt(SO_ATTACH_FILTER)");
+}
+
+static void attach_filter(void)
+{
+	struct sockaddr_ll *ME = (struct sockaddr_ll *)&me;
+	unsigned int hln = ME->sll_halen;
+
+	filter_len = 0;
+
+	/* not our own frames, nor those for other hosts */
+	filter_stmt(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	filter_jump(BPF_JMP | BPF_JGT | BPF_K, PACKET_MULTICAST, FILTER_DROP, 0);
+
+	filter_stmt(BPF_LD | BPF_H | BPF_ABS, OFFSET_OF(struct arphdr, ar_hrd));
+	if (ME->sll_hatype == ARPHRD_FDDI)
+		filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ARPHRD_ETHER, 1, 0);
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ME->sll_hatype, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_H | BPF_ABS, OFFSET_OF(struct arphdr, ar_pro));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_B | BPF_ABS, OFFSET_OF(struct arphdr, ar_hln));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, hln, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_B | BPF_ABS, OFFSET_OF(struct arphdr, ar_pln));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_H | BPF_ABS, OFFSET_OF(struct arphdr, ar_op));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REQUEST, 1, 0);
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, FILTER_DROP);
+
+	/* sender ip */
+	filter_stmt(BPF_LD | BPF_W | BPF_ABS, sizeof(struct arphdr) + hln);
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(dst.s_addr), 0, FILTER_DROP);
+	if (!dad && !watch) {
+		/* target ip and hardware address */
+		filter_stmt(BPF_LD | BPF_W | BPF_ABS, sizeof(struct arphdr) + 2 * hln + 4);
+		filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(src.s_addr), 0, FILTER_DROP);
+		filter_addr(sizeof(struct arphdr) + hln + 4, ME->sll_addr, hln, 1);
+	} else {
+		/* not from us, and in DAD for the source we probed from if any */
+		filter_addr(sizeof(struct arphdr), ME->sll_addr, hln, 0);
+		if (dad && src.s_addr) {
+			filter_stmt(BPF_LD | BPF_W | BPF_ABS, sizeof(struct arphdr) + 2 * hln + 4);
+			filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(src.s_addr), 0, FILTER_DROP);
+		}
+	}
+
+	filter_install();
+}
+
+/*
+ * The probe of several targets: any device, so only the tests that do
+ * not depend on the address lengths, and the sender being one of the
+ * targets if there are not too many of them.
+ */
+static void attach_probe_filter(void)
+{
+	int i;
+
+	filter_len = 0;
+
+	filter_stmt(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+	filter_jump(BPF_JMP | BPF_JGT | BPF_K, PACKET_MULTICAST, FILTER_DROP, 0);
+	filter_stmt(BPF_LD | BPF_H | BPF_ABS, OFFSET_OF(struct arphdr, ar_pro));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_B | BPF_ABS, OFFSET_OF(struct arphdr, ar_pln));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, 4, 0, FILTER_DROP);
+	filter_stmt(BPF_LD | BPF_H | BPF_ABS, OFFSET_OF(struct arphdr, ar_op));
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REQUEST, 1, 0);
+	filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, FILTER_DROP);
+
+	if (ntargets <= FILTER_TARGETS) {
+		/* the sender ip is after the sender hardware address */
+		filter_stmt(BPF_LD | BPF_B | BPF_ABS, OFFSET_OF(struct arphdr, ar_hln));
+		filter_stmt(BPF_MISC | BPF_TAX, 0);
+		filter_stmt(BPF_LD | BPF_W | BPF_IND, sizeof(struct arphdr));
+		for (i = 0; i < ntargets - 1; i++)
+			filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(targets[i].ip.s_addr),
+				    ntargets - 1 - i, 0);
+		filter_jump(BPF_JMP | BPF_JEQ | BPF_K, ntohl(targets[i].ip.s_addr),
+			    0, FILTER_DROP);
+	}
+
+	filter_install();
+}
+
+/*
+ * Wait for the interval timer, the ARP socket and SIGINT in one epoll
+ * set.  Nothing runs in a signal handler, so nothing needs masking
+ * around recv_pack().  Does not return: tick(), recv_pack() or SIGINT
+ * end up in finish().
+ */
+static void event_loop(void)
+{
+	struct epoll_event ev, events[3];
+	sigset_t sset;
+	int ep, tfd, sfd, i, n;
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGINT);
+	/* the watch runs until it is stopped, and then reports what it saw */
+	if (watch)
+		sigaddset(&sset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+	sfd = signalfd(-1, &sset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		perror("arping: signalfd");
+		exit(2);
+	}
+
+	tfd = timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("arping: timerfd_create");
+		exit(2);
+	}
+	arm_timer();
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		perror("arping: epoll_create1");
+		exit(2);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) < 0)
+		goto ctl_failed;
+	ev.data.fd = sfd;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev) < 0)
+		goto ctl_failed;
+	ev.data.fd = s;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) < 0)
+		goto ctl_failed;
+
+	tick();
+
+	while(1) {
+		n = epoll_wait(ep, events, 3, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("arping: epoll_wait");
+			exit(2);
+		}
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == tfd) {
+				uint64_t expired;
+
+				if (read(tfd, &expired, sizeof(expired)) == sizeof(expired))
+					tick();
+			} else if (fd == sfd) {
+				finish();
+			} else {
+				unsigned char packet[4096];
+				struct sockaddr_storage from;
+				socklen_t alen;
+				int cc;
+
+				/* take all there is, a reply may be behind a lot of chatter */
+				for (;;) {
+					alen = sizeof(from);
+					cc = recvfrom(s, packet, sizeof(packet), MSG_DONTWAIT,
+						      (struct sockaddr *)&from, &alen);
+					if (cc < 0) {
+						if (errno != EAGAIN && errno != EINTR)
+							perror("arping: recvfrom");
+						break;
+					}
+					if (ntargets)
+						recv_probe(packet, cc, (struct sockaddr_ll *)&from);
+					else if (watch)
+						recv_conflict(packet, cc, (struct sockaddr_ll *)&from);
+					else
+						recv_pack(packet, cc, (struct sockaddr_ll *)&from);
+				}
+			}
+		}
+	}
+
+ctl_failed:
+	perror("arping: epoll_ctl");
+	exit(2);
+}
+
 #ifdef USE_SYSFS
 union sysfs_devattr_value {
 	unsigned long	ulong;
@@ -1059,12 +1640,454 @@ static void set_device_broadcast(struct device *dev, unsigned char *ba, size_t b
 	set_device_broadcast_fallback(dev, ba, balen);
 }
 
+/*
+ * A target is address[@device]; without a device it goes out on the one
+ * of option -I.
+ */
+static void add_target(const char *arg)
+{
+	struct target *t;
+	char *name, *at;
+
+	name = strdup(arg);
+	if (!name) {
+		perror("malloc");
+		exit(2);
+	}
+	at = strchr(name, '@');
+	if (at)
+		*at++ = 0;
+
+	if (!(ntargets & (ntargets - 1))) {
+		t = realloc(targets, (ntargets ? 2 * ntargets : 16) * sizeof(*t));
+		if (!t) {
+			perror("malloc");
+			exit(2);
+		}
+		targets = t;
+	}
+	t = &targets[ntargets];
+	memset(t, 0, sizeof(*t));
+
+	if (inet_aton(name, &t->ip) != 1) {
+		fprintf(stderr, "arping: invalid target %s\n", arg);
+		exit(2);
+	}
+	t->ifname = at && *at ? at : device.name;
+	if (!t->ifname || !*t->ifname) {
+		fprintf(stderr, "arping: no device for target %s\n", arg);
+		exit(2);
+	}
+	ntargets++;
+}
+
+/* Targets separated by blanks or newlines; "#" comments out the rest of a line */
+static void read_targets(const char *file)
+{
+	char line[1024], *p, *tok;
+	FILE *f;
+
+	f = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "arping: %s: %s\n", file, strerror(errno));
+		exit(2);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		p = strchr(line, '#');
+		if (p)
+			*p = 0;
+		for (tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n"))
+			add_target(tok);
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "arping: %s: %s\n", file, strerror(errno));
+		exit(2);
+	}
+	if (f != stdin)
+		fclose(f);
+}
+
+/*
+ * Look up a device as the single target mode does, with a socket bound
+ * to it to learn our link layer address.  The frames all go out on the
+ * main socket, to the ifindex in their sockaddr_ll.
+ */
+static struct target_device *get_target_device(const char *name)
+{
+	struct device saved = device;
+	struct target_device *td;
+	socklen_t alen;
+	int i, fd;
+
+	for (i = 0; i < ntarget_devices; i++) {
+		if (!strcmp(target_devices[i].name, name))
+			return &target_devices[i];
+	}
+
+	td = realloc(target_devices, (ntarget_devices + 1) * sizeof(*td));
+	if (!td) {
+		perror("malloc");
+		exit(2);
+	}
+	target_devices = td;
+	td = &target_devices[ntarget_devices++];
+	memset(td, 0, sizeof(*td));
+	td->name = name;
+
+	memset(&device, 0, sizeof(device));
+	device.name = name;
+	if (find_device() < 0)
+		exit(2);
+	if (!device.ifindex) {
+		fprintf(stderr, "arping: Device %s not available.\n", name);
+		exit(2);
+	}
+
+	enable_capability_raw();
+	fd = socket(PF_PACKET, SOCK_DGRAM, 0);
+	disable_capability_raw();
+	if (fd < 0) {
+		perror("arping: socket");
+		exit(2);
+	}
+	((struct sockaddr_ll *)&td->me)->sll_family = AF_PACKET;
+	((struct sockaddr_ll *)&td->me)->sll_ifindex = device.ifindex;
+	((struct sockaddr_ll *)&td->me)->sll_protocol = htons(ETH_P_ARP);
+	if (bind(fd, (struct sockaddr*)&td->me, sizeof(td->me)) == -1) {
+		perror("bind");
+		exit(2);
+	}
+	alen = sizeof(td->me);
+	if (getsockname(fd, (struct sockaddr*)&td->me, &alen) == -1) {
+		perror("getsockname");
+		exit(2);
+	}
+	close(fd);
+	if (((struct sockaddr_ll *)&td->me)->sll_halen == 0) {
+		if (!quiet)
+			printf("Interface \"%s\" is not ARPable (no ll address)\n", name);
+		exit(2);
+	}
+
+	td->he = td->me;
+	set_device_broadcast(&device, ((struct sockaddr_ll *)&td->he)->sll_addr,
+			     ((struct sockaddr_ll *)&td->he)->sll_halen);
+	device = saved;
+	return td;
+}
+
+/*
+ * The address the kernel sends from to dst on the device, found as
+ * main() finds src for the single target.
+ */
+static struct in_addr route_source(const char *name, struct in_addr dst)
+{
+	struct sockaddr_in saddr;
+	socklen_t alen = sizeof(saddr);
+	int on = 1;
+	int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (probe_fd < 0) {
+		perror("socket");
+		exit(2);
+	}
+	enable_capability_raw();
+	if (setsockopt(probe_fd, SOL_SOCKET, SO_BINDTODEVICE, name, strlen(name)+1) == -1)
+		perror("WARNING: interface is ignored");
+	disable_capability_raw();
+
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(1025);
+	saddr.sin_addr = dst;
+	if (setsockopt(probe_fd, SOL_SOCKET, SO_DONTROUTE, (char*)&on, sizeof(on)) == -1)
+		perror("WARNING: setsockopt(SO_DONTROUTE)");
+	if (connect(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
+		fprintf(stderr, "arping: %s on %s: %s\n", inet_ntoa(dst), name, strerror(errno));
+		exit(2);
+	}
+	if (getsockname(probe_fd, (struct sockaddr*)&saddr, &alen) == -1) {
+		perror("getsockname");
+		exit(2);
+	}
+	close(probe_fd);
+	return saddr.sin_addr;
+}
+
+/*
+ * The devices below a bond or a VLAN, as find_device_by_sysfs() sees
+ * them, but from /sys directly: libsysfs is seldom built in.
+ */
+#define SYSFS_NET	"/sys/class/net"
+
+static int sysfs_net_read(const char *name, const char *attr, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), SYSFS_NET "/%s/%s", name, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	return 0;
+}
+
+static int sysfs_net_is_bond(const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), SYSFS_NET "/%s/bonding", name);
+	return access(path, F_OK) == 0;
+}
+
+static int sysfs_net_is_vlan(const char *name)
+{
+	char uevent[1024];
+
+	if (sysfs_net_read(name, "uevent", uevent, sizeof(uevent)) < 0)
+		return 0;
+	return strstr(uevent, "DEVTYPE=vlan\n") != NULL;
+}
+
+/* The slaves of a bond, or the lower_* links of any other device */
+static int sysfs_net_lower(const char *name, char lower[][IFNAMSIZ], int max)
+{
+	char slaves[4096], path[PATH_MAX], *tok;
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	if (sysfs_net_read(name, "bonding/slaves", slaves, sizeof(slaves)) == 0) {
+		for (tok = strtok(slaves, " \n"); tok && n < max; tok = strtok(NULL, " \n"))
+			snprintf(lower[n++], IFNAMSIZ, "%s", tok);
+		return n;
+	}
+
+	snprintf(path, sizeof(path), SYSFS_NET "/%s", name);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) && n < max) {
+		if (!strncmp(de->d_name, "lower_", 6))
+			snprintf(lower[n++], IFNAMSIZ, "%s", de->d_name + 6);
+	}
+	closedir(dir);
+	return n;
+}
+
+static int vlan_id(const char *name)
+{
+	struct vlan_ioctl_args va;
+	int fd, rc;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&va, 0, sizeof(va));
+	va.cmd = GET_VLAN_VID_CMD;
+	strncpy(va.device1, name, sizeof(va.device1) - 1);
+	rc = ioctl(fd, SIOCGIFVLAN, &va);
+	close(fd);
+	return rc < 0 ? -1 : va.u.VID;
+}
+
+/*
+ * Walk down from name through bonds and VLANs, collecting the devices
+ * that are neither: the bond slaves and VLAN parents that the switches
+ * see.  Each comes with the VLAN tags a frame needs on it.
+ */
+static void find_fanout(const char *name, const unsigned short *tags, int ntags,
+			struct fanout_dev *devs, int *ndevs, int depth)
+{
+	char lower[FANOUT_MAX][IFNAMSIZ];
+	unsigned short t[FANOUT_DEPTH];
+	struct fanout_dev *fd;
+	int i, n, vid;
+
+	memcpy(t, tags, ntags * sizeof(*t));
+	if (sysfs_net_is_bond(name)) {
+		/* down to the slaves, with the same tags */
+	} else if (sysfs_net_is_vlan(name)) {
+		vid = vlan_id(name);
+		if (vid < 0 || ntags == FANOUT_DEPTH) {
+			fprintf(stderr, "arping: no VLAN id for %s, not announcing below it\n", name);
+			return;
+		}
+		t[ntags++] = vid;
+	} else {
+		if (depth == 0 || *ndevs == FANOUT_MAX)
+			return;
+		fd = &devs[(*ndevs)++];
+		snprintf(fd->name, sizeof(fd->name), "%s", name);
+		fd->ifindex = if_nametoindex(name);
+		fd->ntags = ntags;
+		memcpy(fd->tags, t, ntags * sizeof(*t));
+		if (!fd->ifindex)
+			(*ndevs)--;
+		return;
+	}
+
+	if (depth == FANOUT_DEPTH)
+		return;
+	n = sysfs_net_lower(name, lower, FANOUT_MAX);
+	for (i = 0; i < n; i++)
+		find_fanout(lower[i], t, ntags, devs, ndevs, depth + 1);
+}
+
+/* The frame for a device below: the VLAN tags, outermost first, then the ARP */
+static int build_fanout(unsigned char *buf, const struct fanout_dev *fd,
+			const unsigned char *arp, int len)
+{
+	unsigned char *p = buf;
+	unsigned short tci, type;
+	int j;
+
+	for (j = fd->ntags - 1; j >= 0; j--) {
+		tci = htons(fd->tags[j]);
+		type = htons(j ? ETH_P_8021Q : ETH_P_ARP);
+		memcpy(p, &tci, 2);
+		memcpy(p + 2, &type, 2);
+		p += 4;
+	}
+	memcpy(p, arp, len);
+	return p - buf + len;
+}
+
+static void set_msg(int i, void *buf, size_t len, struct sockaddr_ll *to)
+{
+	target_iov[i].iov_base = buf;
+	target_iov[i].iov_len = len;
+	target_msgs[i].msg_hdr.msg_name = to;
+	target_msgs[i].msg_hdr.msg_namelen = SLL_LEN(to->sll_halen);
+	target_msgs[i].msg_hdr.msg_iov = &target_iov[i];
+	target_msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+/* With -L, find the devices below each of the target devices */
+static void setup_fanout(void)
+{
+	struct fanout_dev devs[FANOUT_MAX];
+	struct target_device *td;
+	int i, j, n;
+
+	for (i = 0; i < ntarget_devices; i++) {
+		td = &target_devices[i];
+		n = 0;
+		find_fanout(td->name, NULL, 0, devs, &n, 0);
+		td->lower = malloc(n * sizeof(*devs) + 1);
+		if (!td->lower) {
+			perror("malloc");
+			exit(2);
+		}
+		memcpy(td->lower, devs, n * sizeof(*devs));
+		td->nlower = n;
+		if (quiet)
+			continue;
+		for (j = 0; j < n; j++) {
+			printf("%s also on %s", td->name, devs[j].name);
+			if (devs[j].ntags)
+				printf(" (VLAN %u)", devs[j].tags[0]);
+			printf("\n");
+		}
+		if (!n)
+			printf("%s has no bond slaves or VLAN parents\n", td->name);
+	}
+}
+
+/*
+ * Build the frame of every target, and the messages that send them:
+ * the targets first, then with -L their copies for the devices below.
+ * The probe listens on the one device of its targets, or on all.
+ */
+static void setup_targets(void)
+{
+	struct target_device *td;
+	struct fanout_frame *ff;
+	struct sockaddr_ll *he;
+	struct sockaddr_ll sll;
+	int i, j, n;
+
+	for (i = 0; i < ntargets; i++) {
+		struct target *t = &targets[i];
+
+		td = get_target_device(t->ifname);
+		t->dev = td - target_devices;
+		t->he = td->he;
+		if (src.s_addr)
+			t->src = src;
+		else if (unsolicited)
+			t->src = t->ip;
+		else
+			t->src = route_source(t->ifname, t->ip);
+		t->len = build_pack(t->frame, t->src, t->ip,
+				    (struct sockaddr_ll *)&td->me, (struct sockaddr_ll *)&t->he);
+	}
+
+	nmsgs = ntargets;
+	if (fanout) {
+		setup_fanout();
+		for (i = 0; i < ntargets; i++)
+			nmsgs += target_devices[targets[i].dev].nlower;
+		fanout_frames = calloc(nmsgs - ntargets + 1, sizeof(*fanout_frames));
+		if (!fanout_frames) {
+			perror("malloc");
+			exit(2);
+		}
+	}
+
+	target_msgs = calloc(nmsgs, sizeof(*target_msgs));
+	target_iov = calloc(nmsgs, sizeof(*target_iov));
+	if (!target_msgs || !target_iov) {
+		perror("malloc");
+		exit(2);
+	}
+
+	n = ntargets;
+	for (i = 0; i < ntargets; i++) {
+		struct target *t = &targets[i];
+
+		set_msg(i, t->frame, t->len, (struct sockaddr_ll *)&t->he);
+		if (!fanout)
+			continue;
+		td = &target_devices[t->dev];
+		for (j = 0; j < td->nlower; j++, n++) {
+			ff = &fanout_frames[n - ntargets];
+			ff->he = t->he;
+			he = (struct sockaddr_ll *)&ff->he;
+			he->sll_ifindex = td->lower[j].ifindex;
+			he->sll_protocol = htons(td->lower[j].ntags ? ETH_P_8021Q : ETH_P_ARP);
+			set_msg(n, ff->frame, build_fanout(ff->frame, &td->lower[j], t->frame, t->len), he);
+		}
+	}
+
+	if (unsolicited)
+		return;
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ARP);
+	if (ntarget_devices == 1)
+		sll.sll_ifindex = ((struct sockaddr_ll *)&target_devices[0].me)->sll_ifindex;
+	if (bind(s, (struct sockaddr*)&sll, sizeof(sll)) == -1) {
+		perror("bind");
+		exit(2);
+	}
+	attach_probe_filter();
+}
+
 int
 main(int argc, char **argv)
 {
 	int socket_errno;
 	int ch;
 	int hb_mode = 0;
+	long ms;
 
 	signal(SIGTERM, byebye);
 	signal(SIGPIPE, byebye);
@@ -1082,7 +2105,7 @@ main(int argc, char **argv)
 
 	disable_capability_raw();
 
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUACLqc:w:W:s:I:T:Vr:i:p:")) != EOF) {
 		switch(ch) {
 		case 'b':
 			broadcast_only=1;
@@ -1098,6 +2121,13 @@ main(int argc, char **argv)
 			advert++;
 			unsolicited++;
 			break;
+		case 'C':
+			watch++;
+			unsolicited++;
+			break;
+		case 'L':
+			fanout++;
+			break;
 		case 'q':
 			quiet++;
 			break;
@@ -1110,6 +2140,16 @@ main(int argc, char **argv)
 		case 'w':
 			timeout = atoi(optarg);
 			break;
+		case 'W':
+		{
+			double secs = atof(optarg);
+
+			if (secs < 0.001 || secs > INT_MAX / 2)
+				usage();
+			interval.tv_sec = (time_t)secs;
+			interval.tv_usec = (secs - interval.tv_sec) * 1000000;
+			break;
+		}
 		case 'I':
 			device.name = optarg;
 			break;
@@ -1119,13 +2159,23 @@ main(int argc, char **argv)
 		case 's':
 			source = optarg;
 			break;
+		case 'T':
+			targets_file = optarg;
+			break;
 		case 'V':
 			printf("send_arp utility, based on arping from iputils-%s\n", SNAPSHOT);
 			exit(0);
+		case 'i': /* send_arp.libnet compatibility option */
+		    hb_mode = 1;
+		    ms = atol(optarg);
+		    if (ms <= 0)
+			usage();
+		    interval.tv_sec = ms / 1000;
+		    interval.tv_usec = ms % 1000 * 1000;
+		    break;
 		case 'p':
-		case 'i':
 		    hb_mode = 1;
-		    /* send_arp.libnet compatibility options, ignore */
+		    /* send_arp.libnet compatibility option, ignore */
 		    break;
 		case 'h':
 		case '?':
@@ -1134,6 +2184,13 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (watch) {
+		if (dad || hb_mode)
+			usage();
+		if (count < 0)
+			count = BURST_DEFAULT;
+	}
+
 	if(hb_mode) {
 	    /* send_arp.libnet compatibility mode */
 	    if (argc - optind != 5) {
@@ -1160,8 +2217,23 @@ main(int argc, char **argv)
 	} else {
 	    argc -= optind;
 	    argv += optind;
-	    if (argc != 1)
+	    if (argc == 0 && !targets_file)
 		usage();
+	    if (argc != 1 || targets_file) {
+		if (dad || watch) {
+			fprintf(stderr, "arping: %s takes one target\n", dad ? "DAD" : "-C");
+			exit(2);
+		}
+		/* a probe of several targets is done on the first reply */
+		if (!unsolicited)
+			quit_on_reply = 1;
+		while (argc-- > 0)
+			add_target(*argv++);
+		if (targets_file)
+			read_targets(targets_file);
+		if (!ntargets)
+			usage();
+	    }
 
 	    target = *argv;
 	}
@@ -1175,6 +2247,31 @@ main(int argc, char **argv)
 		exit(2);
 	}
 
+	if (fanout) {
+		if (!unsolicited || dad || watch) {
+			fprintf(stderr, "arping: -L is for -U and -A\n");
+			exit(2);
+		}
+		/* the single target goes the multi-target way, with its copies */
+		if (!ntargets)
+			add_target(target);
+	}
+
+	if (ntargets) {
+		if (source && inet_aton(source, &src) != 1) {
+			fprintf(stderr, "arping: invalid source %s\n", source);
+			exit(2);
+		}
+		setup_targets();
+
+		if (!quiet)
+			printf("ARPING %d addresses\n", ntargets);
+
+		drop_capabilities();
+
+		event_loop();
+	}
+
 	if (find_device() < 0)
 		exit(2);
 
@@ -1294,7 +2391,11 @@ main(int argc, char **argv)
 	set_device_broadcast(&device, ((struct sockaddr_ll *)&he)->sll_addr,
 			     ((struct sockaddr_ll *)&he)->sll_halen);
 
-	if (!quiet) {
+	attach_filter();
+
+	if (!quiet && watch) {
+		printf("Watching for conflicts on %s %s\n", inet_ntoa(dst), device.name ? : "");
+	} else if (!quiet) {
 		printf("ARPING %s ", inet_ntoa(dst));
 		printf("from %s %s\n",  inet_ntoa(src), device.name ? : "");
 	}
@@ -1306,31 +2407,8 @@ main(int argc, char **argv)
 
 	drop_capabilities();
 
-	set_signal(SIGINT, finish);
-	set_signal(SIGALRM, catcher);
-
-	catcher();
-
-	while(1) {
-		sigset_t sset, osset;
-		unsigned char packet[4096];
-		struct sockaddr_storage from;
-		socklen_t alen = sizeof(from);
-		int cc;
-
-		if ((cc = recvfrom(s, packet, sizeof(packet), 0,
-				   (struct sockaddr *)&from, &alen)) < 0) {
-			perror("arping: recvfrom");
-			continue;
-		}
-
-		sigemptyset(&sset);
-		sigaddset(&sset, SIGALRM);
-		sigaddset(&sset, SIGINT);
-		sigprocmask(SIG_BLOCK, &sset, &osset);
-		recv_pack(packet, cc, (struct sockaddr_ll *)&from);
-		sigprocmask(SIG_SETMASK, &osset, NULL);
-	}
+	event_loop();
+	return 0;
 }
 
 
@@ -40,7 +40,8 @@
      (AC_INIT, AM_INIT_AUTOMAKE) must change together.
  */
 #define SFEX_VERSION 1
-#define SFEX_REVISION 3
+#define SFEX_SLOT_VERSION 2	/* version of meta-data with slots */
+#define SFEX_REVISION 4
 
 #if 0
 #ifndef TRUE
@@ -63,6 +64,9 @@
  */
 #define SFEX_ODIRECT_ALIGNMENT sysconf(_SC_PAGESIZE)
 
+/* upper limit of one write when the whole meta-data area is initialized */
+#define SFEX_BULK_IO_SIZE (1024 * 1024)
+
 /*
  * sfex_controldata --- control data
  *
@@ -72,7 +76,9 @@
  *
  * version number --- 4 bytes. This is printable integer number and 
  * range is from 0 to 999. This must be left-justify, null(0x00) padding, and 
- * make a last byte null.
+ * make a last byte null. It is SFEX_SLOT_VERSION when number of slots is 
+ * not 0 and SFEX_VERSION otherwise, so that programs which do not know 
+ * about slots refuse the meta-data instead of taking the lock data.
  *
  * revision number --- 4 bytes. This is printable integer number and 
  * range is from 0 to 999. This must be left-justify, null(0x00) padding, and 
@@ -92,6 +98,13 @@
  * is from 1 to 999. This must be left-justify, null(0x00) padding, and make 
  * a last byte null. This is the number of locks following this control data.
  *
+ * number of slots --- 4 bytes. This is printable integer number and range 
+ * is 0 or from 2 to 32. This must be left-justify, null(0x00) padding, and 
+ * make a last byte null. 0 means classic meta-data: the locks are taken 
+ * through the lock data. Revision 3 and older leave this field empty, which 
+ * is read as 0. Otherwise each lock has this number of slot data, one for 
+ * each node, and the lock is taken through them (see sfex_slotdata).
+ *
  * padding --- The size of this member depend on blocksize. It is adjusted so 
  * that the whole of the control data including this padding area becomes 
  * blocksize.  The contents of padding area are all 0x00.
@@ -102,6 +115,7 @@ typedef struct sfex_controldata {
   int revision;			/*  revision number */
   size_t blocksize;		/*  block size */
   int numlocks;			/*  number of locks */
+  int numslots;			/*  number of slots per lock, 0 if none */
 } sfex_controldata;
 
 typedef struct sfex_controldata_ondisk {
@@ -110,6 +124,7 @@ typedef struct sfex_controldata_ondisk {
   uint8_t revision[4];
   uint8_t blocksize[8];
   uint8_t numlocks[4];
+  uint8_t numslots[4];
 } sfex_controldata_ondisk;
 
 /*
@@ -153,6 +168,66 @@ typedef struct sfex_lockdata_ondisk {
 	uint8_t nodename[256];
 } sfex_lockdata_ondisk;
 
+/*
+ * sfex_slotdata --- slot data
+ *
+ * When the control data has numslots, numslots slot data per lock are 
+ * allocated behind of all lock data: slot s (1 origin) of lock index i 
+ * is block (1 + numlocks + (i - 1) * numslots + (s - 1)). Each slot is 
+ * written only by the node which was given that slot number, so there is 
+ * no write conflict, and the lock is decided by comparing the slots in the 
+ * manner of Disk Paxos:
+ *
+ *  1. write BID with a ballot higher than any seen, read all slots, and 
+ *     give up if another slot is COMMIT or HELD or has a higher BID.
+ *  2. write COMMIT, read all slots, and give up if another slot is COMMIT 
+ *     or HELD.
+ *  3. write HELD.
+ *
+ * Since every node writes its COMMIT before it reads the others, of two 
+ * nodes which both pass step 2 the one which read last would have seen 
+ * the other's COMMIT. So at most one node gets the lock, without any 
+ * sleep. A node which gives up writes IDLE and tries again with a higher 
+ * ballot. A slot which has not changed for lock_timeout seconds belongs 
+ * to a dead node and is not counted.
+ *
+ * slot status --- 1 byte. printable character. SFEX_SLOT_*.
+ *
+ * increment counter --- 4 bytes. Same as the one in the lock data. It is 
+ * incremented on every write of the slot, so that a live owner is told 
+ * from a dead one.
+ *
+ * ballot --- 12 bytes. This is printable integer number and range is from 
+ * 0 to SFEX_MAX_BALLOT. This must be left-justify, null(0x00) padding, and 
+ * make a last byte null. Ballots of slot s are always equal to s - 1 
+ * modulo numslots, so no two slots bid with the same ballot.
+ *
+ * node name --- 256bytes. Same as the one in the lock data. This is only 
+ * displayed; the slot number identifies the owner.
+ *
+ * padding --- The size of this member depend on blocksize. The contents 
+ * of padding area are all 0x00.
+ */
+typedef struct sfex_slotdata {
+  char status;				/* status of slot */
+  int count;				/* increment counter */
+  unsigned long long ballot;		/* ballot of the last bid */
+  char nodename[256];		/* node name */
+} sfex_slotdata;
+
+typedef struct sfex_slotdata_ondisk {
+	uint8_t status;
+	uint8_t count[4];
+	uint8_t ballot[12];
+	uint8_t nodename[256];
+} sfex_slotdata_ondisk;
+
+/* character for slot status. This is used in sfex_slotdata.status */
+#define SFEX_SLOT_IDLE 'i'	/* not taking part */
+#define SFEX_SLOT_BID 'b'	/* bidding for the lock */
+#define SFEX_SLOT_COMMIT 'c'	/* about to take the lock */
+#define SFEX_SLOT_HELD 'h'	/* holding the lock */
+
 /* character for lock status. This is used in sfex_lockdata.status */
 #define SFEX_STATUS_UNLOCK 'u' /* unlock */
 #define SFEX_STATUS_LOCK 'l'	/* lock */
@@ -161,13 +236,48 @@ typedef struct sfex_lockdata_ondisk {
 #define SFEX_MAGIC "SFEX"
 #define SFEX_MIN_NUMLOCKS 1
 #define SFEX_MAX_NUMLOCKS 999
+#define SFEX_MIN_NUMSLOTS 2
+#define SFEX_MAX_NUMSLOTS 32
+#define SFEX_MAX_BALLOT 99999999999ULL
+#define SFEX_MAX_DEVICES 9	/* a lock may span an odd number of devices */
 #define SFEX_MIN_COUNT 0
 #define SFEX_MAX_COUNT 999
+#define SFEX_MIN_BLOCKSIZE 512
+#define SFEX_MAX_BLOCKSIZE 9999999
+#define SFEX_DEFAULT_BLOCKSIZE 512	/* regular files, unless told otherwise */
 #define SFEX_MAX_NODENAME (sizeof(((sfex_lockdata *)0)->nodename) - 1)
 
 /* update macro for increment counter */
 #define SFEX_NEXT_COUNT(c) (c >= SFEX_MAX_COUNT ? c - SFEX_MAX_COUNT : c + 1)
 
+/*
+ * sfex_statusdata --- lock state published by sfex_daemon
+ *
+ * sfex_daemon keeps this structure in a shared memory mapping of the status 
+ * file given with -S and updates it after every acquisition, renewal and 
+ * release. sfex_status reads it, so that monitoring the lock costs no I/O 
+ * to the shared disk.
+ *
+ * seq is incremented before and after each update: a reader which sees an 
+ * odd value, or a different value after reading, must retry.
+ * last_renewal_mono is taken from CLOCK_MONOTONIC, last_renewal from the 
+ * wall clock (for display only).
+ */
+typedef struct sfex_statusdata {
+  uint32_t magic;		/* SFEX_STATUSDATA_MAGIC */
+  uint32_t seq;			/* update sequence number */
+  int32_t pid;			/* pid of sfex_daemon */
+  int32_t held;			/* 1 while the lock is held */
+  int32_t index;		/* lock index */
+  int32_t count;		/* increment counter written last */
+  int64_t lock_timeout;		/* seconds */
+  int64_t last_renewal;		/* seconds since the epoch */
+  int64_t last_renewal_mono;	/* milliseconds, CLOCK_MONOTONIC */
+  int64_t renewal_usec;		/* duration of the last renewal */
+} sfex_statusdata;
+
+#define SFEX_STATUSDATA_MAGIC 0x53465853	/* "SFXS" */
+
 /* extern variables */
 extern const char *progname;
 extern char *nodename;
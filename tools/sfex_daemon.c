@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <time.h>
 #include "sfex.h"
 #include "sfex_lib.h"
 
@@ -19,7 +20,9 @@
 #include <glue_config.h> /* for HA_LOG_FACILITY */
 #endif
 
+#ifndef SFEX_TESTING
 static int sysrq_fd;
+#endif
 static int lock_index = 1;        /* default 1st lock */
 static time_t collision_timeout = 1; /* default 1 sec */
 static time_t lock_timeout = 60; /* default 60 sec */
@@ -30,17 +33,152 @@ static sfex_controldata cdata;
 static sfex_lockdata ldata;
 static sfex_lockdata ldata_new;
 
+/* slot mode (sfex_init -s), see sfex_slotdata in sfex.h */
+static int slot_index;			/* own slot, 0 if not in slot mode */
+static sfex_slotdata myslot;
+static sfex_slotdata slots[SFEX_MAX_NUMSLOTS + 1];
+static sfex_slotdata stale[SFEX_MAX_NUMSLOTS + 1]; /* slots of dead nodes */
+static int is_stale[SFEX_MAX_NUMSLOTS + 1];
+
+/* a lock spanning several devices is held on a majority of them */
+static int ndevices = 1;
+static int usable[SFEX_MAX_DEVICES];	/* passed the start-up check */
+static int held_on[SFEX_MAX_DEVICES];
+static sfex_lockdata mldata[SFEX_MAX_DEVICES];
+static sfex_lockdata mldata_new[SFEX_MAX_DEVICES];
+#define MAJORITY (ndevices / 2 + 1)
+
 static const char *device;
 const char *progname;
 char *nodename;
 static const char *rsc_id = "sfex";
+static const char *status_file;
+static sfex_statusdata *status;
+
+#ifdef SFEX_TESTING
+/* sfex_sim follows its competitors through these markers on stdout */
+#define sim_event(ev) do { printf("%s\n", ev); fflush(stdout); } while (0)
+#else
+#define sim_event(ev) do { } while (0)
+#endif
 
 static void usage(FILE *dist) {
-	  fprintf(dist, "usage: %s [-i <index>] [-c <collision_timeout>] [-t <lock_timeout>] <device>\n", progname);
+	  fprintf(dist, "usage: %s [-i <index>] [-s <slot>] [-c <collision_timeout>] [-t <lock_timeout>] [-S <status_file>] <device> [<device>...]\n", progname);
+}
+
+static int64_t monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * open_status --- create the status file and map it
+ *
+ * The lock state is kept in a shared mapping of this file, so that
+ * sfex_status can tell whether we hold the lock without any disk I/O.
+ * The file is built under a temporary name and renamed into place, so
+ * that a reader never finds it short, even while the daemon restarts.
+ */
+static void open_status(void)
+{
+	char tmp[PATH_MAX];
+	void *p;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", status_file) >= (int)sizeof(tmp)) {
+		cl_log(LOG_ERR, "status file name %s is too long\n", status_file);
+		exit(EXIT_FAILURE);
+	}
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		cl_log(LOG_ERR, "can't create status file %s: %s\n", tmp, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (fchmod(fd, 0644) == -1 || ftruncate(fd, sizeof(sfex_statusdata)) == -1) {
+		cl_log(LOG_ERR, "can't resize status file %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		exit(EXIT_FAILURE);
+	}
+	p = mmap(NULL, sizeof(sfex_statusdata), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		cl_log(LOG_ERR, "can't map status file %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	status = p;
+	status->magic = SFEX_STATUSDATA_MAGIC;
+	if (rename(tmp, status_file) == -1) {
+		cl_log(LOG_ERR, "can't rename %s to %s: %s\n", tmp, status_file, strerror(errno));
+		unlink(tmp);
+		exit(EXIT_FAILURE);
+	}
 }
 
+/*
+ * publish_status --- update the status file
+ *
+ * held --- whether we hold the lock now
+ *
+ * renewal_usec --- duration of the renewal that just succeeded, or -1 if
+ * no renewal happened.
+ */
+static void publish_status(int held, int64_t renewal_usec)
+{
+	if (!status)
+		return;
+
+	status->seq++;
+	__sync_synchronize();
+	status->pid = getpid();
+	status->held = held;
+	status->index = lock_index;
+	status->count = slot_index ? myslot.count : ldata.count;
+	status->lock_timeout = lock_timeout;
+	if (renewal_usec >= 0) {
+		status->last_renewal = time(NULL);
+		status->last_renewal_mono = monotonic_usec() / 1000;
+		status->renewal_usec = renewal_usec;
+	}
+	__sync_synchronize();
+	status->seq++;
+}
+
+/*
+ * renewal_deadline --- how long one lock renewal may take, in milliseconds
+ *
+ * The other nodes consider the lock expired lock_timeout seconds after its
+ * counter last moved. We wrote it monitor_interval seconds before starting
+ * the renewal, so what is left of the lease is the time the read and the
+ * write of update_lock() may take. A renewal which misses it is treated
+ * like a failed one.
+ */
+static long renewal_deadline(void)
+{
+	if (lock_timeout > monitor_interval)
+		return (lock_timeout - monitor_interval) * 1000;
+	return lock_timeout * 1000;
+}
+
+static void acquire_slot_lock(void);
+static void acquire_majority_lock(void);
+
 static void acquire_lock(void)
 {
+	if (slot_index) {
+		acquire_slot_lock();
+		return;
+	}
+	if (ndevices > 1) {
+		acquire_majority_lock();
+		return;
+	}
+
+	/* a hung LUN must not keep us in the start operation forever */
+	set_io_deadline(lock_timeout * 1000);
 	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in acquire_lock\n");
 		exit(EXIT_FAILURE);
@@ -50,9 +188,11 @@ static void acquire_lock(void)
 		unsigned int t = lock_timeout;
 		while (t > 0)
 			t = sleep(t);
+		set_io_deadline(lock_timeout * 1000);
 		read_lockdata(&cdata, &ldata_new, lock_index);
 		if (ldata.count != ldata_new.count) {
 			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
+			sim_event("busy");
 			exit(2);
 		}
 	}
@@ -77,11 +217,13 @@ static void acquire_lock(void)
 		unsigned int t = collision_timeout;
 		while (t > 0)
 			t = sleep(t);
+		set_io_deadline(lock_timeout * 1000);
 		if (read_lockdata(&cdata, &ldata_new, lock_index) == -1) {
 			cl_log(LOG_ERR, "read_lockdata failed in collision detection\n");
 		}
 		if (strncmp((char*)(ldata.nodename), (const char*)(ldata_new.nodename), sizeof(ldata.nodename))) {
 			cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
+			sim_event("collision");
 			exit(2);
 		}
 	}
@@ -95,10 +237,17 @@ static void acquire_lock(void)
 		exit(EXIT_FAILURE);
 	}
 	cl_log(LOG_INFO, "lock acquired\n");
+	publish_status(1, 0);
+	sim_event("acquired");
 }
 
 static void error_todo (void)
 {
+	publish_status(0, -1);
+#ifdef SFEX_TESTING
+	sim_event("error");
+	exit(EXIT_FAILURE);
+#endif
 	if (fork() == 0) {
 		cl_log(LOG_INFO, "Execute \"crm_resource -F -r %s --node %s\" command\n", rsc_id, nodename);
 		execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "--node", nodename, NULL);
@@ -109,12 +258,15 @@ static void error_todo (void)
 
 static void failure_todo(void)
 {
-#ifdef SFEX_TESTING	
+#ifdef SFEX_TESTING
+	publish_status(0, -1);
+	sim_event("lost");
 	exit(EXIT_FAILURE);
 #else
 	/*execl("/usr/sbin/crm_resource", "crm_resource", "-F", "-r", rsc_id, "--node", nodename, NULL); */
 	int ret;
 
+	publish_status(0, -1);
 	cl_log(LOG_INFO, "Force reboot node %s\n", nodename);
 	ret = write(sysrq_fd, "b\n", 2);
 	if (ret == -1) {
@@ -125,8 +277,414 @@ static void failure_todo(void)
 #endif
 }
 
+/* the number of BID/COMMIT rounds before giving up as a collision */
+#define SLOT_ROUNDS 8
+
+static void read_all_slots(const char *where)
+{
+	if (read_slots(&cdata, slots, lock_index) == -1) {
+		cl_log(LOG_ERR, "read_slots failed in %s\n", where);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int write_own_slot(char st, unsigned long long ballot)
+{
+	myslot.status = st;
+	myslot.count = SFEX_NEXT_COUNT(myslot.count);
+	myslot.ballot = ballot;
+	strncpy(myslot.nodename, nodename, sizeof(myslot.nodename) - 1);
+	return write_slotdata(&cdata, &myslot, lock_index, slot_index);
+}
+
+/*
+ * slot_is_live --- whether slot s may belong to a node taking or holding
+ * the lock
+ *
+ * An idle slot, our own and one that was found dead do not count. A dead
+ * slot comes back to life as soon as its owner writes it again.
+ */
+static int slot_is_live(int s)
+{
+	const sfex_slotdata *p = &slots[s];
+
+	if (s == slot_index || p->status == SFEX_SLOT_IDLE)
+		return 0;
+	if (is_stale[s] && p->status == stale[s].status
+	    && p->count == stale[s].count && p->ballot == stale[s].ballot)
+		return 0;
+	return 1;
+}
+
+/*
+ * slot_conflict --- whether another node is ahead of our ballot
+ *
+ * Any live COMMIT or HELD slot wins over us. While bidding, so does a
+ * higher BID; once we have committed, a higher bidder will see our COMMIT
+ * and give way by itself.
+ */
+static int slot_conflict(unsigned long long ballot, int committed)
+{
+	int s;
+
+	for (s = 1; s <= cdata.numslots; s++) {
+		if (!slot_is_live(s))
+			continue;
+		if (slots[s].status == SFEX_SLOT_COMMIT || slots[s].status == SFEX_SLOT_HELD)
+			return s;
+		if (!committed && slots[s].status == SFEX_SLOT_BID && slots[s].ballot > ballot)
+			return s;
+	}
+	return 0;
+}
+
+static int slot_held_by_other(void)
+{
+	int s;
+
+	for (s = 1; s <= cdata.numslots; s++)
+		if (slot_is_live(s) && slots[s].status == SFEX_SLOT_HELD)
+			return s;
+	return 0;
+}
+
+/* the lowest ballot of our slot above every ballot on disk */
+static unsigned long long next_ballot(void)
+{
+	unsigned long long max = myslot.ballot, b;
+	int s;
+
+	for (s = 1; s <= cdata.numslots; s++)
+		if (slots[s].ballot > max)
+			max = slots[s].ballot;
+	b = (max / cdata.numslots + 1) * cdata.numslots + (slot_index - 1);
+	/* wrapping only costs a lost round, safety does not depend on it */
+	if (b > SFEX_MAX_BALLOT)
+		b = slot_index - 1;
+	return b;
+}
+
+/*
+ * acquire_slot_lock --- acquire the lock in slot mode
+ *
+ * Slots of other nodes which are not idle may be left by a node which has
+ * died, so we watch them for lock_timeout seconds first, as the classic
+ * mode does with the lock data. Then each round is two writes and two
+ * reads of our own and all other slots, and there is no collision_timeout
+ * sleep (see sfex_slotdata in sfex.h).
+ */
+static void acquire_slot_lock(void)
+{
+	int s, round;
+
+	set_io_deadline(lock_timeout * 1000);
+	read_all_slots("acquire_lock");
+	myslot = slots[slot_index];
+
+	for (s = 1; s <= cdata.numslots; s++)
+		if (slot_is_live(s))
+			break;
+	if (s <= cdata.numslots) {
+		unsigned int t = lock_timeout;
+
+		memcpy(stale, slots, sizeof(stale));
+		for (s = 1; s <= cdata.numslots; s++)
+			is_stale[s] = slots[s].status != SFEX_SLOT_IDLE;
+		while (t > 0)
+			t = sleep(t);
+		set_io_deadline(lock_timeout * 1000);
+		read_all_slots("acquire_lock");
+		s = slot_held_by_other();
+		if (s) {
+			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by %s (slot %d).\n",
+				slots[s].nodename, s);
+			sim_event("busy");
+			exit(2);
+		}
+	}
+
+	for (round = 0; round < SLOT_ROUNDS; round++) {
+		unsigned long long ballot = next_ballot();
+
+		/* every write and read of this round must finish before any
+		 * other node could take our slot for dead */
+		set_io_deadline(lock_timeout * 1000);
+		if (write_own_slot(SFEX_SLOT_BID, ballot) == -1) {
+			cl_log(LOG_ERR, "write_slotdata failed\n");
+			exit(EXIT_FAILURE);
+		}
+		read_all_slots("acquire_lock");
+		s = slot_conflict(ballot, 0);
+		if (!s) {
+			if (write_own_slot(SFEX_SLOT_COMMIT, ballot) == -1) {
+				cl_log(LOG_ERR, "write_slotdata failed\n");
+				exit(EXIT_FAILURE);
+			}
+			read_all_slots("collision detection");
+			s = slot_conflict(ballot, 1);
+		}
+		if (!s) {
+			if (write_own_slot(SFEX_SLOT_HELD, ballot) == -1) {
+				cl_log(LOG_ERR, "write_slotdata failed\n");
+				exit(EXIT_FAILURE);
+			}
+			cl_log(LOG_INFO, "lock acquired (slot %d, ballot %llu)\n", slot_index, ballot);
+			publish_status(1, 0);
+			sim_event("acquired");
+			return;
+		}
+
+		/* give way, and try again unless the winner already holds it */
+		if (write_own_slot(SFEX_SLOT_IDLE, ballot) == -1) {
+			cl_log(LOG_ERR, "write_slotdata failed\n");
+			exit(EXIT_FAILURE);
+		}
+		if (slots[s].status == SFEX_SLOT_HELD) {
+			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by %s (slot %d).\n",
+				slots[s].nodename, s);
+			sim_event("busy");
+			exit(2);
+		}
+		/* a random backoff lets one of the bidders through */
+		usleep((random() % 50000) * (round + 1));
+	}
+	cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
+	sim_event("collision");
+	exit(2);
+}
+
+static void update_slot_lock(void)
+{
+	int64_t start = monotonic_usec();
+	int s;
+
+	set_io_deadline(renewal_deadline());
+	if (read_slots(&cdata, slots, lock_index) == -1) {
+		cl_log(LOG_ERR, "read_slots failed in update_lock\n");
+		error_todo();
+		exit(EXIT_FAILURE);
+	}
+
+	/* somebody took our slot for dead and got the lock */
+	s = slot_held_by_other();
+	if (s || slots[slot_index].status != SFEX_SLOT_HELD
+	    || slots[slot_index].count != myslot.count) {
+		cl_log(LOG_ERR, "can't update lock.\n");
+		failure_todo();
+		exit(EXIT_FAILURE);
+	}
+
+	if (write_own_slot(SFEX_SLOT_HELD, myslot.ballot) == -1) {
+		cl_log(LOG_ERR, "write_slotdata failed in update_lock\n");
+		error_todo();
+		exit(EXIT_FAILURE);
+	}
+	publish_status(1, monotonic_usec() - start);
+}
+
+static void release_slot_lock(void)
+{
+	set_io_deadline(lock_timeout * 1000);
+	if (write_own_slot(SFEX_SLOT_IDLE, myslot.ballot) == -1) {
+		cl_log(LOG_ERR, "write_slotdata failed in release_lock\n");
+		exit(EXIT_FAILURE);
+	}
+	publish_status(0, -1);
+	cl_log(LOG_INFO, "lock released\n");
+}
+
+static int count_devices(const int *flags)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ndevices; i++)
+		n += flags[i] != 0;
+	return n;
+}
+
+/* keep ldata in step with the first device we hold, for publish_status() */
+static void sync_ldata(void)
+{
+	int i;
+
+	for (i = 0; i < ndevices; i++)
+		if (held_on[i]) {
+			ldata = mldata[i];
+			return;
+		}
+}
+
+/*
+ * acquire_majority_lock --- acquire the lock on several devices
+ *
+ * This is the procedure of acquire_lock() run on all devices at once, the
+ * I/O of each step being issued in parallel. The lock is ours when we win
+ * it on a majority of the devices; since two majorities always share a
+ * device, no two nodes can both get it. A device which fails or is too
+ * slow is simply left out, so one bad LUN of three does not stop us.
+ */
+static void acquire_majority_lock(void)
+{
+	int ok[SFEX_MAX_DEVICES], watch[SFEX_MAX_DEVICES];
+	int i, watching = 0;
+
+	set_io_deadline(lock_timeout * 1000);
+	memcpy(ok, usable, sizeof(ok));
+	if (read_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY) < MAJORITY) {
+		cl_log(LOG_ERR, "read_lockdata failed on a majority of devices in acquire_lock\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		watch[i] = ok[i] && mldata[i].status == SFEX_STATUS_LOCK
+			&& strncmp(nodename, mldata[i].nodename, sizeof(mldata[i].nodename));
+		watching |= watch[i];
+	}
+	if (watching) {
+		int again[SFEX_MAX_DEVICES];
+		unsigned int t = lock_timeout;
+
+		while (t > 0)
+			t = sleep(t);
+		set_io_deadline(lock_timeout * 1000);
+		memcpy(again, watch, sizeof(again));
+		read_lockdata_all(&cdata, mldata_new, lock_index, again, MAJORITY);
+		for (i = 0; i < ndevices; i++)
+			if (watch[i] && (!again[i] || mldata_new[i].count != mldata[i].count))
+				ok[i] = 0;
+		if (count_devices(ok) < MAJORITY) {
+			cl_log(LOG_ERR, "can\'t acquire lock: the lock's already hold by some other node.\n");
+			sim_event("busy");
+			exit(2);
+		}
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		if (!ok[i])
+			continue;
+		mldata[i].status = SFEX_STATUS_LOCK;
+		mldata[i].count = SFEX_NEXT_COUNT(mldata[i].count);
+		strncpy(mldata[i].nodename, nodename, sizeof(mldata[i].nodename) - 1);
+	}
+	if (write_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY) < MAJORITY) {
+		cl_log(LOG_ERR, "write_lockdata failed on a majority of devices\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* detect the collision of lock, on each device */
+	{
+		unsigned int t = collision_timeout;
+		while (t > 0)
+			t = sleep(t);
+	}
+	set_io_deadline(lock_timeout * 1000);
+	memcpy(held_on, ok, sizeof(held_on));
+	read_lockdata_all(&cdata, mldata_new, lock_index, held_on, MAJORITY);
+	for (i = 0; i < ndevices; i++)
+		if (held_on[i] && strncmp(mldata[i].nodename, mldata_new[i].nodename, sizeof(mldata[i].nodename)))
+			held_on[i] = 0;
+	if (count_devices(held_on) < MAJORITY) {
+		/* give back the devices we won, so the winner need not wait */
+		for (i = 0; i < ndevices; i++)
+			mldata[i].status = SFEX_STATUS_UNLOCK;
+		write_lockdata_all(&cdata, mldata, lock_index, held_on, MAJORITY);
+		cl_log(LOG_ERR, "can\'t acquire lock: collision detected in the air.\n");
+		sim_event("collision");
+		exit(2);
+	}
+
+	/* extension of lock */
+	for (i = 0; i < ndevices; i++)
+		mldata[i].count = SFEX_NEXT_COUNT(mldata[i].count);
+	memcpy(ok, held_on, sizeof(ok));
+	if (write_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY) < MAJORITY) {
+		cl_log(LOG_ERR, "write_lockdata failed in extension of lock\n");
+		exit(EXIT_FAILURE);
+	}
+	sync_ldata();
+	cl_log(LOG_INFO, "lock acquired on %d of %d devices\n", count_devices(held_on), ndevices);
+	publish_status(1, 0);
+	sim_event("acquired");
+}
+
+/*
+ * update_majority_lock --- renew the lock on several devices
+ *
+ * The renewal succeeds when it reaches a majority of the devices in time.
+ * A device where it fails is tried again on the next renewal; one which
+ * another node has taken over is given up.
+ */
+static void update_majority_lock(void)
+{
+	int64_t start = monotonic_usec();
+	int ok[SFEX_MAX_DEVICES];
+	int i;
+
+	set_io_deadline(renewal_deadline());
+	memcpy(ok, held_on, sizeof(ok));
+	read_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY);
+	for (i = 0; i < ndevices; i++) {
+		if (!ok[i])
+			continue;
+		if (mldata[i].status != SFEX_STATUS_LOCK || strncmp(mldata[i].nodename, nodename, sizeof(mldata[i].nodename))) {
+			cl_log(LOG_WARNING, "lost the lock on device %d\n", i + 1);
+			held_on[i] = ok[i] = 0;
+			continue;
+		}
+		mldata[i].count = SFEX_NEXT_COUNT(mldata[i].count);
+	}
+	if (count_devices(held_on) < MAJORITY) {
+		cl_log(LOG_ERR, "can't update lock.\n");
+		failure_todo();
+		exit(EXIT_FAILURE);
+	}
+
+	if (write_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY) < MAJORITY) {
+		cl_log(LOG_ERR, "write_lockdata failed on a majority of devices in update_lock\n");
+		error_todo();
+		exit(EXIT_FAILURE);
+	}
+	sync_ldata();
+	publish_status(1, monotonic_usec() - start);
+}
+
+static void release_majority_lock(void)
+{
+	int ok[SFEX_MAX_DEVICES];
+	int i;
+
+	set_io_deadline(lock_timeout * 1000);
+	memcpy(ok, held_on, sizeof(ok));
+	read_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY);
+	for (i = 0; i < ndevices; i++) {
+		if (ok[i] && (mldata[i].status != SFEX_STATUS_LOCK
+			      || strncmp(mldata[i].nodename, nodename, sizeof(mldata[i].nodename))))
+			ok[i] = 0;
+		mldata[i].status = SFEX_STATUS_UNLOCK;
+	}
+	if (write_lockdata_all(&cdata, mldata, lock_index, ok, MAJORITY) < MAJORITY) {
+		cl_log(LOG_ERR, "write_lockdata failed on a majority of devices in release_lock\n");
+		exit(EXIT_FAILURE);
+	}
+	publish_status(0, -1);
+	cl_log(LOG_INFO, "lock released\n");
+}
+
 static void update_lock(void)
 {
+	int64_t start = monotonic_usec();
+
+	if (slot_index) {
+		update_slot_lock();
+		return;
+	}
+	if (ndevices > 1) {
+		update_majority_lock();
+		return;
+	}
+
+	set_io_deadline(renewal_deadline());
+
 	/* read lock data */
 	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in update_lock\n");
@@ -149,12 +707,24 @@ static void update_lock(void)
 		error_todo();
 		exit(EXIT_FAILURE);
 	}
+	publish_status(1, monotonic_usec() - start);
 }
 
 static void release_lock(void)
 {
 	/* The only thing I care about in release_lock(), is to terminate the process */
 	   
+	if (slot_index) {
+		release_slot_lock();
+		return;
+	}
+	if (ndevices > 1) {
+		release_majority_lock();
+		return;
+	}
+
+	set_io_deadline(lock_timeout * 1000);
+
 	/* read lock data */
 	if (read_lockdata(&cdata, &ldata, lock_index) == -1) {
 		cl_log(LOG_ERR, "read_lockdata failed in release_lock\n");
@@ -175,6 +745,7 @@ static void release_lock(void)
 		cl_log(LOG_ERR, "write_lockdata failed in release_lock\n");
 		exit(EXIT_FAILURE);
 	}
+	publish_status(0, -1);
 	cl_log(LOG_INFO, "lock released\n");
 }
 
@@ -182,6 +753,8 @@ static void quit_handler(int signo, siginfo_t *info, void *context)
 {
 	cl_log(LOG_INFO, "quit_handler called. now releasing lock\n");
 	release_lock();
+	if (status_file)
+		unlink(status_file);
 	cl_log(LOG_INFO, "Shutdown sfex_daemon with EXIT_SUCCESS\n");
 	exit(EXIT_SUCCESS);
 }
@@ -201,7 +774,7 @@ int main(int argc, char *argv[])
 	/* read command line option */
 	opterr = 0;
 	while (1) {
-		int c = getopt(argc, argv, "hi:c:t:m:n:r:");
+		int c = getopt(argc, argv, "hi:s:c:t:m:n:r:S:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -222,6 +795,20 @@ int main(int argc, char *argv[])
 					lock_index = l;
 				}
 				break;
+			case 's':           /* -s <slot> */
+				{
+					unsigned long l = strtoul(optarg, NULL, 10);
+					if (l < 1 || l > SFEX_MAX_NUMSLOTS) {
+						cl_log(LOG_ERR, 
+								"slot %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+								optarg,
+								(unsigned long)1,
+								(unsigned long)SFEX_MAX_NUMSLOTS);
+						exit(4);
+					}
+					slot_index = l;
+				}
+				break;
 			case 'c':           /* -c <collision_timeout> */
 				{
 					unsigned long l = strtoul(optarg, NULL, 10);
@@ -281,6 +868,9 @@ int main(int argc, char *argv[])
 					rsc_id = strdup(optarg);
 				}
 				break;
+			case 'S':           /* -S <status_file> */
+				status_file = optarg;
+				break;
 			case '?':           /* error */
 				usage(stderr);
 				exit(4);
@@ -291,15 +881,26 @@ int main(int argc, char *argv[])
 		cl_log(LOG_ERR, "no device specified.\n");
 		usage(stderr);
 		exit(EXIT_FAILURE);
-	} else if (optind + 1 < argc) {
-		cl_log(LOG_ERR, "too many arguments.\n");
+	}
+	ndevices = argc - optind;
+	if (ndevices > SFEX_MAX_DEVICES || ndevices % 2 == 0) {
+		cl_log(LOG_ERR, "the number of devices must be odd and at most %d.\n", SFEX_MAX_DEVICES);
 		usage(stderr);
 		exit(EXIT_FAILURE);
 	}
+	if (ndevices > 1 && slot_index) {
+		cl_log(LOG_ERR, "slots can't be used with several devices.\n");
+		exit(EXIT_FAILURE);
+	}
 	device = argv[optind];
 
-	prepare_lock(device);
-#if !SFEX_TESTING
+	{
+		int i;
+
+		for (i = 0; i < ndevices; i++)
+			prepare_lock(argv[optind + i]);
+	}
+#ifndef SFEX_TESTING
 	sysrq_fd = open("/proc/sysrq-trigger", O_WRONLY);
 	if (sysrq_fd == -1) {
 		cl_log(LOG_ERR, "failed to open /proc/sysrq-trigger due to %s\n", strerror(errno));
@@ -307,9 +908,44 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	ret = lock_index_check(&cdata, lock_index);
-	if (ret == -1)
+	set_io_deadline(lock_timeout * 1000);
+	if (ndevices == 1) {
+		ret = lock_index_check(&cdata, lock_index);
+		if (ret == -1)
+			exit(EXIT_FAILURE);
+	} else {
+		/* a device that fails here is left out, as long as a majority is usable */
+		sfex_controldata c;
+		int i;
+
+		for (i = 0; i < ndevices; i++) {
+			select_device(i);
+			set_io_deadline(lock_timeout * 1000);
+			usable[i] = lock_index_check(&c, lock_index) == 0 && c.numslots == 0;
+			if (usable[i])
+				cdata = c;
+			else
+				cl_log(LOG_ERR, "device %s can't be used.\n", argv[optind + i]);
+		}
+		select_device(0);
+		if (count_devices(usable) < MAJORITY) {
+			cl_log(LOG_ERR, "a majority of devices can't be used.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (cdata.numslots && !slot_index) {
+		cl_log(LOG_ERR, "the meta-data has %d slots per lock. specify the slot of this node with -s.\n",
+				cdata.numslots);
+		exit(EXIT_FAILURE);
+	} else if (slot_index > cdata.numslots) {
+		if (cdata.numslots)
+			cl_log(LOG_ERR, "slot %d is too large. %d slots are stored.\n",
+					slot_index, cdata.numslots);
+		else
+			cl_log(LOG_ERR, "the meta-data has no slots. initialize it with sfex_init -s.\n");
 		exit(EXIT_FAILURE);
+	}
+	srandom(getpid());
 
 	{
 		struct sigaction sig_act;
@@ -324,16 +960,23 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (status_file)
+		open_status();
+
 	cl_log(LOG_INFO, "Starting SFeX Daemon...\n");
 	
 	/* acquire lock first.*/
 	acquire_lock();
 
+#ifndef SFEX_TESTING
 	if (daemon(0, 1) != 0) {
 		cl_perror("%s::%d: daemon() failed.", __FUNCTION__, __LINE__);
 		release_lock();
 		exit(EXIT_FAILURE);
 	}
+#endif
+	/* our pid has changed */
+	publish_status(1, -1);
 
 	cl_make_realtime(-1, -1, 128, 128);
 	
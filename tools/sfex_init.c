@@ -25,7 +25,7 @@
  *
  *-------------------------------------------------------------------------
  *
- * sfex_init [-b <blocksize>] [-n <numlocks>] <device>
+ * sfex_init [-b <blocksize>] [-n <numlocks>] [-s <numslots>] <device>
  *
  * -b <blocksize> --- The size of the block is specified by the number of 
  * bytes. In general, to prevent a partial writing to the disk, the size 
@@ -35,14 +35,25 @@
  * is used(When you specify --enable-directio option for configure script). 
  * (In Linux kernel 2.6, "direct I/O " does not work if this value is not 
  * a multiple of 512.) Default is 512 bytes.
+ * A block device always uses its logical sector size, so this option is
+ * mostly useful when <device> is a regular file (for testing and
+ * benchmarking without shared storage).
  *
  * -n <numlocks> --- The number of storing lock data is specified by integer 
  * of one or more. When you want to control two or more resources by one 
  * meta-data, you set the value of two or more to numlocks. A necessary disk 
  * area for meta data are (blocksize*(1+numlocks))bytes. Default is 1.
  *
+ * -s <numslots> --- Put the meta-data in slot mode with this number of 
+ * slots (2 to 32) per lock. Each node is then given its own slot with 
+ * sfex_daemon -s, and the lock is acquired without the collision_timeout 
+ * sleep. The disk area grows to (blocksize*(1+numlocks*(1+numslots)))bytes.
+ * Default is 0, no slots (classic meta-data). Slot mode meta-data carry a 
+ * new version number, so sfex programs older than slot mode refuse them.
+ *
  * <device> --- This is file path which stored meta-data. It is usually 
  * expressed in "/dev/...", because it is partition on the shared disk.
+ * A regular file is accepted as well.
  *
  * exit code --- 0 - Normal end. 3 - Error occurs while processing it. 
  * The content of the error is displayed into stderr. 4 - The mistake is 
@@ -57,6 +68,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
@@ -75,7 +87,7 @@ char *nodename;
  * return value --- void
  */
 static void usage(FILE *dist) {
-  fprintf(dist, "usage: %s [-n <numlocks>] <device>\n", progname);
+  fprintf(dist, "usage: %s [-b <blocksize>] [-n <numlocks>] [-s <numslots>] <device>\n", progname);
 }
 
 /*
@@ -94,6 +106,7 @@ main(int argc, char *argv[]) {
 
   /* command line parameter */
   int numlocks = 1;		/* default 1 locks  */
+  int numslots = 0;		/* default no slots */
   const char *device;
 
   /*
@@ -111,13 +124,29 @@ main(int argc, char *argv[]) {
   /* read command line option */
   opterr = 0;
   while (1) {
-    int c = getopt(argc, argv, "hn:");
+    int c = getopt(argc, argv, "hb:n:s:");
     if (c == -1)
       break;
     switch (c) {
     case 'h':			/* help */
       usage(stdout);
       exit(0);
+    case 'b':			/* -b <blocksize> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l < SFEX_MIN_BLOCKSIZE || l > SFEX_MAX_BLOCKSIZE
+	    || l % SFEX_MIN_BLOCKSIZE) {
+	  fprintf(stderr,
+		  "%s: ERROR: blocksize %s is out of range or invalid. it must be a multiple of %lu between %lu and %lu.\n",
+		  progname, optarg,
+		  (unsigned long)SFEX_MIN_BLOCKSIZE,
+		  (unsigned long)SFEX_MIN_BLOCKSIZE,
+		  (unsigned long)SFEX_MAX_BLOCKSIZE);
+	  exit(4);
+	}
+	sector_size = l;
+      }
+      break;
     case 'n':			/* -n <numlocks> */
       {
 	unsigned long l = strtoul(optarg, NULL, 10);
@@ -132,6 +161,20 @@ main(int argc, char *argv[]) {
 	numlocks = l;
       }
       break;
+    case 's':			/* -s <numslots> */
+      {
+	unsigned long l = strtoul(optarg, NULL, 10);
+	if (l < SFEX_MIN_NUMSLOTS || l > SFEX_MAX_NUMSLOTS) {
+	  fprintf(stderr,
+		  "%s: ERROR: numslots %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+		  progname, optarg,
+		  (unsigned long)SFEX_MIN_NUMSLOTS,
+		  (unsigned long)SFEX_MAX_NUMSLOTS);
+	  exit(4);
+	}
+	numslots = l;
+      }
+      break;
     case '?':			/* error */
       usage(stderr);
       exit(4);
@@ -158,19 +201,24 @@ main(int argc, char *argv[]) {
   nodename = get_nodename();
 
   /* create and control data and lock data */
-  init_controldata(&cdata, sector_size, numlocks);
+  init_controldata(&cdata, sector_size, numlocks, numslots);
   init_lockdata(&ldata);
 
-  /* write out control data and lock data */
-  write_controldata(&cdata);
+  /* write out control data and lock data in one go */
   {
-    int index;
-    for (index = 1; index <= numlocks; index++)
-      if (write_lockdata(&cdata, &ldata, index) == -1) {
-        fprintf(stderr, "%s: ERROR: cannot write lock data (index=%d).\n",
-                progname, index);
-        exit(3);
-      }
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (write_metadata(&cdata, &ldata) == -1) {
+      fprintf(stderr, "%s: ERROR: cannot write meta-data.\n", progname);
+      exit(3);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("%s: initialized %d lock(s), %lu bytes, in %.1f ms\n",
+	   device, numlocks,
+	   (unsigned long)(cdata.blocksize * (1 + numlocks * (1 + numslots))),
+	   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
   }
 
   exit(0);
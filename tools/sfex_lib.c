@@ -41,24 +41,557 @@
 #include <sys/ioctl.h>
 #include <syslog.h>
 #include <linux/fs.h>
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <limits.h>
 
 #include "sfex.h"
 #include "sfex_lib.h"
 
 static void *locked_mem;
+static void *slots_mem;		/* numslots blocks, for read_slots() */
 static int dev_fd;
 unsigned long sector_size = 0;
 
+/*
+ * Every device opened by prepare_lock(). dev_fd and locked_mem are those of
+ * the selected one (see select_device()); the *_all functions work on all
+ * of them at once.
+ */
+typedef struct sfex_device {
+  int fd;
+  void *mem;			/* one block */
+  int inflight;			/* an abandoned request still owns mem */
+#ifdef SFEX_TESTING
+  long sim_done_at;		/* end of a simulated late request */
+#endif
+} sfex_device;
+
+static sfex_device devices[SFEX_MAX_DEVICES];
+static int ndevices;
+static int cur_device;
+
+#ifdef SFEX_TESTING
+/*
+ * injected_io_delay --- simulate a slow shared disk
+ *
+ * When SFEX_TESTING_IO_DELAY is set to "<min>[-<max>]" (milliseconds), every
+ * lock I/O is delayed by a random time in that range. This is used by
+ * sfex_sim to see how the lock timing behaves on a sluggish LUN.
+ * SFEX_TESTING_IO_DELAY_<n> overrides it for the n-th device (1 origin),
+ * so that one LUN of several can be made slow.
+ * Returns the delay for the next I/O on device dev in milliseconds.
+ */
+static long
+injected_io_delay (int dev)
+{
+  static long min_ms[SFEX_MAX_DEVICES], max_ms[SFEX_MAX_DEVICES];
+  static int parsed[SFEX_MAX_DEVICES];
+
+  if (!parsed[dev]) {
+    char name[40];
+    const char *spec;
+    char *endp;
+
+    snprintf (name, sizeof (name), "SFEX_TESTING_IO_DELAY_%d", dev + 1);
+    spec = getenv (name);
+    if (!spec)
+      spec = getenv ("SFEX_TESTING_IO_DELAY");
+    if (spec && *spec) {
+      min_ms[dev] = strtol (spec, &endp, 10);
+      max_ms[dev] = (*endp == '-') ? strtol (endp + 1, NULL, 10) : min_ms[dev];
+      if (min_ms[dev] < 0 || max_ms[dev] < min_ms[dev])
+	min_ms[dev] = max_ms[dev] = 0;
+      srandom (getpid ());
+    }
+    parsed[dev] = 1;
+  }
+  if (max_ms[dev] == 0)
+    return 0;
+  return min_ms[dev] + (max_ms[dev] > min_ms[dev]
+			? random () % (max_ms[dev] - min_ms[dev] + 1) : 0);
+}
+#else
+#define injected_io_delay(dev) 0L
+#endif
+
+static int io_deadline_set;	/* lock I/O is bounded by io_deadline */
+static struct timespec io_deadline;
+static aio_context_t aio_ctx;
+static int aio_unavailable;
+static uint64_t aio_batch;	/* tags requests, see lock_io() */
+
+static int
+sys_io_setup (unsigned nr_events, aio_context_t * ctx)
+{
+  return syscall (__NR_io_setup, nr_events, ctx);
+}
+
+static int
+sys_io_submit (aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+  return syscall (__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int
+sys_io_getevents (aio_context_t ctx, long min_nr, long nr,
+		  struct io_event *events, struct timespec *timeout)
+{
+  return syscall (__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static int
+sys_io_cancel (aio_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+  return syscall (__NR_io_cancel, ctx, iocb, result);
+}
+
+/*
+ * set_io_deadline --- bound the following lock I/O in time
+ *
+ * Every lock I/O issued after this call must complete within msec
+ * milliseconds from now, or it fails with ETIMEDOUT. 0 removes the bound.
+ */
+void
+set_io_deadline (long msec)
+{
+  if (msec <= 0) {
+    io_deadline_set = 0;
+    return;
+  }
+  clock_gettime (CLOCK_MONOTONIC, &io_deadline);
+  io_deadline.tv_sec += msec / 1000;
+  io_deadline.tv_nsec += (msec % 1000) * 1000000;
+  if (io_deadline.tv_nsec >= 1000000000) {
+    io_deadline.tv_sec++;
+    io_deadline.tv_nsec -= 1000000000;
+  }
+  io_deadline_set = 1;
+}
+
+/* stragglers of lock_io_all() get at least this long, in milliseconds */
+#define STRAGGLER_GRACE 20
+
+static long
+now_msec (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* milliseconds left until io_deadline, never negative */
+static long
+io_time_left (void)
+{
+  struct timespec now;
+  long left;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  left = (io_deadline.tv_sec - now.tv_sec) * 1000
+    + (io_deadline.tv_nsec - now.tv_nsec) / 1000000;
+  return left > 0 ? left : 0;
+}
+
+/* set up aio_ctx on first use; 0 if AIO can't bound the lock I/O */
+static int
+aio_ready (void)
+{
+  if (io_deadline_set && !aio_ctx && !aio_unavailable) {
+    if (sys_io_setup (SFEX_MAX_DEVICES, &aio_ctx) == -1) {
+      cl_log(LOG_WARNING, "AIO is not available, lock I/O is not bounded in time: %s\n",
+		    strerror (errno));
+      aio_ctx = 0;
+      aio_unavailable = 1;
+    }
+  }
+  return io_deadline_set && aio_ctx;
+}
+
+/* mark the device of a late completion usable again */
+static void
+reap_abandoned (const struct io_event *ev)
+{
+  int dev = ev->data & 0xff;
+
+  if (dev < ndevices && devices[dev].inflight) {
+    devices[dev].inflight = 0;
+    cl_log(LOG_INFO, "late lock I/O on device %d completed\n", dev + 1);
+  }
+}
+
+/*
+ * poll_abandoned --- see whether abandoned requests have completed
+ *
+ * A device whose request was abandoned at the deadline can't be used until 
+ * the kernel gives its block back. Any completion carrying an old tag is 
+ * such a request.
+ */
+static void
+poll_abandoned (void)
+{
+  struct io_event evs[SFEX_MAX_DEVICES];
+  struct timespec ts = { 0, 0 };
+  int i, n, busy = 0;
+
+  for (i = 0; i < ndevices; i++) {
+#ifdef SFEX_TESTING
+    if (devices[i].inflight && devices[i].sim_done_at
+	&& now_msec () >= devices[i].sim_done_at) {
+      devices[i].inflight = 0;
+      devices[i].sim_done_at = 0;
+    }
+#endif
+    busy |= devices[i].inflight;
+  }
+  if (!busy || !aio_ctx)
+    return;
+  n = sys_io_getevents (aio_ctx, 0, SFEX_MAX_DEVICES, evs, &ts);
+  for (i = 0; i < n; i++)
+    reap_abandoned (&evs[i]);
+}
+
+/*
+ * lock_io --- read or write one piece of meta-data
+ *
+ * Without a deadline this is a blocking pread/pwrite, retried on EINTR and 
+ * EAGAIN. With a deadline (see set_io_deadline()) the request is submitted 
+ * through Linux AIO and abandoned when the deadline passes, so that a hung 
+ * LUN makes the caller fail instead of blocking it forever. In that case 
+ * errno is ETIMEDOUT, and since the kernel may still own the buffer, lock 
+ * I/O on the device fails as well until the request completes. Each 
+ * request is tagged with aio_batch, so that the late completion of an 
+ * abandoned one is not taken for the completion of a newer one.
+ * If AIO is not available we fall back to blocking I/O. Buffered I/O (a 
+ * file on a filesystem without O_DIRECT) completes while being submitted, 
+ * so the deadline does not interrupt it.
+ *
+ * return value --- number of bytes transferred, or -1 on error
+ */
+static ssize_t
+lock_io (int is_write, void *buf, size_t len, off_t offset)
+{
+  long delay = injected_io_delay (cur_device);
+  struct iocb cb, *cbs[1] = { &cb };
+  struct io_event ev;
+
+  poll_abandoned ();
+  if (devices[cur_device].inflight) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  if (delay > 0) {
+    if (io_deadline_set && delay >= io_time_left ()) {
+      usleep (io_time_left () * 1000);
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    usleep (delay * 1000);
+  }
+
+  if (!aio_ready ()) {
+    do {
+      ssize_t s = is_write ? pwrite (dev_fd, buf, len, offset)
+	: pread (dev_fd, buf, len, offset);
+      if (s == -1 && (errno == EINTR || errno == EAGAIN))
+	continue;
+      return s;
+    } while (1);
+  }
+
+  memset (&cb, 0, sizeof (cb));
+  cb.aio_fildes = dev_fd;
+  cb.aio_lio_opcode = is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+  cb.aio_buf = (uintptr_t) buf;
+  cb.aio_nbytes = len;
+  cb.aio_offset = offset;
+  cb.aio_data = (++aio_batch << 8) | cur_device;
+
+  while (sys_io_submit (aio_ctx, 1, cbs) != 1) {
+    if (errno == EINTR || errno == EAGAIN) {
+      if (io_time_left () > 0)
+	continue;
+      errno = ETIMEDOUT;
+    }
+    return -1;
+  }
+
+  do {
+    long left = io_time_left ();
+    struct timespec ts = { left / 1000, (left % 1000) * 1000000 };
+    int n = sys_io_getevents (aio_ctx, 1, 1, &ev, &ts);
+
+    if (n == 1 && ev.data != cb.aio_data) {
+      reap_abandoned (&ev);
+      continue;
+    }
+    if (n == 1) {
+      if ((long) ev.res < 0) {
+	errno = -(long) ev.res;
+	return -1;
+      }
+      return ev.res;
+    }
+    if (n == -1 && errno != EINTR)
+      return -1;
+  } while (io_time_left () > 0);
+
+  if (sys_io_cancel (aio_ctx, &cb, &ev) != 0)
+    devices[cur_device].inflight = 1;
+  cl_log(LOG_ERR, "lock I/O did not complete in time\n");
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+#ifdef SFEX_TESTING
+/*
+ * simulate_delays --- injected delays for lock_io_all()
+ *
+ * Each device gets its own delay, and lock_io_all() waits as it would for 
+ * real requests taking that long. The I/O of a device left behind is not 
+ * done, and the device counts as busy until its delay has passed.
+ */
+static void
+simulate_delays (int *ok, int need)
+{
+  long d[SFEX_MAX_DEVICES], sorted[SFEX_MAX_DEVICES], start = now_msec ();
+  long left = io_deadline_set ? io_time_left () : LONG_MAX, cutoff, max = 0;
+  int i, j, n = 0;
+
+  for (i = 0; i < ndevices; i++) {
+    if (!ok[i])
+      continue;
+    d[i] = injected_io_delay (i);
+    for (j = n++; j > 0 && sorted[j - 1] > d[i]; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = d[i];
+    if (d[i] > max)
+      max = d[i];
+  }
+  cutoff = max < left ? max : left;
+  if (need > 0 && need <= n) {
+    long quorum = sorted[need - 1];
+    long grace = quorum > STRAGGLER_GRACE ? quorum : STRAGGLER_GRACE;
+    if (quorum + grace < cutoff)
+      cutoff = quorum + grace;
+  }
+  for (i = 0; i < ndevices; i++) {
+    if (ok[i] && (d[i] > cutoff || d[i] >= left)) {
+      ok[i] = 0;
+      devices[i].inflight = 1;
+      devices[i].sim_done_at = start + d[i];
+      cl_log(LOG_ERR, "lock I/O on device %d did not complete in time\n", i + 1);
+    }
+  }
+  if (cutoff > 0)
+    usleep (cutoff * 1000);
+}
+#else
+#define simulate_delays(ok, need)
+#endif
+
+/*
+ * lock_io_all --- read or write one block on several devices at once
+ *
+ * The I/O is done in the block of each device (sfex_device.mem). All 
+ * requests are submitted together. Once need of them have completed, the 
+ * others are given as long again as that took (at least STRAGGLER_GRACE 
+ * ms), and never more than the deadline. So a slow or dead device neither 
+ * holds the others up nor eats the time of the next step. A request left 
+ * behind keeps its device busy until it completes (see poll_abandoned()).
+ *
+ * ok --- one flag per device. On entry, the devices to do the I/O on; on 
+ * return, those on which it completed.
+ *
+ * need --- the number of devices the caller can't do without, 0 to wait 
+ * for all of them
+ *
+ * return value --- the number of devices on which the I/O completed
+ */
+static int
+lock_io_all (int is_write, size_t len, off_t offset, int *ok, int need)
+{
+  struct iocb cbs[SFEX_MAX_DEVICES], *cbp[SFEX_MAX_DEVICES];
+  struct io_event evs[SFEX_MAX_DEVICES];
+  int submitted[SFEX_MAX_DEVICES];
+  int i, n = 0, pending = 0, done = 0;
+  long start = now_msec (), stop = -1;
+
+  poll_abandoned ();
+  for (i = 0; i < ndevices; i++)
+    if (ok[i] && devices[i].inflight)
+      ok[i] = 0;
+  simulate_delays (ok, need);
+
+  if (!aio_ready ()) {
+    for (i = 0; i < ndevices; i++) {
+      ssize_t s;
+
+      if (!ok[i])
+	continue;
+      do {
+	s = is_write ? pwrite (devices[i].fd, devices[i].mem, len, offset)
+	  : pread (devices[i].fd, devices[i].mem, len, offset);
+      } while (s == -1 && (errno == EINTR || errno == EAGAIN));
+      ok[i] = (s == (ssize_t) len);
+      done += ok[i];
+    }
+    return done;
+  }
+
+  aio_batch++;
+  for (i = 0; i < ndevices; i++) {
+    submitted[i] = 0;
+    if (!ok[i])
+      continue;
+    memset (&cbs[i], 0, sizeof (cbs[i]));
+    cbs[i].aio_fildes = devices[i].fd;
+    cbs[i].aio_lio_opcode = is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+    cbs[i].aio_buf = (uintptr_t) devices[i].mem;
+    cbs[i].aio_nbytes = len;
+    cbs[i].aio_offset = offset;
+    cbs[i].aio_data = (aio_batch << 8) | i;
+    cbp[n++] = &cbs[i];
+  }
+
+  /* io_submit may take only a part of the batch */
+  for (i = 0; i < n; ) {
+    int r = sys_io_submit (aio_ctx, n - i, cbp + i);
+    if (r > 0) {
+      while (r-- > 0) {
+	submitted[cbp[i]->aio_data & 0xff] = 1;
+	pending++;
+	i++;
+      }
+    } else if (r == -1 && (errno == EINTR || errno == EAGAIN)
+	       && io_time_left () > 0) {
+      continue;
+    } else {
+      cl_log(LOG_ERR, "can't submit lock I/O: %s\n", strerror (errno));
+      break;
+    }
+  }
+  for (i = 0; i < ndevices; i++)
+    ok[i] = 0;
+
+  while (pending > 0) {
+    long left = io_time_left ();
+    struct timespec ts;
+    int r, e;
+
+    if (stop >= 0 && stop - now_msec () < left)
+      left = stop - now_msec ();
+    if (left <= 0)
+      break;
+    ts.tv_sec = left / 1000;
+    ts.tv_nsec = (left % 1000) * 1000000;
+    r = sys_io_getevents (aio_ctx, 1, SFEX_MAX_DEVICES, evs, &ts);
+    if (r == -1) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    for (e = 0; e < r; e++) {
+      if ((evs[e].data >> 8) != aio_batch) {
+	reap_abandoned (&evs[e]);
+	continue;
+      }
+      i = evs[e].data & 0xff;
+      if (!submitted[i])
+	continue;
+      submitted[i] = 0;
+      pending--;
+      ok[i] = ((long) evs[e].res == (long) len);
+      done += ok[i];
+      if (need > 0 && done == need && stop < 0) {
+	long took = now_msec () - start;
+	stop = now_msec () + (took > STRAGGLER_GRACE ? took : STRAGGLER_GRACE);
+      }
+    }
+  }
+
+  for (i = 0; i < ndevices; i++) {
+    struct io_event ev;
+
+    if (!submitted[i])
+      continue;
+    if (sys_io_cancel (aio_ctx, &cbs[i], &ev) != 0)
+      devices[i].inflight = 1;
+    cl_log(LOG_ERR, "lock I/O on device %d did not complete in time\n", i + 1);
+  }
+  return done;
+}
+
+/*
+ * get_file_blocksize --- block size of sfex meta-data kept in a regular file
+ *
+ * A regular file has no sector size of its own, so we take the block size
+ * recorded in the control data by sfex_init. If the file was not
+ * initialized yet, SFEX_DEFAULT_BLOCKSIZE is used.
+ */
+static unsigned long
+get_file_blocksize (const char *device)
+{
+  sfex_controldata_ondisk block;
+  unsigned long blocksize = SFEX_DEFAULT_BLOCKSIZE;
+  int fd;
+
+  fd = open (device, O_RDONLY);
+  if (fd == -1)
+    return blocksize;
+  if (pread (fd, &block, sizeof (block), 0) == sizeof (block)
+      && !memcmp (block.magic, SFEX_MAGIC, sizeof (block.magic))
+      && !block.blocksize[sizeof (block.blocksize) - 1]) {
+    unsigned long l = strtoul ((char *) (block.blocksize), NULL, 10);
+    if (l >= SFEX_MIN_BLOCKSIZE && l <= SFEX_MAX_BLOCKSIZE && !(l % SFEX_MIN_BLOCKSIZE))
+      blocksize = l;
+  }
+  close (fd);
+  return blocksize;
+}
+
+/*
+ * prepare_lock --- open the meta-data device
+ *
+ * device may be a block device or a regular file. For a block device the
+ * block size is its logical sector size. For a regular file it is the value
+ * preset in sector_size (sfex_init -b), or else the one recorded in the
+ * control data. Regular files on filesystems which refuse O_DIRECT (tmpfs 
+ * for instance) are accessed with O_SYNC only; a block device must take 
+ * O_DIRECT.
+ * It may be called for several devices; they then share the block size and 
+ * are used through select_device() or the *_all functions.
+ */
 int
 prepare_lock (const char *device)
 {
   int sec_tmp = 0;
+  int flags = O_RDWR | O_DIRECT | O_SYNC;
+  struct stat st;
+
+  if (ndevices == SFEX_MAX_DEVICES) {
+    cl_log(LOG_ERR, "too many devices. at most %d can be used.\n",
+		  SFEX_MAX_DEVICES);
+    exit (3);
+  }
 
   do {
-    dev_fd = open (device, O_RDWR | O_DIRECT | O_SYNC);
+    dev_fd = open (device, flags);
     if (dev_fd == -1) {
       if (errno == EINTR || errno == EAGAIN)
 	continue;
+      /* only a regular file may do without O_DIRECT: on a shared
+	 block device the page cache would hide the other nodes' writes */
+      if (errno == EINVAL && (flags & O_DIRECT)
+	  && stat (device, &st) == 0 && S_ISREG (st.st_mode)) {
+	cl_log(LOG_WARNING, "%s does not support O_DIRECT, using O_SYNC only\n",
+		      device);
+	flags &= ~O_DIRECT;
+	continue;
+      }
       cl_log(LOG_ERR, "can't open device %s: %s\n",
 		    device, strerror (errno));
       exit (3);
@@ -67,11 +600,27 @@ prepare_lock (const char *device)
   }
   while (1);
 
-  ioctl(dev_fd, BLKSSZGET, &sec_tmp);
-  sector_size = (unsigned long)sec_tmp;
-  if (sector_size == 0) {
-	  cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
-	  exit(EXIT_FAILURE);
+  if (fstat (dev_fd, &st) == -1) {
+    cl_log(LOG_ERR, "can't stat device %s: %s\n",
+		  device, strerror (errno));
+    exit (3);
+  }
+
+  if (S_ISREG (st.st_mode)) {
+    if (sector_size == 0)
+      sector_size = get_file_blocksize (device);
+  } else {
+    ioctl(dev_fd, BLKSSZGET, &sec_tmp);
+    if (sec_tmp == 0) {
+	    cl_log(LOG_ERR, "Get sector size failed: %s\n", strerror(errno));
+	    exit(EXIT_FAILURE);
+    }
+    if (sector_size != 0 && sector_size != (unsigned long)sec_tmp) {
+	    cl_log(LOG_ERR, "blocksize %lu does not match the sector size %d of %s\n",
+			  sector_size, sec_tmp, device);
+	    exit(3);
+    }
+    sector_size = (unsigned long)sec_tmp;
   }
 
   if (posix_memalign
@@ -82,9 +631,28 @@ prepare_lock (const char *device)
   }
   memset (locked_mem, 0, sector_size);
 
+  devices[ndevices].fd = dev_fd;
+  devices[ndevices].mem = locked_mem;
+  devices[ndevices].inflight = 0;
+  ndevices++;
+  select_device (0);
+
   return 0;
 }
 
+/*
+ * select_device --- choose the device used by the single device functions
+ *
+ * dev --- the order of the device in the prepare_lock() calls. 0 origin.
+ */
+void
+select_device (int dev)
+{
+  cur_device = dev;
+  dev_fd = devices[dev].fd;
+  locked_mem = devices[dev].mem;
+}
+
 /*
  * get_progname --- a program name
  *
@@ -141,13 +709,15 @@ get_nodename (void)
  * We initialize each member of sfex_controldata structure.
  */
 void
-init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks)
+init_controldata (sfex_controldata * cdata, size_t blocksize, int numlocks,
+		  int numslots)
 {
   memcpy (cdata->magic, SFEX_MAGIC, sizeof (cdata->magic));
-  cdata->version = SFEX_VERSION;
+  cdata->version = numslots ? SFEX_SLOT_VERSION : SFEX_VERSION;
   cdata->revision = SFEX_REVISION;
   cdata->blocksize = blocksize;
   cdata->numlocks = numlocks;
+  cdata->numslots = numslots;
 }
 
 /*
@@ -164,23 +734,42 @@ init_lockdata (sfex_lockdata * ldata)
 }
 
 /*
- * write_controldata --- write control data into file
- *
- * We write sfex_controldata struct into file. We open a file with 
- * synchronization mode and write out control data.
- *
- * cdata --- pointer of control data
+ * init_slotdata --- initialize slot data
  *
- * device --- name of target file
+ * We initialize each member of sfex_slotdata structure.
  */
 void
-write_controldata (const sfex_controldata * cdata)
+init_slotdata (sfex_slotdata * sdata)
 {
-  sfex_controldata_ondisk *block;
-  int fd;
+  sdata->status = SFEX_SLOT_IDLE;
+  sdata->count = 0;
+  sdata->ballot = 0;
+  sdata->nodename[0] = 0;
+}
 
-  block = (sfex_controldata_ondisk *) (locked_mem);
+/*
+ * slot_offset --- position of slot data in the meta-data area
+ *
+ * index --- index number for lock data. 1 origine.
+ *
+ * slot --- slot number. 1 origine.
+ */
+static off_t
+slot_offset (const sfex_controldata * cdata, int index, int slot)
+{
+  return (off_t) cdata->blocksize
+    * (1 + cdata->numlocks + (index - 1) * cdata->numslots + (slot - 1));
+}
 
+/*
+ * format_controldata --- build the on-disk image of control data
+ *
+ * block --- buffer of cdata->blocksize bytes
+ */
+static void
+format_controldata (sfex_controldata_ondisk * block,
+		    const sfex_controldata * cdata)
+{
   /* We write control data into the buffer with given format. */
   /* We write the offset value of each field of the control data directly.
    * Because a point using this value is limited to two places, we do not 
@@ -197,28 +786,80 @@ write_controldata (const sfex_controldata * cdata)
 	    (unsigned)cdata->blocksize);
   snprintf ((char *) (block->numlocks), sizeof (block->numlocks), "%d",
 	    cdata->numlocks);
+  if (cdata->numslots)
+    snprintf ((char *) (block->numslots), sizeof (block->numslots), "%d",
+	      cdata->numslots);
+}
 
-  fd = dev_fd;
-  if (lseek (fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    exit (3);
-  }
+/*
+ * format_lockdata --- build the on-disk image of lock data
+ *
+ * block --- buffer of cdata->blocksize bytes
+ */
+static void
+format_lockdata (sfex_lockdata_ondisk * block, const sfex_controldata * cdata,
+		 const sfex_lockdata * ldata)
+{
+  /* We write lock data into buffer with given format */
+  /* We write the offset value of each field of the control data directly.
+   * Because a point using this value is limited to two places, we do not 
+   * use macro. If you chage the following offset values, you must change 
+   * values in the read_lockdata() function.
+   */
+  memset (block, 0, cdata->blocksize);
+  block->status = ldata->status;
+  snprintf ((char *) (block->count), sizeof (block->count), "%d",
+	    ldata->count);
+  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
+	    ldata->nodename);
+}
+
+/*
+ * format_slotdata --- build the on-disk image of slot data
+ *
+ * block --- buffer of cdata->blocksize bytes
+ */
+static void
+format_slotdata (sfex_slotdata_ondisk * block, const sfex_controldata * cdata,
+		 const sfex_slotdata * sdata)
+{
+  /* If you change the following offset values, you must change values in 
+   * the read_slots() function.
+   */
+  memset (block, 0, cdata->blocksize);
+  block->status = sdata->status;
+  snprintf ((char *) (block->count), sizeof (block->count), "%d",
+	    sdata->count);
+  snprintf ((char *) (block->ballot), sizeof (block->ballot), "%llu",
+	    sdata->ballot);
+  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
+	    sdata->nodename);
+}
+
+/*
+ * write_controldata --- write control data into file
+ *
+ * We write sfex_controldata struct into file. We open a file with 
+ * synchronization mode and write out control data.
+ *
+ * cdata --- pointer of control data
+ *
+ * device --- name of target file
+ */
+void
+write_controldata (const sfex_controldata * cdata)
+{
+  sfex_controldata_ondisk *block;
+
+  block = (sfex_controldata_ondisk *) (locked_mem);
+  format_controldata (block, cdata);
 
   /* write buffer into a file  */
-  do {
-	  ssize_t s = write (fd, block, cdata->blocksize);
-	  if (s == -1) {
-		  if (errno == EINTR || errno == EAGAIN)
-			  continue;
-		  cl_log(LOG_ERR, "can't write meta-data: %s\n",
-				strerror (errno));
-		  exit (3);
-	  }
-	  else
-		  break;
+  if (lock_io (1, block, cdata->blocksize, 0) == -1) {
+    cl_log(LOG_ERR, "can't write meta-data: %s\n",
+		  strerror (errno));
+    exit (3);
   }
-  while (1);
 }
 
 /*
@@ -240,37 +881,14 @@ write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
 		int index)
 {
   sfex_lockdata_ondisk *block;
-  int fd;
 
   block = (sfex_lockdata_ondisk *) locked_mem;
-  /* We write lock data into buffer with given format */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the read_lockdata() function.
-   */
-  memset (block, 0, cdata->blocksize);
-  block->status = ldata->status;
-  snprintf ((char *) (block->count), sizeof (block->count), "%d",
-	    ldata->count);
-  snprintf ((char *) (block->nodename), sizeof (block->nodename), "%s",
-	    ldata->nodename);
-
-  fd = dev_fd;
-
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
-  }
+  format_lockdata (block, cdata, ldata);
 
   /* write buffer into file */
-  do {
-    ssize_t s = write (fd, block, cdata->blocksize);
+  {
+    ssize_t s = lock_io (1, block, cdata->blocksize, cdata->blocksize * index);
     if (s == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-	continue;
       cl_log(LOG_ERR, "can't write meta-data: %s\n",
 		    strerror (errno));
       return -1;
@@ -280,12 +898,100 @@ write_lockdata (const sfex_controldata * cdata, const sfex_lockdata * ldata,
       cl_log(LOG_ERR, "can't write meta-data atomically.\n");
       return -1;
     }
-    break;
   }
-  while (1);
   return 0;
 }
 
+/*
+ * write_metadata --- write the whole meta-data area at once
+ *
+ * We build the control data, numlocks copies of ldata and, if the control 
+ * data has slots, idle slot data for every lock in one aligned buffer 
+ * and write it with a few large writes of at most SFEX_BULK_IO_SIZE 
+ * bytes, instead of one synchronous write per block. The area is then read 
+ * back and compared, so that a silently dropped write is noticed.
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- pointer for lock data written to every index
+ *
+ * return value --- 0 on success, -1 on error
+ */
+int
+write_metadata (const sfex_controldata * cdata, const sfex_lockdata * ldata)
+{
+  size_t len = cdata->blocksize
+    * (1 + cdata->numlocks + cdata->numlocks * cdata->numslots);
+  size_t chunk = SFEX_BULK_IO_SIZE - SFEX_BULK_IO_SIZE % cdata->blocksize;
+  uint8_t *area = NULL, *check = NULL;
+  size_t off;
+  int index, ret = -1;
+
+  if (chunk == 0)
+    chunk = cdata->blocksize;
+
+  if (posix_memalign ((void **) (&area), SFEX_ODIRECT_ALIGNMENT, len) != 0
+      || posix_memalign ((void **) (&check), SFEX_ODIRECT_ALIGNMENT, len) != 0) {
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
+    goto out;
+  }
+
+  format_controldata ((sfex_controldata_ondisk *) area, cdata);
+  for (index = 1; index <= cdata->numlocks; index++)
+    format_lockdata ((sfex_lockdata_ondisk *) (area + cdata->blocksize * index),
+		     cdata, ldata);
+  if (cdata->numslots) {
+    sfex_slotdata sdata;
+    int slot;
+
+    init_slotdata (&sdata);
+    for (index = 1; index <= cdata->numlocks; index++)
+      for (slot = 1; slot <= cdata->numslots; slot++)
+	format_slotdata ((sfex_slotdata_ondisk *)
+			 (area + slot_offset (cdata, index, slot)), cdata, &sdata);
+  }
+
+  for (off = 0; off < len; ) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    ssize_t s;
+
+    s = lock_io (1, area + off, n, off);
+    if (s == -1) {
+      cl_log(LOG_ERR, "can't write meta-data: %s\n", strerror (errno));
+      goto out;
+    } else if ((size_t)s != n) {
+      cl_log(LOG_ERR, "can't write meta-data atomically.\n");
+      goto out;
+    }
+    off += n;
+  }
+
+  for (off = 0; off < len; ) {
+    size_t n = len - off < chunk ? len - off : chunk;
+    ssize_t s;
+
+    s = lock_io (0, check + off, n, off);
+    if (s == -1) {
+      cl_log(LOG_ERR, "can't read meta-data back: %s\n", strerror (errno));
+      goto out;
+    } else if ((size_t)s != n) {
+      cl_log(LOG_ERR, "can't read meta-data back atomically.\n");
+      goto out;
+    }
+    off += n;
+  }
+  if (memcmp (area, check, len)) {
+    cl_log(LOG_ERR, "meta-data read back differs from what was written.\n");
+    goto out;
+  }
+  ret = 0;
+
+out:
+  free (area);
+  free (check);
+  return ret;
+}
+
 /*
  * read_controldata --- read control data from file
  *
@@ -302,27 +1008,14 @@ read_controldata (sfex_controldata * cdata)
 
   block = (sfex_controldata_ondisk *) (locked_mem);
 
-  if (lseek (dev_fd, 0, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
+  /* read data from file */
+  if (lock_io (0, block, sector_size, 0) == -1) {
+    cl_log(LOG_ERR,
+	    "can't read controldata meta-data: %s\n",
+	    strerror (errno));
     return -1;
   }
 
-  /* read data from file */
-  do {
-	  ssize_t s = read (dev_fd, block, sector_size);
-	  if (s == -1) {
-		  if (errno == EINTR || errno == EAGAIN)
-			  continue;
-		  cl_log(LOG_ERR,
-			  "can't read controldata meta-data: %s\n",
-			   strerror (errno));
-		  return -1;
-	  }
-	  else
-		  break;
-  } while (1);
-
   /* read control data from buffer */
   /* 1. check the magic number.  2. check null terminator of each field 
      3. check the version number.  4. Unmuch of revision number is allowed  */
@@ -339,12 +1032,13 @@ read_controldata (sfex_controldata * cdata)
   if (block->version[sizeof (block->version)-1]
       || block->revision[sizeof (block->revision)-1]
       || block->blocksize[sizeof (block->blocksize)-1]
-      || block->numlocks[sizeof (block->numlocks)-1]) {
+      || block->numlocks[sizeof (block->numlocks)-1]
+      || block->numslots[sizeof (block->numslots)-1]) {
     cl_log(LOG_ERR, "control data format error.\n");
     return -1;
   }
   cdata->version = atoi ((char *) (block->version));
-  if (cdata->version != SFEX_VERSION) {
+  if (cdata->version != SFEX_VERSION && cdata->version != SFEX_SLOT_VERSION) {
     cl_log(LOG_ERR,
       "version number mismatched. program is %d, data is %d.\n",
        SFEX_VERSION, cdata->version);
@@ -353,10 +1047,56 @@ read_controldata (sfex_controldata * cdata)
   cdata->revision = atoi ((char *) (block->revision));
   cdata->blocksize = atoi ((char *) (block->blocksize));
   cdata->numlocks = atoi ((char *) (block->numlocks));
+  /* empty before revision 4, which reads as 0 (classic) */
+  cdata->numslots = atoi ((char *) (block->numslots));
+  if (cdata->numslots != 0 && (cdata->numslots < SFEX_MIN_NUMSLOTS
+			       || cdata->numslots > SFEX_MAX_NUMSLOTS)) {
+    cl_log(LOG_ERR, "control data format error.\n");
+    return -1;
+  }
+  /* slots come with their own version, see sfex_controldata */
+  if ((cdata->version == SFEX_SLOT_VERSION) != (cdata->numslots != 0)) {
+    cl_log(LOG_ERR, "control data format error.\n");
+    return -1;
+  }
 
   return 0;
 }
 
+/*
+ * parse_lockdata --- read lock data from its on-disk image
+ */
+static int
+parse_lockdata (const sfex_lockdata_ondisk * block, sfex_lockdata * ldata)
+{
+  /* read control data form buffer */
+  /* 1. check null terminator of each field 2. check the status */
+  /* We write the offset value of each field of the control data directly.
+   * Because a point using this value is limited to two places, we do not 
+   * use macro. If you chage the following offset values, you must change 
+   * values in the write_lockdata() function.
+   */
+  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
+    cl_log(LOG_ERR, "lock data format error.\n");
+    return -1;
+  }
+  ldata->status = block->status;
+  if (ldata->status != SFEX_STATUS_UNLOCK
+      && ldata->status != SFEX_STATUS_LOCK) {
+    cl_log(LOG_ERR, "lock data format error.\n");
+    return -1;
+  }
+  ldata->count = atoi ((const char *) (block->count));
+  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(ldata->nodename));
+
+#ifdef SFEX_DEBUG
+  cl_log(LOG_INFO, "status: %c\n", ldata->status);
+  cl_log(LOG_INFO, "count: %d\n", ldata->count);
+  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
+#endif
+  return 0;
+}
+
 /*
  * read_lockdata --- read lock data from file
  *
@@ -377,25 +1117,13 @@ read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
 	       int index)
 {
   sfex_lockdata_ondisk *block;
-  int fd;
 
   block = (sfex_lockdata_ondisk *) (locked_mem);
 
-  fd = dev_fd;
-
-  /* seek a file pointer to given position */
-  if (lseek (fd, cdata->blocksize * index, SEEK_SET) == -1) {
-    cl_log(LOG_ERR, "can't seek file pointer: %s\n",
-		  strerror (errno));
-    return -1;
-  }
-
   /* read from file */
-  do {
-    ssize_t s = read (fd, block, cdata->blocksize);
+  {
+    ssize_t s = lock_io (0, block, cdata->blocksize, cdata->blocksize * index);
     if (s == -1) {
-      if (errno == EINTR || errno == EAGAIN)
-	continue;
       cl_log(LOG_ERR, "can't read lockdata meta-data: %s\n",
 		    strerror (errno));
       return -1;
@@ -404,35 +1132,154 @@ read_lockdata (const sfex_controldata * cdata, sfex_lockdata * ldata,
       cl_log(LOG_ERR, "can't read meta-data atomically.\n");
       return -1;
     }
-    break;
   }
-  while (1);
 
-  /* read control data form buffer */
-  /* 1. check null terminator of each field 2. check the status */
-  /* We write the offset value of each field of the control data directly.
-   * Because a point using this value is limited to two places, we do not 
-   * use macro. If you chage the following offset values, you must change 
-   * values in the write_lockdata() function.
-   */
-  if (block->count[sizeof(block->count)-1] || block->nodename[sizeof(block->nodename)-1]) {
-    cl_log(LOG_ERR, "lock data format error.\n");
+  return parse_lockdata (block, ldata);
+}
+
+/*
+ * read_lockdata_all --- read lock data from every device at once
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of lock data, one per device
+ *
+ * index --- index number. 1 origin.
+ *
+ * ok, need --- see lock_io_all(). A device whose lock data is broken is 
+ * dropped as well.
+ *
+ * return value --- the number of devices read
+ */
+int
+read_lockdata_all (const sfex_controldata * cdata, sfex_lockdata * ldata,
+		   int index, int *ok, int need)
+{
+  int i, n = 0;
+
+  lock_io_all (0, cdata->blocksize, cdata->blocksize * index, ok, need);
+  for (i = 0; i < ndevices; i++) {
+    if (ok[i] && parse_lockdata (devices[i].mem, &ldata[i]) == -1)
+      ok[i] = 0;
+    n += ok[i];
+  }
+  return n;
+}
+
+/*
+ * write_lockdata_all --- write lock data to every device at once
+ *
+ * cdata --- pointer for control data
+ *
+ * ldata --- array of lock data, one per device
+ *
+ * index --- index number. 1 origin.
+ *
+ * ok, need --- see lock_io_all()
+ *
+ * return value --- the number of devices written
+ */
+int
+write_lockdata_all (const sfex_controldata * cdata,
+		    const sfex_lockdata * ldata, int index, int *ok, int need)
+{
+  int i;
+
+  for (i = 0; i < ndevices; i++)
+    if (ok[i])
+      format_lockdata (devices[i].mem, cdata, &ldata[i]);
+  return lock_io_all (1, cdata->blocksize, cdata->blocksize * index, ok, need);
+}
+
+/*
+ * write_slotdata --- write slot data into file
+ *
+ * cdata --- pointer for control data
+ *
+ * sdata --- pointer for slot data
+ *
+ * index --- index number for lock data. 1 origine.
+ *
+ * slot --- slot number. 1 origine.
+ */
+int
+write_slotdata (const sfex_controldata * cdata, const sfex_slotdata * sdata,
+		int index, int slot)
+{
+  sfex_slotdata_ondisk *block;
+  ssize_t s;
+
+  block = (sfex_slotdata_ondisk *) locked_mem;
+  format_slotdata (block, cdata, sdata);
+
+  s = lock_io (1, block, cdata->blocksize, slot_offset (cdata, index, slot));
+  if (s == -1) {
+    cl_log(LOG_ERR, "can't write meta-data: %s\n", strerror (errno));
+    return -1;
+  } else if (s != cdata->blocksize) {
+    cl_log(LOG_ERR, "can't write meta-data atomically.\n");
     return -1;
   }
-  ldata->status = block->status;
-  if (ldata->status != SFEX_STATUS_UNLOCK
-      && ldata->status != SFEX_STATUS_LOCK) {
-    cl_log(LOG_ERR, "lock data format error.\n");
+  return 0;
+}
+
+/*
+ * read_slots --- read all slot data of a lock
+ *
+ * The slots of one lock are contiguous, so they are read with one I/O.
+ *
+ * cdata --- pointer for control data
+ *
+ * slots --- array of cdata->numslots + 1 slot data. Slot s is stored into 
+ * slots[s]; slots[0] is not used.
+ *
+ * index --- index number for lock data. 1 origine.
+ */
+int
+read_slots (const sfex_controldata * cdata, sfex_slotdata * slots, int index)
+{
+  size_t len = cdata->blocksize * cdata->numslots;
+  ssize_t s;
+  int slot;
+
+  if (!slots_mem
+      && posix_memalign (&slots_mem, SFEX_ODIRECT_ALIGNMENT, len) != 0) {
+    slots_mem = NULL;
+    cl_log(LOG_ERR, "Failed to allocate aligned memory\n");
     return -1;
   }
-  ldata->count = atoi ((char *) (block->count));
-  strncpy ((char *) (ldata->nodename), (const char *) (block->nodename), sizeof(ldata->nodename));
 
-#ifdef SFEX_DEBUG
-  cl_log(LOG_INFO, "status: %c\n", ldata->status);
-  cl_log(LOG_INFO, "count: %d\n", ldata->count);
-  cl_log(LOG_INFO, "nodename: %s\n", ldata->nodename);
-#endif
+  s = lock_io (0, slots_mem, len, slot_offset (cdata, index, 1));
+  if (s == -1) {
+    cl_log(LOG_ERR, "can't read slot meta-data: %s\n", strerror (errno));
+    return -1;
+  } else if ((size_t)s != len) {
+    cl_log(LOG_ERR, "can't read meta-data atomically.\n");
+    return -1;
+  }
+
+  for (slot = 1; slot <= cdata->numslots; slot++) {
+    const sfex_slotdata_ondisk *block = (const sfex_slotdata_ondisk *)
+      ((uint8_t *) slots_mem + cdata->blocksize * (slot - 1));
+    sfex_slotdata *sdata = &slots[slot];
+
+    if (block->count[sizeof (block->count)-1]
+	|| block->ballot[sizeof (block->ballot)-1]
+	|| block->nodename[sizeof (block->nodename)-1]) {
+      cl_log(LOG_ERR, "slot data format error.\n");
+      return -1;
+    }
+    sdata->status = block->status;
+    if (sdata->status != SFEX_SLOT_IDLE && sdata->status != SFEX_SLOT_BID
+	&& sdata->status != SFEX_SLOT_COMMIT && sdata->status != SFEX_SLOT_HELD) {
+      cl_log(LOG_ERR, "slot data format error.\n");
+      return -1;
+    }
+    sdata->count = atoi ((const char *) (block->count));
+    sdata->ballot = strtoull ((const char *) (block->ballot), NULL, 10);
+    strncpy (sdata->nodename, (const char *) (block->nodename),
+	     sizeof (sdata->nodename));
+  }
   return 0;
 }
 
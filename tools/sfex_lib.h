@@ -30,13 +30,21 @@
 
 const char *get_progname(const char *argv0);
 char *get_nodename(void);
-void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks);
+void init_controldata(sfex_controldata *cdata, size_t blocksize, int numlocks, int numslots);
 void init_lockdata(sfex_lockdata *ldata);
+void init_slotdata(sfex_slotdata *sdata);
 void write_controldata(const sfex_controldata *cdata);
 int write_lockdata(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index);
+int write_metadata(const sfex_controldata *cdata, const sfex_lockdata *ldata);
 int read_controldata(sfex_controldata *cdata);
 int read_lockdata(const sfex_controldata *cdata, sfex_lockdata *ldata, int index);
+int write_slotdata(const sfex_controldata *cdata, const sfex_slotdata *sdata, int index, int slot);
+int read_slots(const sfex_controldata *cdata, sfex_slotdata *slots, int index);
 int prepare_lock(const char *device);
+void select_device(int dev);
+int read_lockdata_all(const sfex_controldata *cdata, sfex_lockdata *ldata, int index, int *ok, int need);
+int write_lockdata_all(const sfex_controldata *cdata, const sfex_lockdata *ldata, int index, int *ok, int need);
+void set_io_deadline(long msec);
 int lock_index_check(sfex_controldata * cdata, int index);
 
 #endif /* LIB_H */
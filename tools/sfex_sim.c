@@ -0,0 +1,523 @@
+/*-------------------------------------------------------------------------
+ *
+ * Shared Disk File EXclusiveness Control Program(SF-EX)
+ *
+ * sfex_sim.c --- Lock contention simulator and benchmark for SF-EX.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *-------------------------------------------------------------------------
+ *
+ * sfex_sim [-n <competitors>] [-d <duration>] [-k <kill_interval>]
+ *          [-D <min>[-<max>]] [-c <collision_timeout>] [-t <lock_timeout>]
+ *          [-m <monitor_interval>] [-b <blocksize>] [-s] [-x <daemon>]
+ *          <file> [<file>...]
+ *
+ * sfex_sim initializes <file> as sfex meta-data and runs <competitors>
+ * instances of sfex_daemon_sim (sfex_daemon built with SFEX_TESTING) which
+ * all try to take lock #1 of it. A competitor which fails to get the lock
+ * is restarted after a second, the same way the cluster keeps retrying a
+ * failed start. Every <kill_interval> seconds the current owner is killed
+ * with SIGKILL to provoke a failover. With -D every lock I/O of the
+ * competitors is delayed by a random time in the given range (ms).
+ * With -s the meta-data is put in slot mode (sfex_init -s) with one slot
+ * per competitor, so the slot protocol can be compared with the classic
+ * collision_timeout one.
+ * Several files (an odd number) make a lock spanning several devices; set
+ * SFEX_TESTING_IO_DELAY_<n> in the environment to slow down the n-th one.
+ *
+ * At the end a summary is printed: time to acquire, collision detection
+ * rate, dual-ownership violations (two competitors believing they hold the
+ * lock at the same time) and failover latency, from the kill to another
+ * competitor taking the lock. When the killed one is restarted and takes 
+ * the lock back first, that time is reported apart.
+ *
+ * exit code --- 0 - no dual-ownership was seen. 1 - dual-ownership was
+ * seen. 3 - Error occurs while processing it. 4 - The mistake is found in
+ * the command line parameter.
+ *
+ *-------------------------------------------------------------------------*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sfex.h"
+#include "sfex_lib.h"
+
+#define SIM_MAX_COMPETITORS 64
+#define SIM_RESTART_DELAY 1.0	/* seconds before a failed competitor retries */
+
+const char *progname;
+char *nodename;
+
+typedef enum {
+	SIM_IDLE,		/* waiting to be (re)started */
+	SIM_ACQUIRING,		/* started, lock not acquired yet */
+	SIM_OWNER		/* believes it holds the lock */
+} sim_state;
+
+typedef struct sim_competitor {
+	pid_t pid;
+	int fd;			/* read end of its stdout */
+	sim_state state;
+	double since;		/* start of the current state */
+	int killed;		/* SIGKILLed by us */
+	int reported;		/* outcome of the attempt seen */
+	char buf[256];
+	size_t buflen;
+} sim_competitor;
+
+typedef struct sim_stat {
+	int n;
+	double min, max, sum;
+} sim_stat;
+
+static sim_competitor comp[SIM_MAX_COMPETITORS];
+static int ncomp = 3;
+static int owners;
+
+static sim_stat acquire_time, failover_time, reclaim_time;
+static int attempts, acquired, collisions, busy, lost, errors;
+static int violations, kills;
+static double killed_at = -1;
+static int killed_owner = -1;	/* competitor killed at killed_at */
+static double sim_start;
+
+static char *daemon_path;
+static char **files;		/* the lock spans all of them */
+static int nfiles;
+static char *io_delay;
+static char collision_timeout[16] = "1";
+static char lock_timeout[16] = "5";
+static char monitor_interval[16] = "1";
+static int slot_mode;
+
+static void usage(FILE *dist) {
+	fprintf(dist, "usage: %s [-n <competitors>] [-d <duration>] [-k <kill_interval>] [-D <min>[-<max>]]\n"
+		"       [-c <collision_timeout>] [-t <lock_timeout>] [-m <monitor_interval>]\n"
+		"       [-b <blocksize>] [-s] [-x <daemon>] <file> [<file>...]\n", progname);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stat_add(sim_stat *st, double v)
+{
+	if (st->n == 0 || v < st->min)
+		st->min = v;
+	if (st->n == 0 || v > st->max)
+		st->max = v;
+	st->sum += v;
+	st->n++;
+}
+
+static void stat_print(const char *name, const sim_stat *st)
+{
+	if (st->n == 0) {
+		printf("%-20s n/a\n", name);
+		return;
+	}
+	printf("%-20s min %.3fs, avg %.3fs, max %.3fs (%d samples)\n",
+		name, st->min, st->sum / st->n, st->max, st->n);
+}
+
+static unsigned long get_ulong(const char *name, const char *arg,
+	unsigned long min, unsigned long max)
+{
+	char *endp;
+	unsigned long l = strtoul(arg, &endp, 10);
+
+	if (*endp || l < min || l > max) {
+		fprintf(stderr, "%s: ERROR: %s %s is out of range or invalid. it must be integer value between %lu and %lu.\n",
+			progname, name, arg, min, max);
+		exit(4);
+	}
+	return l;
+}
+
+/*
+ * init_files --- write fresh meta-data with one lock into the backing files
+ *
+ * In slot mode every competitor gets a slot of its own.
+ */
+static void init_files(void)
+{
+	sfex_controldata cdata;
+	sfex_lockdata ldata;
+	int i;
+
+	for (i = 0; i < nfiles; i++)
+		prepare_lock(files[i]);
+	init_controldata(&cdata, sector_size, 1, slot_mode ? ncomp : 0);
+	init_lockdata(&ldata);
+	for (i = 0; i < nfiles; i++) {
+		select_device(i);
+		if (write_metadata(&cdata, &ldata) == -1) {
+			fprintf(stderr, "%s: ERROR: cannot write meta-data to %s.\n",
+				progname, files[i]);
+			exit(3);
+		}
+	}
+}
+
+static void start_competitor(int i)
+{
+	sim_competitor *c = &comp[i];
+	char name[32], slot[16];
+	int pfd[2];
+
+	if (pipe(pfd) == -1) {
+		fprintf(stderr, "%s: ERROR: pipe: %s\n", progname, strerror(errno));
+		exit(3);
+	}
+	snprintf(name, sizeof(name), "sim%d", i + 1);
+	snprintf(slot, sizeof(slot), "%d", slot_mode ? i + 1 : 0);
+
+	c->pid = fork();
+	if (c->pid == -1) {
+		fprintf(stderr, "%s: ERROR: fork: %s\n", progname, strerror(errno));
+		exit(3);
+	}
+	if (c->pid == 0) {
+		dup2(pfd[1], STDOUT_FILENO);
+		close(pfd[0]);
+		close(pfd[1]);
+		if (io_delay)
+			setenv("SFEX_TESTING_IO_DELAY", io_delay, 1);
+		{
+			/* execv() takes char *, so no string literals here */
+			char opt_i[] = "-i", opt_s[] = "-s", opt_c[] = "-c";
+			char opt_t[] = "-t", opt_m[] = "-m", opt_n[] = "-n";
+			char opt_r[] = "-r", lock_index[] = "1", rsc_id[] = "sfex_sim";
+			char *args[16 + SFEX_MAX_DEVICES];
+			int n = 0, f;
+
+			args[n++] = daemon_path;
+			args[n++] = opt_i;
+			args[n++] = lock_index;
+			if (slot_mode) {
+				args[n++] = opt_s;
+				args[n++] = slot;
+			} else {
+				args[n++] = opt_c;
+				args[n++] = collision_timeout;
+			}
+			args[n++] = opt_t;
+			args[n++] = lock_timeout;
+			args[n++] = opt_m;
+			args[n++] = monitor_interval;
+			args[n++] = opt_n;
+			args[n++] = name;
+			args[n++] = opt_r;
+			args[n++] = rsc_id;
+			for (f = 0; f < nfiles; f++)
+				args[n++] = files[f];
+			args[n] = NULL;
+			execv(daemon_path, args);
+		}
+		fprintf(stderr, "%s: ERROR: cannot execute %s: %s\n",
+			progname, daemon_path, strerror(errno));
+		_exit(3);
+	}
+	close(pfd[1]);
+	c->fd = pfd[0];
+	c->buflen = 0;
+	c->killed = 0;
+	c->reported = 0;
+	c->state = SIM_ACQUIRING;
+	c->since = now();
+}
+
+static void handle_event(int i, const char *ev)
+{
+	sim_competitor *c = &comp[i];
+	double t = now();
+
+	c->reported = 1;
+	if (!strcmp(ev, "acquired")) {
+		attempts++;
+		acquired++;
+		stat_add(&acquire_time, t - c->since);
+		if (owners > 0) {
+			violations++;
+			printf("%8.3f  VIOLATION: sim%d acquired while %d other owner(s) alive\n",
+				t - sim_start, i + 1, owners);
+		}
+		/* the killed one restarting and taking its lock back
+		   is no failover */
+		if (killed_at >= 0) {
+			stat_add(i == killed_owner ? &reclaim_time : &failover_time,
+				 t - killed_at);
+			killed_at = -1;
+		}
+		owners++;
+		c->state = SIM_OWNER;
+		c->since = t;
+	} else if (!strcmp(ev, "collision")) {
+		attempts++;
+		collisions++;
+	} else if (!strcmp(ev, "busy")) {
+		attempts++;
+		busy++;
+	} else if (!strcmp(ev, "lost")) {
+		lost++;
+	} else if (!strcmp(ev, "error")) {
+		errors++;
+	}
+}
+
+static void read_competitor(int i)
+{
+	sim_competitor *c = &comp[i];
+	ssize_t n;
+	char *nl;
+
+	n = read(c->fd, c->buf + c->buflen, sizeof(c->buf) - 1 - c->buflen);
+	if (n > 0) {
+		c->buflen += n;
+		c->buf[c->buflen] = '\0';
+		while ((nl = strchr(c->buf, '\n')) != NULL) {
+			*nl = '\0';
+			handle_event(i, c->buf);
+			c->buflen -= nl + 1 - c->buf;
+			memmove(c->buf, nl + 1, c->buflen + 1);
+		}
+		if (c->buflen == sizeof(c->buf) - 1)
+			c->buflen = 0;
+		return;
+	}
+	if (n == -1 && errno == EINTR)
+		return;
+
+	/* EOF: the competitor is gone */
+	close(c->fd);
+	c->fd = -1;
+	waitpid(c->pid, NULL, 0);
+	c->pid = 0;
+	if (c->state == SIM_OWNER)
+		owners--;
+	else if (!c->reported && !c->killed) {
+		/* gave up without a verdict: I/O failed or timed out */
+		attempts++;
+		errors++;
+	}
+	c->state = SIM_IDLE;
+	c->since = now();
+}
+
+static int find_owner(void)
+{
+	int i;
+
+	for (i = 0; i < ncomp; i++)
+		if (comp[i].state == SIM_OWNER && !comp[i].killed)
+			return i;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long duration = 60, kill_interval = 0;
+	double end, last_kill;
+	char *path = NULL;
+	int i;
+
+	progname = get_progname(argv[0]);
+	nodename = get_nodename();
+
+	cl_log_set_entity(progname);
+	cl_log_enable_stderr(TRUE);
+
+	opterr = 0;
+	while (1) {
+		int c = getopt(argc, argv, "hn:d:k:D:c:t:m:b:sx:");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+			usage(stdout);
+			exit(0);
+		case 'n':
+			ncomp = get_ulong("competitors", optarg, 1, SIM_MAX_COMPETITORS);
+			break;
+		case 'd':
+			duration = get_ulong("duration", optarg, 1, INT_MAX);
+			break;
+		case 'k':
+			kill_interval = get_ulong("kill_interval", optarg, 0, INT_MAX);
+			break;
+		case 'D':
+			io_delay = optarg;
+			break;
+		case 'c':
+			get_ulong("collision_timeout", optarg, 1, INT_MAX);
+			snprintf(collision_timeout, sizeof(collision_timeout), "%s", optarg);
+			break;
+		case 't':
+			get_ulong("lock_timeout", optarg, 1, INT_MAX);
+			snprintf(lock_timeout, sizeof(lock_timeout), "%s", optarg);
+			break;
+		case 'm':
+			get_ulong("monitor_interval", optarg, 1, INT_MAX);
+			snprintf(monitor_interval, sizeof(monitor_interval), "%s", optarg);
+			break;
+		case 'b':
+			sector_size = get_ulong("blocksize", optarg, SFEX_MIN_BLOCKSIZE, SFEX_MAX_BLOCKSIZE);
+			if (sector_size % SFEX_MIN_BLOCKSIZE) {
+				fprintf(stderr, "%s: ERROR: blocksize must be a multiple of %d.\n",
+					progname, SFEX_MIN_BLOCKSIZE);
+				exit(4);
+			}
+			break;
+		case 's':
+			slot_mode = 1;
+			break;
+		case 'x':
+			daemon_path = optarg;
+			break;
+		case '?':
+			usage(stderr);
+			exit(4);
+		}
+	}
+	nfiles = argc - optind;
+	if (nfiles < 1) {
+		usage(stderr);
+		exit(4);
+	}
+	if (nfiles > SFEX_MAX_DEVICES || nfiles % 2 == 0) {
+		fprintf(stderr, "%s: ERROR: the number of files must be odd and at most %d.\n",
+			progname, SFEX_MAX_DEVICES);
+		exit(4);
+	}
+	if (nfiles > 1 && slot_mode) {
+		fprintf(stderr, "%s: ERROR: slot mode uses one file.\n", progname);
+		exit(4);
+	}
+	files = argv + optind;
+	if (slot_mode && (ncomp < SFEX_MIN_NUMSLOTS || ncomp > SFEX_MAX_NUMSLOTS)) {
+		fprintf(stderr, "%s: ERROR: slot mode needs between %d and %d competitors.\n",
+			progname, SFEX_MIN_NUMSLOTS, SFEX_MAX_NUMSLOTS);
+		exit(4);
+	}
+
+	if (!daemon_path) {
+		const char *slash = strrchr(argv[0], '/');
+		size_t len = slash ? (size_t)(slash - argv[0] + 1) : 0;
+
+		path = malloc(len + sizeof("sfex_daemon_sim"));
+		if (!path) {
+			fprintf(stderr, "%s: ERROR: %s\n", progname, strerror(errno));
+			exit(3);
+		}
+		memcpy(path, argv[0], len);
+		strcpy(path + len, "sfex_daemon_sim");
+		daemon_path = path;
+	}
+
+	init_files();
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%d competitors, %lus, lock_timeout %ss, %s%s%s, monitor_interval %ss, I/O delay %s ms, kill every %lus\n",
+		ncomp, duration, lock_timeout,
+		slot_mode ? "slot mode" : "collision_timeout ",
+		slot_mode ? "" : collision_timeout, slot_mode ? "" : "s",
+		monitor_interval, io_delay ? io_delay : "0", kill_interval);
+
+	for (i = 0; i < ncomp; i++) {
+		comp[i].fd = -1;
+		start_competitor(i);
+	}
+
+	sim_start = last_kill = now();
+	end = sim_start + duration;
+	while (now() < end) {
+		struct pollfd pfd[SIM_MAX_COMPETITORS];
+		int idx[SIM_MAX_COMPETITORS];
+		int n = 0, owner;
+		double t;
+
+		for (i = 0; i < ncomp; i++) {
+			if (comp[i].fd == -1)
+				continue;
+			pfd[n].fd = comp[i].fd;
+			pfd[n].events = POLLIN;
+			idx[n++] = i;
+		}
+		if (poll(pfd, n, 100) > 0) {
+			for (i = 0; i < n; i++)
+				if (pfd[i].revents)
+					read_competitor(idx[i]);
+		}
+
+		t = now();
+		for (i = 0; i < ncomp; i++)
+			if (comp[i].state == SIM_IDLE
+			    && t - comp[i].since >= SIM_RESTART_DELAY)
+				start_competitor(i);
+
+		owner = find_owner();
+		if (kill_interval && t - last_kill >= kill_interval && owner >= 0) {
+			printf("%8.3f  killing owner sim%d\n", t - sim_start, owner + 1);
+			kill(comp[owner].pid, SIGKILL);
+			comp[owner].killed = 1;
+			killed_at = t;
+			killed_owner = owner;
+			last_kill = t;
+			kills++;
+		} else if (owner < 0) {
+			last_kill = t;
+		}
+	}
+
+	for (i = 0; i < ncomp; i++)
+		if (comp[i].pid > 0)
+			kill(comp[i].pid, SIGTERM);
+	while (wait(NULL) > 0)
+		;
+
+	printf("\n");
+	printf("%-20s %d\n", "acquire attempts", attempts);
+	printf("%-20s %d\n", "acquired", acquired);
+	stat_print("time to acquire", &acquire_time);
+	printf("%-20s %d (%.1f%% of attempts)\n", "collisions detected",
+		collisions, attempts ? 100.0 * collisions / attempts : 0.0);
+	printf("%-20s %d\n", "lock busy", busy);
+	printf("%-20s %d\n", "lock lost", lost);
+	printf("%-20s %d\n", "I/O failures", errors);
+	printf("%-20s %d\n", "owners killed", kills);
+	stat_print("failover latency", &failover_time);
+	stat_print("reclaimed by killed", &reclaim_time);
+	printf("%-20s %d\n", "dual ownership", violations);
+
+	free(path);
+	exit(violations ? 1 : 0);
+}
@@ -61,6 +61,7 @@ char *nodename;
 
 void print_controldata(const sfex_controldata *cdata);
 void print_lockdata(const sfex_lockdata *ldata, int index);
+void print_slotdata(const sfex_slotdata *sdata, int slot);
 
 /*
  * print_controldata --- print sfex control data to the display
@@ -79,6 +80,8 @@ print_controldata(const sfex_controldata *cdata)
   printf("  revision: %d\n", cdata->revision);
   printf("  blocksize: %d\n", (int)cdata->blocksize);
   printf("  numlocks: %d\n", cdata->numlocks);
+  if (cdata->numslots)
+    printf("  numslots: %d\n", cdata->numslots);
 }
 
 /*
@@ -99,6 +102,28 @@ print_lockdata(const sfex_lockdata *ldata, int index)
   printf("  nodename: %s\n",ldata->nodename);
 }
 
+/*
+ * print_slotdata --- print sfex slot data to the display
+ *
+ * sdata --- pointer for slot data
+ *
+ * slot --- slot number
+ */
+void
+print_slotdata(const sfex_slotdata *sdata, int slot)
+{
+  const char *st;
+
+  switch (sdata->status) {
+  case SFEX_SLOT_BID: st = "bid"; break;
+  case SFEX_SLOT_COMMIT: st = "commit"; break;
+  case SFEX_SLOT_HELD: st = "lock"; break;
+  default: st = "idle"; break;
+  }
+  printf("  slot #%d: %s, count %d, ballot %llu, nodename %s\n",
+	 slot, st, sdata->count, sdata->ballot, sdata->nodename);
+}
+
 /*
  * usage --- display command line syntax
  *
@@ -200,11 +225,32 @@ main(int argc, char *argv[]) {
   if (ret == -1)
     exit(EXIT_FAILURE);
 
-  /* read lock data */
-  read_lockdata(&cdata, &ldata, index);
-
   /* display status */
   print_controldata(&cdata);
+
+  if (cdata.numslots) {
+    sfex_slotdata slots[SFEX_MAX_NUMSLOTS + 1];
+    int slot, held = 0;
+
+    if (read_slots(&cdata, slots, index) == -1)
+      exit(3);
+    printf("lock data #%d:\n", index);
+    for (slot = 1; slot <= cdata.numslots; slot++) {
+      print_slotdata(&slots[slot], slot);
+      if (slots[slot].status == SFEX_SLOT_HELD
+	  && !strcmp(slots[slot].nodename, nodename))
+	held = 1;
+    }
+    if (!held) {
+      fprintf(stdout, "status is UNLOCKED.\n");
+      exit(2);
+    }
+    fprintf(stdout, "status is LOCKED.\n");
+    exit(0);
+  }
+
+  /* read lock data */
+  read_lockdata(&cdata, &ldata, index);
   print_lockdata(&ldata, index);
 
   /* check current lock status */
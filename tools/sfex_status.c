@@ -0,0 +1,196 @@
+/*-------------------------------------------------------------------------
+ *
+ * Shared Disk File EXclusiveness Control Program(SF-EX)
+ *
+ * sfex_status.c --- Display the lock status published by sfex_daemon.
+ * This is a part of the SF-EX.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ *-------------------------------------------------------------------------
+ *
+ * sfex_status <status_file>
+ *
+ * <status_file> --- The file given to sfex_daemon with -S. Unlike
+ * sfex_stat, this does not read the shared disk at all, so it is cheap
+ * enough to be run from a monitor operation at a short interval.
+ *
+ * exit code --- 0 - The daemon holds the lock and has renewed it within
+ * the lock timeout. 2 - The lock is not held, the last renewal is older
+ * than the lock timeout, or no daemon has set up the file yet (it is
+ * shorter than sfex_statusdata). 3 - Error occurs while processing it
+ * (no daemon, or not a status file). 4 - The mistake is found in the
+ * command line parameter.
+ *
+ *-------------------------------------------------------------------------*/
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#if HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+
+#include "sfex.h"
+
+/* a consistent snapshot is normally read at the first attempt */
+#define SFEX_STATUS_RETRY 1000
+
+const char *progname;
+
+/*
+ * read_status --- take a consistent snapshot of the status page
+ */
+static int
+read_status (const volatile sfex_statusdata * page, sfex_statusdata * sdata)
+{
+  int i;
+  uint32_t seq;
+
+  for (i = 0; i < SFEX_STATUS_RETRY; i++)
+    {
+      seq = page->seq;
+      __sync_synchronize ();
+      if (seq & 1)
+	{
+	  usleep (100);
+	  continue;
+	}
+      sdata->magic = page->magic;
+      sdata->seq = seq;
+      sdata->pid = page->pid;
+      sdata->held = page->held;
+      sdata->index = page->index;
+      sdata->count = page->count;
+      sdata->lock_timeout = page->lock_timeout;
+      sdata->last_renewal = page->last_renewal;
+      sdata->last_renewal_mono = page->last_renewal_mono;
+      sdata->renewal_usec = page->renewal_usec;
+      __sync_synchronize ();
+      if (page->seq == seq)
+	return 0;
+    }
+  return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *status_file;
+  sfex_statusdata *page, sdata;
+  struct timespec now;
+  int64_t age;
+  char stamp[64];
+  struct tm tm;
+  time_t t;
+  struct stat st;
+  int fd;
+
+  progname = strrchr (argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  if (argc != 2 || argv[1][0] == '-')
+    {
+      fprintf (stderr, "usage: %s <status_file>\n", progname);
+      exit (4);
+    }
+  status_file = argv[1];
+
+  fd = open (status_file, O_RDONLY);
+  if (fd == -1)
+    {
+      fprintf (stderr, "%s: ERROR: can't open %s: %s\n", progname,
+	       status_file, strerror (errno));
+      exit (3);
+    }
+  /* a short file would fault on access instead of failing here */
+  if (fstat (fd, &st) == -1)
+    {
+      fprintf (stderr, "%s: ERROR: can't stat %s: %s\n", progname,
+	       status_file, strerror (errno));
+      exit (3);
+    }
+  if (st.st_size < (off_t) sizeof (*page))
+    {
+      printf ("status file is not set up: sfex_daemon is not running.\n");
+      exit (2);
+    }
+  page = mmap (NULL, sizeof (*page), PROT_READ, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED)
+    {
+      fprintf (stderr, "%s: ERROR: can't map %s: %s\n", progname,
+	       status_file, strerror (errno));
+      exit (3);
+    }
+  close (fd);
+
+  if (read_status (page, &sdata) == -1)
+    {
+      fprintf (stderr, "%s: ERROR: status of %s is not settling.\n",
+	       progname, status_file);
+      exit (3);
+    }
+  if (sdata.magic != SFEX_STATUSDATA_MAGIC)
+    {
+      fprintf (stderr, "%s: ERROR: %s is not a sfex status file.\n",
+	       progname, status_file);
+      exit (3);
+    }
+  if (sdata.pid <= 0 || (kill (sdata.pid, 0) == -1 && errno == ESRCH))
+    {
+      fprintf (stderr, "%s: ERROR: sfex_daemon (pid %d) is not running.\n",
+	       progname, (int) sdata.pid);
+      exit (3);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  age = (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000
+    - sdata.last_renewal_mono;
+
+  t = (time_t) sdata.last_renewal;
+  localtime_r (&t, &tm);
+  strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+  printf ("lock data #%d:\n", (int) sdata.index);
+  printf ("  status: %s\n", sdata.held ? "lock" : "unlock");
+  printf ("  count: %d\n", (int) sdata.count);
+  printf ("  pid: %d\n", (int) sdata.pid);
+  if (sdata.last_renewal_mono)
+    printf ("  last renewal: %s (%.1f s ago, took %.3f ms)\n", stamp,
+	    age / 1000.0, sdata.renewal_usec / 1000.0);
+
+  if (!sdata.held)
+    {
+      printf ("status is UNLOCKED.\n");
+      exit (2);
+    }
+  if (age > sdata.lock_timeout * 1000)
+    {
+      printf ("status is STALE (lock timeout is %d s).\n",
+	      (int) sdata.lock_timeout);
+      exit (2);
+    }
+  printf ("status is LOCKED.\n");
+  exit (0);
+}
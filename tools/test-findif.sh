@@ -52,6 +52,7 @@ HERE="$(dirname "$0")"
 : ${LO_NM4:=8}
 : ${LO_BC4:=127.255.255.255}
 : ${LO_IP6:=::1}
+: ${LO_NM6:=128}
 
 : ${DUMMY_IF:=dummy0}
 # carefully selected to fit TEST-NET-2
@@ -63,6 +64,8 @@ HERE="$(dirname "$0")"
 : ${DUMMY_IP6:=2001:db8::1}
 : ${DUMMY_NM6:=32}
 : ${DUMMY_BC6:=198.51.100.255}
+: ${DUMMY_LL6:=fe80::1}
+: ${DUMMY_LLNM6:=64}
 
 #
 # hard-wired
@@ -70,7 +73,7 @@ HERE="$(dirname "$0")"
 
 PRG_CMD="${PRG} -C"
 SCRIPT_CMD="$(head -n1 "${SCRIPT}" | sed 's|#!||') \
-	-c \"export OCF_FUNCTIONS_DIR=$(dirname "${SCRIPT}"); . $(dirname "${SCRIPT}")/ocf-shellfuncs; . ${SCRIPT}; findif\""
+	-c \"export OCF_FUNCTIONS_DIR=$(dirname "${SCRIPT}"); . $(dirname "${SCRIPT}")/ocf-shellfuncs; __OCF_ACTION=start; . ${SCRIPT}; findif\""
 
 DUMMY_USER=test-findif
 
@@ -98,7 +101,7 @@ TESTS="4"
 #
 
 TEST_FORMAT=\
-"   OCF_RESKEY_ip	, OCF_RESKEY_cidr_netmask	, expected_ec		, expected_dev	, expected_nm		, expected_bc"
+"   OCF_RESKEY_ip	, OCF_RESKEY_cidr_netmask	, expected_ec		, expected_dev	, expected_nm		, expected_bc	[, OCF_RESKEY_nic]"
 
 TEST_DATA4=\
 "   # valid: 1-9: loopback, 10-19: dummy if; invalid cases: 20-29: ip, 30-39: netmask bits
@@ -128,12 +131,26 @@ TEST_DATA4=\
 TEST_DATA6=\
 "   # valid: A0-A9: loopback, B0-B9: dummy if; invalid cases: C0-C9: ip, D0-D9: netmask bits
     # A0) LO6_IP
-    ${LO_IP6}		, 				, $OCF_SUCCESS		, ${LO_IF}	, ${LO_NM4}	,
+    ${LO_IP6}		, 				, $OCF_SUCCESS		, ${LO_IF}	, ${LO_NM6}	,
     #
     # B0) DUMMY6_IP+1
     ${DUMMY_IP6_INC}	, 				, $OCF_SUCCESS		, ${DUMMY_IF}	, ${DUMMY_NM6}	,
     # B1) DUMMY4_IP+1, explicit netmask
     ${DUMMY_IP6_INC}	, ${DUMMY_NM6}			, $OCF_SUCCESS		, ${DUMMY_IF}	, ${DUMMY_NM6}	,
+    # B2) DUMMY6_IP+1, explicit nic
+    ${DUMMY_IP6_INC}	, 				, $OCF_SUCCESS		, ${DUMMY_IF}	, ${DUMMY_NM6}	,		, ${DUMMY_IF}
+    # B3) DUMMY6 link local, explicit nic
+    ${DUMMY_LL6}		, 				, $OCF_SUCCESS		, ${DUMMY_IF}	, ${DUMMY_LLNM6}	,		, ${DUMMY_IF}
+    #
+    # C0) *invalid* IPv6 (random string)
+    foo:bar		,				, $OCF_ERR_CONFIGURED	, NA		, NA		, NA
+    # C1) DUMMY6 link local, *missing* nic
+    ${DUMMY_LL6}		,				, $OCF_ERR_CONFIGURED	, NA		, NA		, NA
+    #
+    # D0) DUMMY6_IP+1, explicit *invalid* netmask (129)
+    ${DUMMY_IP6_INC}	, 129				, $OCF_ERR_CONFIGURED	, NA		, NA		, NA
+    # D1) DUMMY6_IP+1, explicit *invalid* netmask (0)
+    ${DUMMY_IP6_INC}	, 0				, $OCF_ERR_CONFIGURED	, NA		, NA		, NA
 "
 
 #
@@ -141,7 +158,7 @@ TEST_DATA6=\
 #
 
 _get_test_field () {
-	echo "$1" | cut -s -d, -f$2 | sed 's|^ \?\(.*[^ ]\) \?$|\1|g'
+	echo "$1" | cut -s -d, -f$2 | sed 's|^ *||;s| *$||'
 }
 
 #
@@ -231,10 +248,12 @@ proceed () {
 			[ -z "${exp_nm}" ]  && warn "test spec.: empty exp_nm"
 			exp_bc="$( _get_test_field "${curline}" 6)"
 			[ -z "${exp_bc}" ]  && warn "test spec.: empty exp_bc"
+			nic="$(    _get_test_field "${curline}" 7)"
 			[ $DEBUG_IN -ne 0 ] \
-			    && echo "${ip}, ${mask}, ${exp_ec}, ${exp_dev}, ${exp_nm}, ${exp_bc}"
+			    && echo "${ip}, ${mask}, ${exp_ec}, ${exp_dev}, ${exp_nm}, ${exp_bc}, ${nic}"
 
 			env="OCF_RESKEY_ip=${ip} OCF_RESKEY_cidr_netmask=${mask}"
+			[ -n "${nic}" ] && env="${env} OCF_RESKEY_nic=${nic}"
 			echo "${env}"
 			res="$(su ${DUMMY_USER} -c "${env} ${CMD} 2>&1")"
 			got_ec=$?
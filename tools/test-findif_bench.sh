@@ -0,0 +1,13 @@
+#!/bin/sh
+
+# make check: cross-check the findif trie against the linear scan on
+# small IPv4 and IPv6 tables (findif_bench alone goes up to a million
+# routes, which is for benchmarking).
+
+set -u
+
+rc=0
+for family in "" "-6"; do
+	./findif_bench $family -n 100000 1000 10000 || rc=1
+done
+exit $rc
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+# make check: run sfex_sim briefly on a scratch file, once with the
+# collision_timeout protocol and once in slot mode, and fail if it sees
+# two owners of the lock at once (see sfex_sim.c for the exit codes).
+
+set -u
+
+meta=`mktemp ${TMPDIR:-/tmp}/sfex_sim.XXXXXX` || exit 1
+trap 'rm -f "$meta"' EXIT
+
+rc=0
+for mode in "" "-s"; do
+	echo "sfex_sim ${mode:-(classic)}"
+	./sfex_sim -n 3 -d 10 -k 3 -t 3 -m 1 $mode "$meta" || rc=1
+done
+exit $rc
@@ -0,0 +1,175 @@
+/*
+   Internet checksum for tickle_tcp
+
+   A scalar sum of 32 bit words into a 64 bit accumulator, and SSE2 and
+   AVX2 loops for long buffers.  SSE2 only keeps up with the scalar sum,
+   so csum_partial() takes AVX2 when the CPU has it, or the scalar sum.
+   The packets tickle_tcp sends are only headers, though, so most of
+   the time goes into csum_replace4(): a packet is the one before it
+   with a few fields changed, and the checksum is patched for those
+   (RFC 1624).
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include "tickle_csum.h"
+
+#ifdef TICKLE_CSUM_X86
+#include <immintrin.h>
+#endif
+
+/* Below this many bytes the AVX2 loop loses to the scalar one */
+#define CSUM_VECTOR_MIN 256
+
+/*
+ * 32 bit lanes gain at most 2 * 0xffff per block, so they are added up
+ * into the 64 bit sum at least this often.
+ */
+#define CSUM_LANE_BLOCKS 0x8000
+
+static uint32_t fold64(uint64_t s)
+{
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	return (uint32_t)s;
+}
+
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	unsigned char tail[2];
+	uint64_t s = sum;
+	uint32_t w[4];
+	uint16_t h;
+
+	for (; len >= 16; p += 16, len -= 16) {
+		memcpy(w, p, 16);
+		s += (uint64_t)w[0] + w[1] + w[2] + w[3];
+	}
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(w, p, 4);
+		s += w[0];
+	}
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		s += h;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* the odd byte is the first of a word padded with zero */
+		tail[0] = *p;
+		tail[1] = 0;
+		memcpy(&h, tail, 2);
+		s += h;
+	}
+	return fold64(s);
+}
+
+#ifdef TICKLE_CSUM_X86
+uint32_t csum_partial_sse2(const void *buf, size_t len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc, v;
+	uint32_t lanes[4];
+	uint64_t s = sum;
+	size_t n;
+
+	while (len >= 16) {
+		acc = zero;
+		for (n = 0; len >= 16 && n < CSUM_LANE_BLOCKS; n++, p += 16, len -= 16) {
+			v = _mm_loadu_si128((const __m128i *)(const void *)p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		_mm_storeu_si128((__m128i *)(void *)lanes, acc);
+		s += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+	return csum_partial_scalar(p, len, fold64(s));
+}
+
+__attribute__((target("avx2")))
+uint32_t csum_partial_avx2(const void *buf, size_t len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc, v;
+	uint32_t lanes[8];
+	uint64_t s = sum;
+	size_t n;
+	int i;
+
+	while (len >= 32) {
+		acc = zero;
+		for (n = 0; len >= 32 && n < CSUM_LANE_BLOCKS; n++, p += 32, len -= 32) {
+			v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+		}
+		_mm256_storeu_si256((__m256i *)(void *)lanes, acc);
+		for (i = 0; i < 8; i++) {
+			s += lanes[i];
+		}
+	}
+	/* the scalar code after it may be legacy SSE, which the upper halves slow down */
+	_mm256_zeroupper();
+	return csum_partial_scalar(p, len, fold64(s));
+}
+
+int csum_have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+#ifdef TICKLE_CSUM_X86
+	if (len >= CSUM_VECTOR_MIN && csum_have_avx2()) {
+		return csum_partial_avx2(buf, len, sum);
+	}
+#endif
+	return csum_partial_scalar(buf, len, sum);
+}
+
+uint16_t csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* HC' = ~(~HC + ~m + m'), RFC 1624 eqn. 3 */
+uint16_t csum_replace2(uint16_t check, uint16_t from, uint16_t to)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	sum += (uint16_t)~from;
+	sum += to;
+	return csum_fold(sum);
+}
+
+uint16_t csum_replace4(uint16_t check, uint32_t from, uint32_t to)
+{
+	uint32_t sum = (uint16_t)~check;
+
+	from = ~from;
+	sum += (from & 0xffff) + (from >> 16);
+	sum += (to & 0xffff) + (to >> 16);
+	return csum_fold(sum);
+}
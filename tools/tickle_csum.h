@@ -0,0 +1,48 @@
+/*
+   Internet checksum for tickle_tcp
+
+   All the values are 16 and 32 bit words as they are in the packet, in
+   network byte order: the one's complement sum does not depend on the
+   byte order, as long as it is the same throughout (RFC 1071).
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_CSUM_H
+#define TICKLE_CSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define TICKLE_CSUM_X86
+#endif
+
+/* Add len bytes at buf to the partial sum */
+uint32_t csum_partial(const void *buf, size_t len, uint32_t sum);
+uint32_t csum_partial_scalar(const void *buf, size_t len, uint32_t sum);
+#ifdef TICKLE_CSUM_X86
+uint32_t csum_partial_sse2(const void *buf, size_t len, uint32_t sum);
+uint32_t csum_partial_avx2(const void *buf, size_t len, uint32_t sum);
+int csum_have_avx2(void);
+#endif
+
+/* The checksum to put in the packet for a partial sum */
+uint16_t csum_fold(uint32_t sum);
+
+/* The checksum after a field of the packet changed from one value to another (RFC 1624) */
+uint16_t csum_replace2(uint16_t check, uint16_t from, uint16_t to);
+uint16_t csum_replace4(uint16_t check, uint32_t from, uint32_t to);
+
+#endif /* TICKLE_CSUM_H */
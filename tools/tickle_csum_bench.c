@@ -0,0 +1,381 @@
+/*
+   Tests and benchmark of the tickle_tcp checksum
+
+   Checks the scalar, SSE2 and AVX2 sums and the RFC 1624 updates
+   against the 16 bit word loop tickle_tcp used to have, on random
+   buffers of every alignment, on buffers long enough to overflow the
+   vector lanes, and on TCP headers with IPv4 and IPv6 pseudo headers.
+   Then it times them: bytes per second for buffers of a few sizes, and
+   tickle checksums per second, summed in full or patched.  The exit
+   code is 1 if any of the checks fails.
+
+	tickle_csum_bench [-n iterations]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "tickle_csum.h"
+
+#define DEFAULT_ITERATIONS	1000000
+#define BIG_LEN			(4 * 1024 * 1024)
+
+typedef uint32_t (*csum_fn)(const void *buf, size_t len, uint32_t sum);
+
+static const struct {
+	const char *name;
+	csum_fn fn;
+} impls[] = {
+	{ "scalar", csum_partial_scalar },
+#ifdef TICKLE_CSUM_X86
+	{ "sse2", csum_partial_sse2 },
+	{ "avx2", csum_partial_avx2 },
+#endif
+	{ "auto", csum_partial },
+};
+#define NIMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return (uint32_t)(rnd_state >> 16);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int impl_usable(size_t i)
+{
+#ifdef TICKLE_CSUM_X86
+	if (impls[i].fn == csum_partial_avx2) {
+		return csum_have_avx2();
+	}
+#endif
+	return 1;
+}
+
+/*
+ * The checksum as tickle_tcp summed it before, one ntohs() per word;
+ * into 64 bits, as the 32 of the old one are too few for the long buffers.
+ */
+static uint64_t ref_sum(const uint8_t *data, size_t n)
+{
+	uint64_t sum = 0;
+
+	while (n >= 2) {
+		sum += (uint32_t)data[0] << 8 | data[1];
+		data += 2;
+		n -= 2;
+	}
+	if (n == 1) {
+		sum += (uint32_t)data[0] << 8;
+	}
+	return sum;
+}
+
+static uint16_t ref_fold(uint64_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	return htons(~sum);
+}
+
+/* A tickle: the pseudo header (12 or 40 bytes) and the TCP header */
+struct pkt {
+	size_t plen;
+	uint8_t b[60];
+};
+
+static void random_pkt(struct pkt *p, int ipv6)
+{
+	size_t i;
+
+	memset(p, 0, sizeof(*p));
+	p->plen = ipv6 ? 40 : 12;
+	for (i = 0; i < (ipv6 ? 32u : 8u); i++) {
+		p->b[i] = rnd();
+	}
+	if (ipv6) {
+		p->b[35] = 20;
+		p->b[39] = 6;
+	} else {
+		p->b[9] = 6;
+		p->b[11] = 20;
+	}
+	for (i = 0; i < 12; i++) {
+		p->b[p->plen + i] = rnd();
+	}
+	p->b[p->plen + 12] = 5 << 4;
+	p->b[p->plen + 13] = 0x10;
+	p->b[p->plen + 14] = 0x04;
+	p->b[p->plen + 15] = 0xd2;
+}
+
+static uint16_t get_check(const struct pkt *p)
+{
+	uint16_t check;
+
+	memcpy(&check, p->b + p->plen + 16, 2);
+	return check;
+}
+
+static void set_check(struct pkt *p, uint16_t check)
+{
+	memcpy(p->b + p->plen + 16, &check, 2);
+}
+
+static uint16_t ref_tcp_check(const struct pkt *p)
+{
+	uint16_t check = ref_fold(ref_sum(p->b, p->plen + 20));
+
+	return check ? check : 0xFFFF;
+}
+
+static int check_sums(unsigned long iterations)
+{
+	static uint8_t buf[2048 + 8];
+	uint8_t *big;
+	size_t len, off, i, j;
+	uint16_t want;
+	int errors = 0;
+
+	for (j = 0; j < iterations / 100 + 1; j++) {
+		len = rnd() % 2048;
+		off = rnd() % 8;
+		for (i = 0; i < len; i++) {
+			buf[off + i] = rnd();
+		}
+		want = ref_fold(ref_sum(buf + off, len));
+		for (i = 0; i < NIMPLS; i++) {
+			if (impl_usable(i) && csum_fold(impls[i].fn(buf + off, len, 0)) != want) {
+				printf("%s: wrong sum of %zu bytes at offset %zu\n",
+				       impls[i].name, len, off);
+				errors++;
+			}
+		}
+	}
+
+	/* all ones, the most the lanes can take */
+	big = malloc(BIG_LEN + 1);
+	if (!big) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(big, 0xff, BIG_LEN + 1);
+	want = ref_fold(ref_sum(big, BIG_LEN + 1));
+	for (i = 0; i < NIMPLS; i++) {
+		if (impl_usable(i) && csum_fold(impls[i].fn(big, BIG_LEN + 1, 0)) != want) {
+			printf("%s: wrong sum of %d bytes of 0xff\n", impls[i].name, BIG_LEN + 1);
+			errors++;
+		}
+	}
+	free(big);
+	return errors;
+}
+
+/*
+ * Build tickles from scratch and by patching the one before, for the
+ * same connections, and compare them with the old checksum.
+ */
+static int check_updates(unsigned long iterations)
+{
+	struct pkt p, q;
+	uint16_t check;
+	uint32_t from, to;
+	size_t field, i, j;
+	int errors = 0;
+
+	for (j = 0; j < 2; j++) {
+		random_pkt(&p, j);
+		set_check(&p, ref_tcp_check(&p));
+		for (i = 0; i < iterations / 10 + 1; i++) {
+			q = p;
+			/* a new remote address and port, or sequence numbers */
+			for (field = 0; field < 3; field++) {
+				size_t at = rnd() % ((q.plen + 12) / 4) * 4;
+
+				memcpy(&from, q.b + at, 4);
+				to = rnd() << 16 ^ rnd();
+				if (rnd() & 1) {
+					to = (from & htonl(0xffff0000)) | (to & htonl(0xffff));
+				}
+				set_check(&q, csum_replace4(get_check(&q), from, to));
+				memcpy(q.b + at, &to, 4);
+			}
+			check = get_check(&q);
+			check = check ? check : 0xFFFF;
+			set_check(&q, 0);
+			if (check != ref_tcp_check(&q)) {
+				printf("IPv%d: patched checksum 0x%04x, summed 0x%04x\n",
+				       j ? 6 : 4, ntohs(check), ntohs(ref_tcp_check(&q)));
+				errors++;
+			}
+			set_check(&q, check);
+			p = q;
+		}
+	}
+
+	/* a port at a time */
+	random_pkt(&p, 0);
+	set_check(&p, ref_tcp_check(&p));
+	for (i = 0; i < iterations / 10 + 1; i++) {
+		size_t at = p.plen + rnd() % 2 * 2;
+		uint16_t from16, to16 = rnd();
+
+		memcpy(&from16, p.b + at, 2);
+		set_check(&p, csum_replace2(get_check(&p), from16, to16));
+		memcpy(p.b + at, &to16, 2);
+		check = get_check(&p);
+		check = check ? check : 0xFFFF;
+		set_check(&p, 0);
+		if (check != ref_tcp_check(&p)) {
+			printf("csum_replace2: patched checksum 0x%04x, summed 0x%04x\n",
+			       ntohs(check), ntohs(ref_tcp_check(&p)));
+			errors++;
+		}
+		set_check(&p, check);
+	}
+	return errors;
+}
+
+static void bench_sums(unsigned long iterations)
+{
+	static const size_t sizes[] = { 32, 60, 256, 1500, 65536 };
+	static uint8_t buf[65536];
+	volatile uint32_t sink = 0;
+	unsigned long n, k;
+	size_t i, s;
+	double t;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = rnd();
+	}
+	printf("\nbytes  impl        MB/s\n");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		n = iterations * 32 / sizes[s] + 1;
+		t = now();
+		for (k = 0; k < n; k++) {
+			sink += ref_sum(buf, sizes[s]);
+		}
+		t = now() - t;
+		printf("%5zu  %-8s %7.0f\n", sizes[s], "old", n * sizes[s] / t / 1e6);
+		for (i = 0; i < NIMPLS; i++) {
+			if (!impl_usable(i)) {
+				continue;
+			}
+			t = now();
+			for (k = 0; k < n; k++) {
+				sink += impls[i].fn(buf, sizes[s], 0);
+			}
+			t = now() - t;
+			printf("%5zu  %-8s %7.0f\n", sizes[s], impls[i].name,
+			       n * sizes[s] / t / 1e6);
+		}
+	}
+}
+
+/* One IPv4 tickle per new remote address and port, summed or patched */
+static void bench_tickles(unsigned long iterations)
+{
+	struct pkt p;
+	volatile uint16_t sink = 0;
+	uint32_t addr, ports, old_addr, old_ports;
+	uint16_t check;
+	unsigned long k;
+	double t;
+
+	random_pkt(&p, 0);
+	printf("\ntickle   checksums/s\n");
+
+	t = now();
+	for (k = 0; k < iterations; k++) {
+		addr = k * 2654435761u;
+		memcpy(p.b + 4, &addr, 4);
+		set_check(&p, 0);
+		check = ref_tcp_check(&p);
+		set_check(&p, check);
+		sink += check;
+	}
+	printf("%-8s %11.0f\n", "old", iterations / (now() - t));
+
+	t = now();
+	for (k = 0; k < iterations; k++) {
+		addr = k * 2654435761u;
+		memcpy(p.b + 4, &addr, 4);
+		set_check(&p, 0);
+		check = csum_fold(csum_partial(p.b, p.plen + 20, 0));
+		set_check(&p, check);
+		sink += check;
+	}
+	printf("%-8s %11.0f\n", "summed", iterations / (now() - t));
+
+	t = now();
+	for (k = 0; k < iterations; k++) {
+		addr = k * 2654435761u;
+		ports = addr ^ 0x5050;
+		memcpy(&old_addr, p.b + 4, 4);
+		memcpy(&old_ports, p.b + 12, 4);
+		check = csum_replace4(get_check(&p), old_addr, addr);
+		check = csum_replace4(check, old_ports, ports);
+		memcpy(p.b + 4, &addr, 4);
+		memcpy(p.b + 12, &ports, 4);
+		set_check(&p, check);
+		sink += check;
+	}
+	printf("%-8s %11.0f\n", "patched", iterations / (now() - t));
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = DEFAULT_ITERATIONS;
+	int c, errors;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			if (iterations > 0) {
+				break;
+			}
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	errors = check_sums(iterations) + check_updates(iterations);
+	printf("%s\n", errors ? "MISMATCH" : "checks passed");
+
+	bench_sums(iterations);
+	bench_tickles(iterations);
+	return errors ? 1 : 0;
+}
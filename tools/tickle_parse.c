@@ -0,0 +1,271 @@
+/*
+   Connection list parser for tickle_tcp
+
+   The list is read in large chunks, and every line is parsed where it
+   is in the buffer: there is no copy of a line, and no allocation per
+   line or per address.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "tickle_parse.h"
+
+static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin)
+{
+	sin->sin_family = AF_INET;
+	sin->sin_port   = htons(port);
+
+	if (inet_pton(AF_INET, s, &sin->sin_addr) != 1) {
+		fprintf(stderr, "Failed to translate %s into sin_addr\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr)
+{
+	saddr->ip6.sin6_family   = AF_INET6;
+	saddr->ip6.sin6_port     = htons(port);
+	saddr->ip6.sin6_flowinfo = 0;
+	saddr->ip6.sin6_scope_id = 0;
+
+	if (inet_pton(AF_INET6, s, &saddr->ip6.sin6_addr) != 1) {
+		fprintf(stderr, "Failed to translate %s into sin6_addr\n", s);
+		return -1;
+	}
+
+	if (iface && IN6_IS_ADDR_LINKLOCAL(&saddr->ip6.sin6_addr)) {
+		saddr->ip6.sin6_scope_id = if_nametoindex(iface);
+	}
+
+        return 0;
+}
+
+int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr)
+{
+	int ret;
+
+	if (!strchr(addr, ':'))
+		ret = parse_ipv4(addr, port, &saddr->ip);
+	else
+		ret = parse_ipv6(addr, iface, port, saddr);
+
+	return ret;
+}
+
+/*
+ * Dotted quad IPv4, as strict as inet_pton(), but without needing the
+ * string to be terminated.  It is most of what tickle_tcp gets.
+ */
+static int scan_ipv4(const char *s, size_t len, struct in_addr *in)
+{
+	uint32_t a = 0, octet;
+	size_t i = 0, digits;
+	int dots = 0;
+
+	for (;;) {
+		octet = 0;
+		for (digits = 0; i < len && s[i] >= '0' && s[i] <= '9'; digits++, i++) {
+			if (digits == 3 || (digits == 1 && octet == 0)) {
+				return -1;
+			}
+			octet = octet * 10 + (s[i] - '0');
+		}
+		if (digits == 0 || octet > 255) {
+			return -1;
+		}
+		a = a << 8 | octet;
+		if (i == len) {
+			break;
+		}
+		if (s[i] != '.' || dots == 3) {
+			return -1;
+		}
+		dots++;
+		i++;
+	}
+	if (dots != 3) {
+		return -1;
+	}
+	in->s_addr = htonl(a);
+	return 0;
+}
+
+/*
+ * ip:port, where the ip is IPv4, or IPv6 with or without brackets; the
+ * port is after the last colon.  addr need not be terminated.
+ */
+int parse_ip_port_len(const char *addr, size_t len, sock_addr *saddr)
+{
+	char ip[TICKLE_FIELD_MAX];
+	const char *p, *q;
+	unsigned long port = 0;
+	size_t iplen;
+
+	if (len >= TICKLE_FIELD_MAX) {
+		fprintf(stderr, "The address %.16s... is too long\n", addr);
+		return -1;
+	}
+
+	for (p = addr + len; p > addr && p[-1] != ':'; p--)
+		;
+	if (p == addr) {
+		fprintf(stderr, "This addr: %.*s does not contain a port number\n",
+			(int)len, addr);
+		return -1;
+	}
+	for (q = p; q < addr + len; q++) {
+		if (*q < '0' || *q > '9' || (port = port * 10 + (*q - '0')) > 65535) {
+			break;
+		}
+	}
+	if (q == p || q < addr + len) {
+		fprintf(stderr, "Bad port in %.*s\n",
+			(int)len, addr);
+		return -1;
+	}
+
+	memset(saddr, 0, sizeof(*saddr));
+	iplen = p - 1 - addr;
+	if (iplen >= 2 && addr[0] == '[' && addr[iplen - 1] == ']') {
+		addr++;
+		iplen -= 2;
+	} else if (!memchr(addr, ':', iplen)) {
+		saddr->ip.sin_family = AF_INET;
+		saddr->ip.sin_port   = htons(port);
+		if (scan_ipv4(addr, iplen, &saddr->ip.sin_addr)) {
+			fprintf(stderr, "Failed to translate %.*s into sin_addr\n",
+				(int)iplen, addr);
+			return -1;
+		}
+		return 0;
+	}
+
+	memcpy(ip, addr, iplen);
+	ip[iplen] = 0;
+	return parse_ipv6(ip, NULL, port, saddr);
+}
+
+int parse_ip_port(const char *addr, sock_addr *saddr)
+{
+	return parse_ip_port_len(addr, strlen(addr), saddr);
+}
+
+void tickle_reader_init(struct tickle_reader *r, int fd)
+{
+	r->fd = fd;
+	r->start = r->end = 0;
+	r->line = 0;
+	r->eof = 0;
+}
+
+/* Move what is left to the front of the buffer, and read some more */
+static int reader_fill(struct tickle_reader *r)
+{
+	ssize_t n;
+
+	if (r->start > 0) {
+		memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+	do {
+		n = read(r->fd, r->buf + r->end, sizeof(r->buf) - r->end);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		fprintf(stderr, "Failed to read the connections (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (n == 0) {
+		r->eof = 1;
+	}
+	r->end += n;
+	return 0;
+}
+
+static int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Parse the next line into addr1 and addr2.  Returns 1 for a line, 0 at
+ * the end of the input, and -1 on errors.  Blank lines are skipped, and
+ * whatever follows the second address is ignored.
+ */
+int tickle_reader_next(struct tickle_reader *r, sock_addr *addr1, sock_addr *addr2)
+{
+	const char *p, *end, *f1, *f2;
+	size_t l1, l2;
+	char *nl;
+
+	for (;;) {
+		nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+		if (!nl && !r->eof) {
+			if (r->start == 0 && r->end == sizeof(r->buf)) {
+				fprintf(stderr, "Line %lu is too long\n", r->line + 1);
+				return -1;
+			}
+			if (reader_fill(r)) {
+				return -1;
+			}
+			continue;
+		}
+		if (!nl && r->start == r->end) {
+			return 0;
+		}
+
+		p = r->buf + r->start;
+		end = nl ? nl : r->buf + r->end;
+		r->start = end - r->buf + (nl ? 1 : 0);
+		r->line++;
+
+		while (p < end && is_blank(*p))
+			p++;
+		if (p == end) {
+			continue;
+		}
+		for (f1 = p; p < end && !is_blank(*p); p++)
+			;
+		l1 = p - f1;
+		while (p < end && is_blank(*p))
+			p++;
+		for (f2 = p; p < end && !is_blank(*p); p++)
+			;
+		l2 = p - f2;
+
+		if (l2 == 0) {
+			fprintf(stderr, "Line %lu has only one address\n", r->line);
+			return -1;
+		}
+		if (parse_ip_port_len(f1, l1, addr1)) {
+			fprintf(stderr, "Bad IP:port on line %lu\n", r->line);
+			return -1;
+		}
+		if (parse_ip_port_len(f2, l2, addr2)) {
+			fprintf(stderr, "Bad IP:port on line %lu\n", r->line);
+			return -1;
+		}
+		return 1;
+	}
+}
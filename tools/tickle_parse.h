@@ -0,0 +1,53 @@
+/*
+   Connection list parser for tickle_tcp
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TICKLE_PARSE_H
+#define TICKLE_PARSE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef union {
+	struct sockaddr     sa;
+	struct sockaddr_in  ip;
+	struct sockaddr_in6 ip6;
+} sock_addr;
+
+/* The longest ip:port field, "[ipv6]:port" */
+#define TICKLE_FIELD_MAX	(INET6_ADDRSTRLEN + 8)
+#define TICKLE_READ_BUF		65536
+
+/*
+ * Reads "local_ip:port remote_ip:port" lines from a file descriptor in
+ * large chunks, and parses them where they are in the buffer.
+ */
+struct tickle_reader {
+	int fd;
+	size_t start, end;
+	unsigned long line;
+	int eof;
+	char buf[TICKLE_READ_BUF];
+};
+
+int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr);
+int parse_ip_port(const char *addr, sock_addr *saddr);
+int parse_ip_port_len(const char *addr, size_t len, sock_addr *saddr);
+void tickle_reader_init(struct tickle_reader *r, int fd);
+int tickle_reader_next(struct tickle_reader *r, sock_addr *addr1, sock_addr *addr2);
+
+#endif /* TICKLE_PARSE_H */
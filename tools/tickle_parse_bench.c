@@ -0,0 +1,481 @@
+/*
+   Benchmark of the tickle_tcp connection list parser
+
+   First checks the parser against tables of fields and of whole inputs:
+   the address and port it gives for IPv4, IPv6 and bracketed IPv6, and
+   that it refuses fields which are too long, have no port or a port
+   above 65535, IPv4 octets with leading zeros, and lines with a single
+   address or too long for the read buffer.
+
+   Then it writes synthetic "local_ip:port remote_ip:port" lines, a mix
+   of IPv4, IPv6 and bracketed IPv6, to a temporary file, and reports how
+   many lines per second the buffered parser reads.  For comparison it
+   also times the fgets() and sscanf() loop tickle_tcp used to have, with
+   its old parse_ip_port(), which doesn't know about brackets.  Both
+   must agree on every line the old code can read.  The exit code is 1
+   if any of the checks fails.
+
+	tickle_parse_bench [-n lines]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "tickle_parse.h"
+
+#define DEFAULT_LINES	1000000
+
+struct field_case {
+	const char *field;
+	int family;		/* 0 if the field must be refused */
+	const char *ip;
+	unsigned port;
+};
+
+static const struct field_case field_cases[] = {
+	{ "192.168.1.10:80", AF_INET, "192.168.1.10", 80 },
+	{ "0.0.0.0:0", AF_INET, "0.0.0.0", 0 },
+	{ "255.255.255.255:65535", AF_INET, "255.255.255.255", 65535 },
+	{ "10.0.0.1:00022", AF_INET, "10.0.0.1", 22 },
+	{ "2001:db8::1:443", AF_INET6, "2001:db8::1", 443 },
+	{ "[2001:db8::1]:443", AF_INET6, "2001:db8::1", 443 },
+	{ "::1:22", AF_INET6, "::1", 22 },
+	{ "[::1]:22", AF_INET6, "::1", 22 },
+	{ "[::]:1", AF_INET6, "::", 1 },
+	{ "::ffff:192.0.2.1:8080", AF_INET6, "::ffff:192.0.2.1", 8080 },
+	{ "[fe80::1:2:3:4]:65535", AF_INET6, "fe80::1:2:3:4", 65535 },
+	/* TICKLE_FIELD_MAX - 1 bytes, the longest there is */
+	{ "[0000:0000:0000:0000:0000:0000:255.255.255.255]:00080", AF_INET6,
+	  "::255.255.255.255", 80 },
+
+	/* the same, one byte too long */
+	{ "[0000:0000:0000:0000:0000:0000:255.255.255.255]:000080", 0, NULL, 0 },
+	{ "1111:2222:3333:4444:5555:6666:7777:8888:9999:aaaa:bbbb:80", 0, NULL, 0 },
+	{ "192.168.1.10", 0, NULL, 0 },
+	{ "192.168.1.10:", 0, NULL, 0 },
+	{ ":80", 0, NULL, 0 },
+	{ "192.168.1.10:65536", 0, NULL, 0 },
+	{ "192.168.1.10:99999999999", 0, NULL, 0 },
+	{ "192.168.1.10:8o", 0, NULL, 0 },
+	{ "192.168.1.10:-1", 0, NULL, 0 },
+	{ "192.168.01.10:80", 0, NULL, 0 },
+	{ "192.168.1.010:80", 0, NULL, 0 },
+	{ "00.0.0.0:80", 0, NULL, 0 },
+	{ "256.1.1.1:80", 0, NULL, 0 },
+	{ "1.2.3:80", 0, NULL, 0 },
+	{ "1.2.3.4.5:80", 0, NULL, 0 },
+	{ "1.2.3.:80", 0, NULL, 0 },
+	{ "1.2.3.4 :80", 0, NULL, 0 },
+	{ "[2001:db8::1:443", 0, NULL, 0 },
+	{ "[2001:db8::1]443", 0, NULL, 0 },
+	{ "[1.2.3.4]:80", 0, NULL, 0 },
+	{ "2001:db8::g:80", 0, NULL, 0 },
+	{ "[]:80", 0, NULL, 0 },
+};
+
+struct reader_case {
+	const char *name;
+	const char *input;
+	int nlines;		/* -1 if the input must be refused */
+	struct {
+		int family;
+		const char *ip1;
+		unsigned port1;
+		const char *ip2;
+		unsigned port2;
+	} lines[3];
+};
+
+static const struct reader_case reader_cases[] = {
+	{ "mixed", "192.168.1.10:80 10.1.2.3:1024\n"
+	  "\n"
+	  " \t[2001:db8::1]:443\t2001:db8::2:50000 trailing words\r\n"
+	  "::1:1 [::2]:2", 3,
+	  { { AF_INET, "192.168.1.10", 80, "10.1.2.3", 1024 },
+	    { AF_INET6, "2001:db8::1", 443, "2001:db8::2", 50000 },
+	    { AF_INET6, "::1", 1, "::2", 2 } } },
+	{ "empty", "", 0, { { 0, NULL, 0, NULL, 0 } } },
+	{ "blank", " \n\t\n\n", 0, { { 0, NULL, 0, NULL, 0 } } },
+	{ "one address", "192.168.1.10:80 10.1.2.3:1024\n192.168.1.10:80\n", -1,
+	  { { 0, NULL, 0, NULL, 0 } } },
+	{ "one address, no newline", "192.168.1.10:80", -1,
+	  { { 0, NULL, 0, NULL, 0 } } },
+	{ "bad port", "192.168.1.10:80 10.1.2.3:65536\n", -1,
+	  { { 0, NULL, 0, NULL, 0 } } },
+	{ "leading zero", "192.168.1.10:80 10.01.2.3:22\n", -1,
+	  { { 0, NULL, 0, NULL, 0 } } },
+	{ "long field", "192.168.1.10:80 "
+	  "[0000:0000:0000:0000:0000:0000:255.255.255.255]:000080\n", -1,
+	  { { 0, NULL, 0, NULL, 0 } } },
+};
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return (uint32_t)(rnd_state >> 16);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check_addr(const sock_addr *sa, int family, const char *ip, unsigned port)
+{
+	union {
+		struct in_addr  in;
+		struct in6_addr in6;
+	} want;
+
+	if (sa->sa.sa_family != family || inet_pton(family, ip, &want) != 1) {
+		return -1;
+	}
+	if (family == AF_INET) {
+		return sa->ip.sin_addr.s_addr == want.in.s_addr
+			&& ntohs(sa->ip.sin_port) == port ? 0 : -1;
+	}
+	return memcmp(&sa->ip6.sin6_addr, &want.in6, sizeof(want.in6)) == 0
+		&& ntohs(sa->ip6.sin6_port) == port ? 0 : -1;
+}
+
+static int same_addr(const sock_addr *a, const sock_addr *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family) {
+		return 0;
+	}
+	if (a->sa.sa_family == AF_INET) {
+		return a->ip.sin_addr.s_addr == b->ip.sin_addr.s_addr
+			&& a->ip.sin_port == b->ip.sin_port;
+	}
+	return memcmp(&a->ip6.sin6_addr, &b->ip6.sin6_addr, sizeof(a->ip6.sin6_addr)) == 0
+		&& a->ip6.sin6_port == b->ip6.sin6_port;
+}
+
+/*
+ * Every field is passed unterminated, followed by a digit, so that the
+ * parser is caught reading past its length.
+ */
+static int check_fields(void)
+{
+	char buf[256];
+	sock_addr sa;
+	size_t i, len;
+	int ret, errors = 0;
+
+	for (i = 0; i < sizeof(field_cases) / sizeof(field_cases[0]); i++) {
+		const struct field_case *fc = &field_cases[i];
+
+		len = strlen(fc->field);
+		memcpy(buf, fc->field, len);
+		strcpy(buf + len, "9 1.2.3.4:5");
+		ret = parse_ip_port_len(buf, len, &sa);
+		if (fc->family ? ret != 0 || check_addr(&sa, fc->family, fc->ip, fc->port)
+			       : ret != -1) {
+			fprintf(stderr, "FAIL: field '%s' %s\n", fc->field,
+				fc->family ? "misparsed" : "accepted");
+			errors++;
+		}
+	}
+
+	/* far beyond TICKLE_FIELD_MAX, no buffer may take it whole */
+	memset(buf, '1', sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	buf[sizeof(buf) - 4] = ':';
+	if (parse_ip_port_len(buf, sizeof(buf) - 1, &sa) != -1) {
+		fprintf(stderr, "FAIL: %d byte field accepted\n", (int)sizeof(buf) - 1);
+		errors++;
+	}
+	return errors;
+}
+
+static int run_reader(FILE *f, const char *input, size_t len, sock_addr *got,
+		      int max)
+{
+	static struct tickle_reader r;
+	int n = 0, ret;
+
+	if (ftruncate(fileno(f), 0) || pwrite(fileno(f), input, len, 0) != (ssize_t)len) {
+		return -2;
+	}
+	lseek(fileno(f), 0, SEEK_SET);
+	tickle_reader_init(&r, fileno(f));
+	while (n < max && (ret = tickle_reader_next(&r, &got[2 * n], &got[2 * n + 1])) > 0) {
+		n++;
+	}
+	return ret < 0 ? -1 : n;
+}
+
+static int check_reader(FILE *f)
+{
+	sock_addr got[2 * 4];
+	char *big;
+	size_t i;
+	int j, n, errors = 0;
+
+	for (i = 0; i < sizeof(reader_cases) / sizeof(reader_cases[0]); i++) {
+		const struct reader_case *rc = &reader_cases[i];
+
+		n = run_reader(f, rc->input, strlen(rc->input), got, 4);
+		if (n != rc->nlines) {
+			fprintf(stderr, "FAIL: input '%s' gave %d lines, not %d\n",
+				rc->name, n, rc->nlines);
+			errors++;
+			continue;
+		}
+		for (j = 0; j < n; j++) {
+			if (check_addr(&got[2 * j], rc->lines[j].family,
+				       rc->lines[j].ip1, rc->lines[j].port1) ||
+			    check_addr(&got[2 * j + 1], rc->lines[j].family,
+				       rc->lines[j].ip2, rc->lines[j].port2)) {
+				fprintf(stderr, "FAIL: input '%s' misparsed on line %d\n",
+					rc->name, j + 1);
+				errors++;
+			}
+		}
+	}
+
+	/* a line the read buffer can't hold ("Line %lu is too long") */
+	big = malloc(TICKLE_READ_BUF + 64);
+	if (!big) {
+		return errors + 1;
+	}
+	strcpy(big, "192.168.1.10:80 10.1.2.3:1024\n");
+	n = strlen(big);
+	memset(big + n, ' ', TICKLE_READ_BUF + 64 - n);
+	strcpy(big + TICKLE_READ_BUF + 32, "1.2.3.4:1 5.6.7.8:2\n");
+	if (run_reader(f, big, strlen(big), got, 4) != -1) {
+		fprintf(stderr, "FAIL: line longer than the read buffer accepted\n");
+		errors++;
+	}
+	free(big);
+	return errors;
+}
+
+/* Mostly IPv4, as in the state files portblock writes */
+static int write_lines(FILE *f, unsigned long n)
+{
+	unsigned long i;
+	uint32_t a;
+
+	for (i = 0; i < n; i++) {
+		a = rnd();
+		switch (i % 8) {
+		case 6:
+			fprintf(f, "2001:db8::%x:%x:443\t2001:db8:1:%x::%x:%u\n",
+				a >> 16, a & 0xffff, rnd() & 0xffff, rnd() & 0xffff,
+				1024 + rnd() % 64511);
+			break;
+		case 7:
+			fprintf(f, "[2001:db8::1]:80 [fd00::%x:%x]:%u\n",
+				a >> 16, a & 0xffff, 1024 + rnd() % 64511);
+			break;
+		default:
+			fprintf(f, "192.168.1.10:80\t%u.%u.%u.%u:%u\n",
+				a >> 24, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff,
+				1024 + rnd() % 64511);
+			break;
+		}
+	}
+	return fflush(f);
+}
+
+/* parse_ip_port() as tickle_tcp had it, for comparison */
+static int old_parse_ip_port(const char *addr, sock_addr *saddr)
+{
+	char *s, *p;
+	unsigned port;
+	char *endp = NULL;
+	int ret;
+
+	s = strdup(addr);
+	if (!s) {
+		return -1;
+	}
+
+	p = strrchr(s, ':');
+	if (!p) {
+		free(s);
+		return -1;
+	}
+
+	port = strtoul(p+1, &endp, 10);
+	if (!endp || *endp != 0) {
+		free(s);
+		return -1;
+	}
+	*p = 0;
+
+	ret = parse_ip(s, NULL, port, saddr);
+	free(s);
+	return ret;
+}
+
+static unsigned long bench_reader(int fd)
+{
+	static struct tickle_reader r;
+	sock_addr src, dst;
+	unsigned long n = 0;
+	int ret;
+
+	tickle_reader_init(&r, fd);
+	while ((ret = tickle_reader_next(&r, &src, &dst)) > 0) {
+		n++;
+	}
+	return ret == 0 ? n : 0;
+}
+
+/* The old loop; it can't read the bracketed lines, which are counted */
+static unsigned long bench_stdio(FILE *f, unsigned long *bad)
+{
+	char line[128], addr1[128], addr2[128];
+	sock_addr src, dst;
+	unsigned long n = 0;
+
+	*bad = 0;
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "%s %s", addr1, addr2);
+		if (old_parse_ip_port(addr1, &src) || old_parse_ip_port(addr2, &dst)) {
+			(*bad)++;
+			continue;
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Both parsers line by line, the old one on a mapping of the file; they
+ * must agree where the old one can read.
+ */
+static int cross_check(int fd, long bytes)
+{
+	static struct tickle_reader r;
+	char line[128], addr1[128], addr2[128];
+	sock_addr src, dst, osrc, odst;
+	const char *p, *nl;
+	char *map;
+	int ret = 1;
+
+	map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return 1;
+	}
+	lseek(fd, 0, SEEK_SET);
+	tickle_reader_init(&r, fd);
+	for (p = map; p < map + bytes; p = nl + 1) {
+		nl = memchr(p, '\n', map + bytes - p);
+		if (!nl || nl - p >= (long)sizeof(line)) {
+			goto out;
+		}
+		memcpy(line, p, nl - p);
+		line[nl - p] = 0;
+		if (tickle_reader_next(&r, &src, &dst) != 1 ||
+		    sscanf(line, "%s %s", addr1, addr2) != 2) {
+			goto out;
+		}
+		if (addr1[0] == '[') {
+			continue;
+		}
+		if (old_parse_ip_port(addr1, &osrc) || old_parse_ip_port(addr2, &odst) ||
+		    !same_addr(&src, &osrc) || !same_addr(&dst, &odst)) {
+			fprintf(stderr, "FAIL: parsers disagree on %s\n", line);
+			goto out;
+		}
+	}
+	ret = tickle_reader_next(&r, &src, &dst) != 0;
+  out:
+	munmap(map, bytes);
+	return ret;
+}
+
+static void report(const char *name, unsigned long n, double t, long bytes)
+{
+	printf("%-8s %10lu %9.3f %12.0f %9.1f\n", name, n, t, n / t,
+	       bytes / t / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nlines = DEFAULT_LINES, n, bad;
+	long bytes;
+	double t;
+	FILE *f;
+	int c, errors = 0;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			nlines = strtoul(optarg, NULL, 10);
+			if (nlines > 0) {
+				break;
+			}
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-n lines]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	f = tmpfile();
+	if (!f) {
+		fprintf(stderr, "Failed to create the test file\n");
+		return 2;
+	}
+
+	/* the parsers complain on stderr about the inputs they refuse */
+	errors += check_fields();
+	errors += check_reader(f);
+	printf("checks: %s\n", errors ? "FAILED" : "passed");
+
+	if (ftruncate(fileno(f), 0) || fseek(f, 0, SEEK_SET) ||
+	    write_lines(f, nlines) != 0) {
+		fprintf(stderr, "Failed to write the test file\n");
+		return 2;
+	}
+	bytes = ftell(f);
+
+	printf("parser        lines         s      lines/s      MB/s\n");
+
+	lseek(fileno(f), 0, SEEK_SET);
+	t = now();
+	n = bench_reader(fileno(f));
+	report("buffered", n, now() - t, bytes);
+	errors += n != nlines;
+
+	rewind(f);
+	t = now();
+	n = bench_stdio(f, &bad);
+	report("stdio", n, now() - t, bytes);
+	errors += n + bad != nlines || bad != nlines / 8;
+
+	errors += cross_check(fileno(f), bytes);
+
+	fclose(f);
+	return errors ? 1 : 0;
+}
@@ -19,328 +19,2446 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* sendmmsg() */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#define TICKLE_SOCK_DIAG
+#include <sys/ioctl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#ifdef PACKET_TX_RING
+#define TICKLE_TX_RING
+#endif
+#include <linux/filter.h>
+#define TICKLE_VERIFY
+#endif
 
-#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
+#include "tickle_parse.h"
+#include "tickle_csum.h"
 
+/* One tickle ACK, as it goes out of the raw socket */
 typedef union {
-	struct sockaddr     sa;
-	struct sockaddr_in  ip;
-	struct sockaddr_in6 ip6;
-} sock_addr;
+	struct {
+		struct iphdr ip;
+		struct tcphdr tcp;
+	} ip4;
+	struct {
+		struct ip6_hdr ip6;
+		struct tcphdr tcp;
+	} ip6;
+} tickle_pkt;
+
+/*
+ * The last tickle built, for each family and for ACK or RST.  The next
+ * one is a copy with the addresses, ports and sequence numbers changed,
+ * and its checksum patched for them instead of summed again.
+ */
+struct tickle_tmpl {
+	tickle_pkt pkt[4];
+	int valid[4];
+};
+
+/*
+ * Tickles queued for one raw socket.  The packets, their destinations
+ * and the message headers are allocated once, as arrays, and handed to
+ * the kernel with sendmmsg() a batch at a time.
+ */
+struct tickle_batch {
+	int s;
+	unsigned int n, max;
+	tickle_pkt *pkts;
+	sock_addr *to;
+	struct iovec *iov;
+	struct mmsghdr *msgs;
+	struct tickle_tmpl tmpl;
+};
+
+#define DEFAULT_BATCH 256
+#define DEFAULT_PLEN4 24
+#define DEFAULT_PLEN6 64
+#define MAX_WORKERS 64
+#define QUEUE_LEN 4096
+#define QUEUE_CHUNK 64
+#define MAX_PORT_RANGES 32
+
+#ifdef TICKLE_TX_RING
+/* A PACKET_TX_RING on one interface, and where we are in it */
+struct tickle_ring {
+	int s;
+	unsigned char *map;
+	size_t map_len;
+	unsigned int frame_size, frame_nr;
+	unsigned int cur, queued;
+	int ifindex;
+	unsigned char src_mac[ETH_ALEN];
+	unsigned char dst_mac[ETH_ALEN];
+	struct tickle_tmpl tmpl;
+};
+#endif
+
+void set_nonblocking(int fd);
+void set_close_on_exec(int fd);
+int open_raw_socket(int family);
+int build_tickle_ack(tickle_pkt *pkt, sock_addr *to,
+		     const sock_addr *dst,
+		     const sock_addr *src,
+		     uint32_t seq, uint32_t ack, int rst);
+int send_tickle_ack(int s,
+		    const sock_addr *dst, 
+		    const sock_addr *src, 
+		    uint32_t seq, uint32_t ack, int rst);
+int batch_init(struct tickle_batch *b, int s, unsigned int max);
+int batch_add(struct tickle_batch *b,
+	      const sock_addr *dst,
+	      const sock_addr *src,
+	      uint32_t seq, uint32_t ack, int rst);
+int batch_flush(struct tickle_batch *b);
+void batch_free(struct tickle_batch *b);
+#ifdef TICKLE_TX_RING
+int ring_init(struct tickle_ring *r, const char *ifname,
+	      const unsigned char *dst_mac, unsigned int frames);
+int ring_add(struct tickle_ring *r,
+	     const sock_addr *dst,
+	     const sock_addr *src,
+	     uint32_t seq, uint32_t ack, int rst);
+int ring_flush(struct tickle_ring *r);
+void ring_free(struct tickle_ring *r);
+#endif
+static void usage(void);
+
+/* 0 would mean no checksum in UDP; TCP takes it too, but stays with 0xFFFF */
+static uint16_t tcp_check(uint32_t sum)
+{
+	uint16_t check = csum_fold(sum);
+
+	return check ? check : 0xFFFF;
+}
+
+static uint16_t tcp_checksum(const void *data, size_t n, const struct iphdr *ip)
+{
+	uint32_t sum;
+
+	/* addresses, protocol and length of the pseudo header */
+	sum = csum_partial(&ip->saddr, 8, htons(ip->protocol) + htons(n));
+	return tcp_check(csum_partial(data, n, sum));
+}
+
+static uint16_t tcp_checksum6(const void *data, size_t n, const struct ip6_hdr *ip6)
+{
+	uint32_t sum;
+
+	/* the length is 32 bits in the IPv6 pseudo header */
+	sum = htons(n >> 16) + htons(n & 0xFFFF) + htons(ip6->ip6_nxt);
+	sum = csum_partial(&ip6->ip6_src, 32, sum);
+	return tcp_check(csum_partial(data, n, sum));
+}
+
+#ifdef TICKLE_TX_RING
+static uint16_t ip_checksum(const struct iphdr *ip)
+{
+	return csum_fold(csum_partial(ip, ip->ihl * 4, 0));
+}
+#endif
+
+void set_nonblocking(int fd)
+{
+	unsigned v;
+	v = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, v | O_NONBLOCK);
+}
+
+void set_close_on_exec(int fd) 
+{               
+	unsigned v;
+	v = fcntl(fd, F_GETFD, 0);
+	fcntl(fd, F_SETFD, v | FD_CLOEXEC);
+}
+
+/*
+ * Open the raw socket for one address family.  It is opened once and
+ * used for every tickle, rather than once per packet.
+ */
+int open_raw_socket(int family)
+{
+	int s;
+	uint32_t one = 1;
+
+	s = socket(family, SOCK_RAW, IPPROTO_RAW);
+	if (s == -1) {
+		return -1;
+	}
+
+	if (family == AF_INET &&
+	    setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
+		fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	set_nonblocking(s);
+	set_close_on_exec(s);
+	return s;
+}
+
+/*
+ * The sockets are non-blocking, so a long list of tickles can fill up
+ * the send buffer; wait for room rather than dropping the packet.
+ */
+static ssize_t send_packet(int s, const void *pkt, size_t len,
+			   const struct sockaddr *to, socklen_t tolen)
+{
+	struct pollfd pfd;
+	ssize_t ret;
+
+	for (;;) {
+		ret = sendto(s, pkt, len, 0, to, tolen);
+		if (ret >= 0 || errno == EINTR) {
+			if (ret >= 0)
+				return ret;
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+		pfd.fd = s;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 1000) == -1 && errno != EINTR) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Fill in the tickle ACK for the connection src -> dst, and the address
+ * to send it to.  Returns the length of the packet.
+ */
+int build_tickle_ack(tickle_pkt *pkt, sock_addr *to,
+		     const sock_addr *dst,
+		     const sock_addr *src,
+		     uint32_t seq, uint32_t ack, int rst)
+{
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		memset(&pkt->ip4, 0, sizeof(pkt->ip4));
+		pkt->ip4.ip.version  = 4;
+		pkt->ip4.ip.ihl      = sizeof(pkt->ip4.ip)/4;
+		pkt->ip4.ip.tot_len  = htons(sizeof(pkt->ip4));
+		pkt->ip4.ip.ttl      = 255;
+		pkt->ip4.ip.protocol = IPPROTO_TCP;
+		pkt->ip4.ip.saddr    = src->ip.sin_addr.s_addr;
+		pkt->ip4.ip.daddr    = dst->ip.sin_addr.s_addr;
+		pkt->ip4.ip.check    = 0;
+
+		pkt->ip4.tcp.source  = src->ip.sin_port;
+		pkt->ip4.tcp.dest    = dst->ip.sin_port;
+		pkt->ip4.tcp.seq     = seq;
+		pkt->ip4.tcp.ack_seq = ack;
+		pkt->ip4.tcp.ack     = 1;
+		if (rst)
+			pkt->ip4.tcp.rst = 1;
+		pkt->ip4.tcp.doff    = sizeof(pkt->ip4.tcp)/4;
+		pkt->ip4.tcp.window   = htons(1234);
+		pkt->ip4.tcp.check    = tcp_checksum(&pkt->ip4.tcp, sizeof(pkt->ip4.tcp), &pkt->ip4.ip);
+
+		to->ip = dst->ip;
+		return sizeof(pkt->ip4);
+
+        case AF_INET6:
+		memset(&pkt->ip6, 0, sizeof(pkt->ip6));
+		pkt->ip6.ip6.ip6_vfc  = 0x60;
+		pkt->ip6.ip6.ip6_plen = htons(20);
+		pkt->ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+		pkt->ip6.ip6.ip6_hlim = 64;
+		pkt->ip6.ip6.ip6_src  = src->ip6.sin6_addr;
+		pkt->ip6.ip6.ip6_dst  = dst->ip6.sin6_addr;
+
+		pkt->ip6.tcp.source   = src->ip6.sin6_port;
+		pkt->ip6.tcp.dest     = dst->ip6.sin6_port;
+		pkt->ip6.tcp.seq      = seq;
+		pkt->ip6.tcp.ack_seq  = ack;
+		pkt->ip6.tcp.ack      = 1;
+		if (rst)
+			pkt->ip6.tcp.rst      = 1;
+		pkt->ip6.tcp.doff     = sizeof(pkt->ip6.tcp)/4;
+		pkt->ip6.tcp.window   = htons(1234);
+		pkt->ip6.tcp.check    = tcp_checksum6(&pkt->ip6.tcp, sizeof(pkt->ip6.tcp), &pkt->ip6.ip6);
+
+		/* the port of a raw IPv6 destination must be 0 */
+		to->ip6 = dst->ip6;
+		to->ip6.sin6_port = 0;
+		return sizeof(pkt->ip6);
+
+	default:
+		fprintf(stderr, "Not an ipv4/v6 address\n");
+		return -1;
+	}
+}
+
+/* Change a field of the template, and its TCP checksum with it */
+static void tmpl_set16(void *field, uint16_t to, uint16_t *check)
+{
+	uint16_t from;
+
+	memcpy(&from, field, 2);
+	if (from != to) {
+		*check = csum_replace2(*check, from, to);
+		memcpy(field, &to, 2);
+	}
+}
+
+static void tmpl_set32(void *field, const void *to, uint16_t *check)
+{
+	uint32_t from, v;
+
+	memcpy(&from, field, 4);
+	memcpy(&v, to, 4);
+	if (from != v) {
+		*check = csum_replace4(*check, from, v);
+		memcpy(field, &v, 4);
+	}
+}
+
+/*
+ * build_tickle_ack(), by way of the template: the first packet of a
+ * kind is built in full, the ones after it by patching the one before.
+ */
+static int build_tickle_ack_tmpl(struct tickle_tmpl *t,
+				 tickle_pkt *pkt, sock_addr *to,
+				 const sock_addr *dst,
+				 const sock_addr *src,
+				 uint32_t seq, uint32_t ack, int rst)
+{
+	struct tcphdr *tcp;
+	uint16_t check;
+	int i, k;
+
+	if (src->sa.sa_family != AF_INET && src->sa.sa_family != AF_INET6) {
+		return build_tickle_ack(pkt, to, dst, src, seq, ack, rst);
+	}
+	k = (src->sa.sa_family == AF_INET6) * 2 + (rst != 0);
+	if (!t->valid[k]) {
+		if (build_tickle_ack(&t->pkt[k], to, dst, src, seq, ack, rst) < 0) {
+			return -1;
+		}
+		t->valid[k] = 1;
+	}
+
+	if (src->sa.sa_family == AF_INET6) {
+		tcp = &t->pkt[k].ip6.tcp;
+		check = tcp->check;
+		for (i = 0; i < 16; i += 4) {
+			tmpl_set32(t->pkt[k].ip6.ip6.ip6_src.s6_addr + i,
+				   src->ip6.sin6_addr.s6_addr + i, &check);
+			tmpl_set32(t->pkt[k].ip6.ip6.ip6_dst.s6_addr + i,
+				   dst->ip6.sin6_addr.s6_addr + i, &check);
+		}
+		to->ip6 = dst->ip6;
+		to->ip6.sin6_port = 0;
+	} else {
+		tcp = &t->pkt[k].ip4.tcp;
+		check = tcp->check;
+		tmpl_set32(&t->pkt[k].ip4.ip.saddr, &src->ip.sin_addr.s_addr, &check);
+		tmpl_set32(&t->pkt[k].ip4.ip.daddr, &dst->ip.sin_addr.s_addr, &check);
+		to->ip = dst->ip;
+	}
+	tmpl_set16(&tcp->source, src->ip.sin_port, &check);
+	tmpl_set16(&tcp->dest, dst->ip.sin_port, &check);
+	tmpl_set32(&tcp->seq, &seq, &check);
+	tmpl_set32(&tcp->ack_seq, &ack, &check);
+	tcp->check = check ? check : 0xFFFF;
+
+	if (src->sa.sa_family == AF_INET6) {
+		memcpy(pkt, &t->pkt[k], sizeof(pkt->ip6));
+		return sizeof(pkt->ip6);
+	}
+	memcpy(pkt, &t->pkt[k], sizeof(pkt->ip4));
+	return sizeof(pkt->ip4);
+}
+
+static socklen_t sock_addr_len(const sock_addr *addr)
+{
+	return addr->sa.sa_family == AF_INET6 ? sizeof(addr->ip6) : sizeof(addr->ip);
+}
+
+int send_tickle_ack(int s,
+		    const sock_addr *dst,
+		    const sock_addr *src,
+		    uint32_t seq, uint32_t ack, int rst)
+{
+	tickle_pkt pkt;
+	sock_addr to;
+	int len;
+
+	if (s == -1) {
+		fprintf(stderr, "No raw socket for this address family\n");
+		return -1;
+	}
+
+	len = build_tickle_ack(&pkt, &to, dst, src, seq, ack, rst);
+	if (len < 0) {
+		return -1;
+	}
+
+	if (send_packet(s, &pkt, len, &to.sa, sock_addr_len(&to)) != len) {
+		fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void batch_free(struct tickle_batch *b)
+{
+	free(b->pkts);
+	free(b->to);
+	free(b->iov);
+	free(b->msgs);
+	memset(b, 0, sizeof(*b));
+	b->s = -1;
+}
+
+int batch_init(struct tickle_batch *b, int s, unsigned int max)
+{
+	unsigned int i;
+
+	memset(b, 0, sizeof(*b));
+	b->s    = s;
+	b->max  = max;
+	b->pkts = calloc(max, sizeof(*b->pkts));
+	b->to   = calloc(max, sizeof(*b->to));
+	b->iov  = calloc(max, sizeof(*b->iov));
+	b->msgs = calloc(max, sizeof(*b->msgs));
+	if (!b->pkts || !b->to || !b->iov || !b->msgs) {
+		fprintf(stderr, "Failed to allocate a batch of %u packets\n", max);
+		batch_free(b);
+		return -1;
+	}
+
+	for (i = 0; i < max; i++) {
+		b->iov[i].iov_base = &b->pkts[i];
+		b->msgs[i].msg_hdr.msg_name   = &b->to[i];
+		b->msgs[i].msg_hdr.msg_iov    = &b->iov[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	return 0;
+}
+
+/*
+ * Send all the queued tickles.  sendmmsg() stops at the first packet
+ * it could not send, so a short count just means starting again from
+ * there; a full socket buffer is waited out like in send_packet().
+ */
+int batch_flush(struct tickle_batch *b)
+{
+	struct pollfd pfd;
+	unsigned int sent = 0;
+	int ret;
+
+	while (sent < b->n) {
+		ret = sendmmsg(b->s, b->msgs + sent, b->n - sent, 0);
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pfd.fd = b->s;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, 1000) == -1 && errno != EINTR) {
+				fprintf(stderr, "Failed poll (%s)\n", strerror(errno));
+				return -1;
+			}
+			continue;
+		}
+		fprintf(stderr, "Failed sendmmsg (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	b->n = 0;
+	return 0;
+}
+
+/* Queue a tickle ACK, and send the batch once it is full */
+int batch_add(struct tickle_batch *b,
+	      const sock_addr *dst,
+	      const sock_addr *src,
+	      uint32_t seq, uint32_t ack, int rst)
+{
+	int len;
+
+	if (b->s == -1) {
+		fprintf(stderr, "No raw socket for this address family\n");
+		return -1;
+	}
+
+	len = build_tickle_ack_tmpl(&b->tmpl, &b->pkts[b->n], &b->to[b->n], dst, src, seq, ack, rst);
+	if (len < 0) {
+		return -1;
+	}
+	b->iov[b->n].iov_len = len;
+	b->msgs[b->n].msg_hdr.msg_namelen = sock_addr_len(&b->to[b->n]);
+
+	if (++b->n == b->max) {
+		return batch_flush(b);
+	}
+	return 0;
+}
+
+#ifdef TICKLE_TX_RING
+/*
+ * The TX ring engine: full Ethernet frames are written straight into a
+ * PACKET_TX_RING shared with the kernel, and one send() hands it the
+ * whole ring.  All frames go to one next hop, normally the router of
+ * the link the clients are behind.
+ */
+int ring_init(struct tickle_ring *r, const char *ifname,
+	      const unsigned char *dst_mac, unsigned int frames)
+{
+	struct tpacket_req req;
+	struct sockaddr_ll sll;
+	struct ifreq ifr;
+	int version = TPACKET_V2;
+	unsigned int per_block;
+
+	memset(r, 0, sizeof(*r));
+	r->s = socket(AF_PACKET, SOCK_RAW, 0);
+	if (r->s == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(r->s);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(r->s, SIOCGIFINDEX, &ifr) != 0) {
+		fprintf(stderr, "Unknown interface %s (%s)\n", ifname, strerror(errno));
+		goto failed;
+	}
+	r->ifindex = ifr.ifr_ifindex;
+	if (ioctl(r->s, SIOCGIFHWADDR, &ifr) != 0) {
+		fprintf(stderr, "Failed to get the address of %s (%s)\n", ifname, strerror(errno));
+		goto failed;
+	}
+	memcpy(r->src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	memcpy(r->dst_mac, dst_mac, ETH_ALEN);
+
+	if (setsockopt(r->s, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+		fprintf(stderr, "Failed to set TPACKET_V2 (%s)\n", strerror(errno));
+		goto failed;
+	}
+
+	r->frame_size = TPACKET_ALIGN(TPACKET2_HDRLEN + ETH_HLEN + sizeof(tickle_pkt));
+	per_block = getpagesize() / r->frame_size;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = getpagesize();
+	req.tp_block_nr   = (frames + per_block - 1) / per_block;
+	req.tp_frame_size = r->frame_size;
+	req.tp_frame_nr   = req.tp_block_nr * per_block;
+	if (setsockopt(r->s, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) {
+		fprintf(stderr, "Failed to set up the TX ring (%s)\n", strerror(errno));
+		goto failed;
+	}
+	r->frame_nr = req.tp_frame_nr;
+	r->map_len  = (size_t)req.tp_block_size * req.tp_block_nr;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->s, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		fprintf(stderr, "Failed to map the TX ring (%s)\n", strerror(errno));
+		goto failed;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family  = AF_PACKET;
+	sll.sll_ifindex = r->ifindex;
+	if (bind(r->s, (struct sockaddr *)&sll, sizeof(sll)) != 0) {
+		fprintf(stderr, "Failed to bind to %s (%s)\n", ifname, strerror(errno));
+		goto failed;
+	}
+	return 0;
+
+failed:
+	ring_free(r);
+	return -1;
+}
+
+void ring_free(struct tickle_ring *r)
+{
+	if (r->map)
+		munmap(r->map, r->map_len);
+	if (r->s != -1)
+		close(r->s);
+	memset(r, 0, sizeof(*r));
+	r->s = -1;
+}
+
+/*
+ * Hand the queued frames to the kernel.  A blocking send() returns once
+ * they are all on their way, and their slots are free again.
+ */
+int ring_flush(struct tickle_ring *r)
+{
+	while (r->queued) {
+		if (send(r->s, NULL, 0, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to send the TX ring (%s)\n", strerror(errno));
+			return -1;
+		}
+		r->queued = 0;
+	}
+	return 0;
+}
+
+int ring_add(struct tickle_ring *r,
+	     const sock_addr *dst,
+	     const sock_addr *src,
+	     uint32_t seq, uint32_t ack, int rst)
+{
+	struct tpacket2_hdr *hdr;
+	struct ethhdr *eth;
+	tickle_pkt *pkt;
+	sock_addr to;
+	int len;
+
+	hdr = (struct tpacket2_hdr *)(void *)(r->map + (size_t)r->cur * r->frame_size);
+	if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+		if (ring_flush(r)) {
+			return -1;
+		}
+		if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+			fprintf(stderr, "TX ring frame not released by the kernel (status 0x%x)\n",
+				hdr->tp_status);
+			return -1;
+		}
+	}
+
+	eth = (struct ethhdr *)(void *)((unsigned char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+	pkt = (tickle_pkt *)(void *)(eth + 1);
+	len = build_tickle_ack_tmpl(&r->tmpl, pkt, &to, dst, src, seq, ack, rst);
+	if (len < 0) {
+		return -1;
+	}
+	memcpy(eth->h_dest, r->dst_mac, ETH_ALEN);
+	memcpy(eth->h_source, r->src_mac, ETH_ALEN);
+	if (src->sa.sa_family == AF_INET) {
+		/* no raw IP socket to fill in the header checksum */
+		eth->h_proto = htons(ETH_P_IP);
+		pkt->ip4.ip.check = ip_checksum(&pkt->ip4.ip);
+	} else {
+		eth->h_proto = htons(ETH_P_IPV6);
+	}
+
+	hdr->tp_len = ETH_HLEN + len;
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+	r->queued++;
+	if (++r->cur == r->frame_nr) {
+		r->cur = 0;
+		return ring_flush(r);
+	}
+	return 0;
+}
+
+static int parse_mac(const char *s, unsigned char *mac)
+{
+	char c;
+
+	if (sscanf(s, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c", &mac[0], &mac[1],
+		   &mac[2], &mac[3], &mac[4], &mac[5], &c) != 6) {
+		return -1;
+	}
+	return 0;
+}
+#endif /* TICKLE_TX_RING */
+
+static void format_ip_port(const sock_addr *addr, char *buf, size_t len)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	if (addr->sa.sa_family == AF_INET6) {
+		inet_ntop(AF_INET6, &addr->ip6.sin6_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(addr->ip6.sin6_port));
+	} else {
+		inet_ntop(AF_INET, &addr->ip.sin_addr, ip, sizeof(ip));
+		snprintf(buf, len, "%s:%u", ip, ntohs(addr->ip.sin_port));
+	}
+}
+
+/*
+ * The workers.
+ *
+ * main() parses the input and deals the connections out to the worker
+ * threads by destination subnet, so that every subnet is handled by one
+ * worker and its budget needs no locking.  Each worker has sockets of
+ * its own.  The global packets per second limit is a token bucket that
+ * all the workers draw from.
+ */
+struct tickle_conn {
+	sock_addr src, dst;
+	double not_before;	/* when the subnet budget allows it */
+};
+
+/* The connections main() hands to one worker */
+struct conn_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct tickle_conn *c;
+	unsigned int head, n, max;
+	int closed;
+};
+
+struct token_bucket {
+	pthread_mutex_t lock;
+	double rate, burst;
+	double tokens, last;
+};
+
+struct subnet_budget {
+	unsigned char key[17];	/* the family, then the masked address */
+	int used;
+	double tokens, last;
+};
+
+struct tickle_engine {
+	int use_ring;
+	struct tickle_batch b4, b6;
+#ifdef TICKLE_TX_RING
+	struct tickle_ring ring;
+#endif
+};
+
+struct tickle_worker {
+	pthread_t tid;
+	struct conn_queue in;
+	struct tickle_conn out[QUEUE_CHUNK];	/* filled by main() */
+	unsigned int nout;
+	struct tickle_conn inbox[QUEUE_CHUNK];	/* taken by the worker */
+	unsigned int nin, iin;
+	struct tickle_engine e;
+	struct tickle_conn *held;	/* waiting for their subnet, a heap */
+	unsigned int nheld, maxheld;
+	struct subnet_budget *subnets;
+	unsigned int nsubnets, maxsubnets;
+	double stash;			/* tokens taken from the bucket */
+	unsigned long conns, packets;
+	int failed;
+};
+
+static struct {
+	int num, batch;
+	const char *ring_if;
+	unsigned char ring_mac[6];
+	double subnet_rate;
+	int plen4, plen6;
+	struct token_bucket bucket;
+} opts;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void bucket_init(struct token_bucket *tb, double rate)
+{
+	pthread_mutex_init(&tb->lock, NULL);
+	tb->rate = rate;
+	/* 10ms worth of packets, so that the rate holds at a fine grain */
+	tb->burst = rate / 100 > 1 ? rate / 100 : 1;
+	tb->tokens = tb->burst;
+	tb->last = now();
+}
+
+/*
+ * Take up to want tokens.  Returns how many were taken; if block is set,
+ * waits until there is at least one.
+ */
+static double bucket_take(struct token_bucket *tb, double want, int block)
+{
+	double t, got;
+
+	if (tb->rate <= 0) {
+		return want;
+	}
+
+	pthread_mutex_lock(&tb->lock);
+	for (;;) {
+		t = now();
+		tb->tokens += (t - tb->last) * tb->rate;
+		if (tb->tokens > tb->burst)
+			tb->tokens = tb->burst;
+		tb->last = t;
+		if (tb->tokens >= 1 || !block)
+			break;
+		pthread_mutex_unlock(&tb->lock);
+		sleep_until(t + (1 - tb->tokens) / tb->rate);
+		pthread_mutex_lock(&tb->lock);
+	}
+	got = tb->tokens < 1 ? 0 : tb->tokens < want ? tb->tokens : want;
+	tb->tokens -= got;
+	pthread_mutex_unlock(&tb->lock);
+	return got;
+}
+
+/* The family, then the address masked to the budget prefix length */
+static void subnet_key(const sock_addr *addr, unsigned char *key)
+{
+	const unsigned char *a;
+	int len, plen, i;
+
+	memset(key, 0, 17);
+	key[0] = addr->sa.sa_family;
+	if (addr->sa.sa_family == AF_INET6) {
+		a = addr->ip6.sin6_addr.s6_addr;
+		len = 16;
+		plen = opts.plen6;
+	} else {
+		a = (const unsigned char *)&addr->ip.sin_addr.s_addr;
+		len = 4;
+		plen = opts.plen4;
+	}
+	for (i = 0; i < len && plen > 0; i++, plen -= 8) {
+		key[i + 1] = plen >= 8 ? a[i] : a[i] & (0xff << (8 - plen));
+	}
+}
+
+static uint32_t key_hash(const unsigned char *key)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < 17; i++) {
+		h = (h ^ key[i]) * 16777619U;
+	}
+	return h;
+}
+
+static struct subnet_budget *subnet_find(struct tickle_worker *w, const unsigned char *key)
+{
+	struct subnet_budget *sb, *old;
+	unsigned int i, oldmax;
+
+	if (2 * (w->nsubnets + 1) > w->maxsubnets) {
+		old = w->subnets;
+		oldmax = w->maxsubnets;
+		w->maxsubnets = oldmax ? 2 * oldmax : 256;
+		w->subnets = calloc(w->maxsubnets, sizeof(*w->subnets));
+		if (!w->subnets) {
+			fprintf(stderr, "Failed to allocate the subnet budgets\n");
+			w->subnets = old;
+			w->maxsubnets = oldmax;
+			return NULL;
+		}
+		w->nsubnets = 0;
+		for (i = 0; i < oldmax; i++) {
+			if (old[i].used) {
+				sb = subnet_find(w, old[i].key);
+				*sb = old[i];
+			}
+		}
+		free(old);
+	}
+
+	i = key_hash(key) & (w->maxsubnets - 1);
+	while (w->subnets[i].used && memcmp(w->subnets[i].key, key, 17) != 0) {
+		i = (i + 1) & (w->maxsubnets - 1);
+	}
+	sb = &w->subnets[i];
+	if (!sb->used) {
+		memcpy(sb->key, key, 17);
+		sb->used = 1;
+		sb->tokens = opts.subnet_rate / 10 > opts.num ? opts.subnet_rate / 10 : opts.num;
+		sb->last = now();
+		w->nsubnets++;
+	}
+	return sb;
+}
+
+/*
+ * Charge a connection to the budget of its subnet, which may go into
+ * debt.  Returns when the debt is paid off, which is when it may go.
+ */
+static int subnet_reserve(struct tickle_worker *w, struct tickle_conn *c)
+{
+	unsigned char key[17];
+	struct subnet_budget *sb;
+	double t = now(), burst;
+
+	subnet_key(&c->dst, key);
+	if ((sb = subnet_find(w, key)) == NULL) {
+		return -1;
+	}
+	burst = opts.subnet_rate / 10 > opts.num ? opts.subnet_rate / 10 : opts.num;
+	sb->tokens += (t - sb->last) * opts.subnet_rate;
+	if (sb->tokens > burst)
+		sb->tokens = burst;
+	sb->last = t;
+	sb->tokens -= opts.num;
+	c->not_before = sb->tokens >= 0 ? t : t - sb->tokens / opts.subnet_rate;
+	return 0;
+}
+
+static int held_push(struct tickle_worker *w, const struct tickle_conn *c)
+{
+	struct tickle_conn *h, tmp;
+	unsigned int i;
+
+	if (w->nheld == w->maxheld) {
+		unsigned int n = w->maxheld ? 2 * w->maxheld : 256;
+
+		h = realloc(w->held, n * sizeof(*h));
+		if (!h) {
+			fprintf(stderr, "Failed to allocate the held connections\n");
+			return -1;
+		}
+		w->held = h;
+		w->maxheld = n;
+	}
+	h = w->held;
+	i = w->nheld++;
+	h[i] = *c;
+	while (i > 0 && h[(i - 1) / 2].not_before > h[i].not_before) {
+		tmp = h[i];
+		h[i] = h[(i - 1) / 2];
+		h[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+	return 0;
+}
+
+static void held_pop(struct tickle_worker *w, struct tickle_conn *c)
+{
+	struct tickle_conn *h = w->held, tmp;
+	unsigned int i = 0, l;
+
+	*c = h[0];
+	h[0] = h[--w->nheld];
+	for (;;) {
+		l = 2 * i + 1;
+		if (l >= w->nheld)
+			break;
+		if (l + 1 < w->nheld && h[l + 1].not_before < h[l].not_before)
+			l++;
+		if (h[i].not_before <= h[l].not_before)
+			break;
+		tmp = h[i];
+		h[i] = h[l];
+		h[l] = tmp;
+		i = l;
+	}
+}
+
+static int queue_init(struct conn_queue *q, unsigned int max)
+{
+	pthread_condattr_t attr;
+
+	memset(q, 0, sizeof(*q));
+	q->c = calloc(max, sizeof(*q->c));
+	if (!q->c) {
+		fprintf(stderr, "Failed to allocate a queue of %u connections\n", max);
+		return -1;
+	}
+	q->max = max;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->not_empty, &attr);
+	pthread_cond_init(&q->not_full, &attr);
+	pthread_condattr_destroy(&attr);
+	return 0;
+}
+
+static void queue_free(struct conn_queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->c);
+}
+
+/*
+ * Connections go through the queue in chunks, to take the lock once
+ * per chunk rather than once per connection.  Returns -1 if the worker
+ * has given up.
+ */
+static int queue_push(struct conn_queue *q, const struct tickle_conn *c, unsigned int n)
+{
+	pthread_mutex_lock(&q->lock);
+	while (n) {
+		while (q->n == q->max && !q->closed) {
+			pthread_cond_wait(&q->not_full, &q->lock);
+		}
+		if (q->closed) {
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		if (q->n == 0)
+			pthread_cond_signal(&q->not_empty);
+		for (; n && q->n < q->max; n--, q->n++) {
+			q->c[(q->head + q->n) % q->max] = *c++;
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/*
+ * Take up to max connections.  wait is 0 not to wait, -1 to wait for
+ * as long as it takes, or else the time to wait until.  Returns the
+ * number taken, 0 if there were none in time, and -1 once the queue
+ * is closed and empty.
+ */
+static int queue_pop(struct conn_queue *q, struct tickle_conn *c,
+		     unsigned int max, double wait)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	ts.tv_sec = (time_t)wait;
+	ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->n == 0 && !q->closed) {
+		if (wait < 0)
+			pthread_cond_wait(&q->not_empty, &q->lock);
+		else if (wait <= 0)
+			break;
+		else if (pthread_cond_timedwait(&q->not_empty, &q->lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	if (q->n == q->max)
+		pthread_cond_signal(&q->not_full);
+	for (; q->n && ret < (int)max; ret++, q->n--) {
+		c[ret] = q->c[q->head];
+		q->head = (q->head + 1) % q->max;
+	}
+	if (ret == 0 && q->closed)
+		ret = -1;
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+static void queue_close(struct conn_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int engine_init(struct tickle_engine *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->b4.s = e->b6.s = -1;
+#ifdef TICKLE_TX_RING
+	e->ring.s = -1;
+	if (opts.ring_if) {
+		e->use_ring = 1;
+		return ring_init(&e->ring, opts.ring_if, opts.ring_mac, opts.batch);
+	}
+#endif
+	if (batch_init(&e->b4, open_raw_socket(AF_INET), opts.batch)) {
+		return -1;
+	}
+	if (e->b4.s == -1) {
+		fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	/* hosts without IPv6 are fine, until an IPv6 tickle shows up */
+	return batch_init(&e->b6, open_raw_socket(AF_INET6), opts.batch);
+}
+
+static int engine_add(struct tickle_engine *e, const struct tickle_conn *c)
+{
+#ifdef TICKLE_TX_RING
+	if (e->use_ring)
+		return ring_add(&e->ring, &c->dst, &c->src, 0, 0, 0);
+#endif
+	return batch_add(c->src.sa.sa_family == AF_INET6 ? &e->b6 : &e->b4,
+			 &c->dst, &c->src, 0, 0, 0);
+}
+
+static int engine_flush(struct tickle_engine *e)
+{
+#ifdef TICKLE_TX_RING
+	if (e->use_ring)
+		return ring_flush(&e->ring);
+#endif
+	if (batch_flush(&e->b4) || batch_flush(&e->b6)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void engine_free(struct tickle_engine *e)
+{
+#ifdef TICKLE_TX_RING
+	if (e->use_ring) {
+		ring_free(&e->ring);
+		return;
+	}
+#endif
+	if (e->b4.s != -1)
+		close(e->b4.s);
+	if (e->b6.s != -1)
+		close(e->b6.s);
+	batch_free(&e->b4);
+	batch_free(&e->b6);
+}
+
+static int worker_send(struct tickle_worker *w, const struct tickle_conn *c)
+{
+	char addr1[INET6_ADDRSTRLEN + 8], addr2[INET6_ADDRSTRLEN + 8];
+	double got;
+	int i;
+
+	while (w->stash < opts.num) {
+		got = bucket_take(&opts.bucket, opts.num - w->stash, 0);
+		if (got <= 0) {
+			/* out of tokens: send what is queued, then wait */
+			if (engine_flush(&w->e)) {
+				return -1;
+			}
+			got = bucket_take(&opts.bucket, opts.num - w->stash, 1);
+		}
+		w->stash += got;
+	}
+	w->stash -= opts.num;
+
+	for (i = 1; i <= opts.num; i++) {
+		if (engine_add(&w->e, c)) {
+			format_ip_port(&c->src, addr1, sizeof(addr1));
+			format_ip_port(&c->dst, addr2, sizeof(addr2));
+			fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
+				addr1, addr2);
+			return -1;
+		}
+		w->packets++;
+	}
+	w->conns++;
+	return 0;
+}
+
+static int worker_next(struct tickle_worker *w, struct tickle_conn *c, double wait)
+{
+	int ret;
+
+	if (w->iin == w->nin) {
+		ret = queue_pop(&w->in, w->inbox, QUEUE_CHUNK, wait);
+		if (ret <= 0) {
+			return ret;
+		}
+		w->nin = ret;
+		w->iin = 0;
+	}
+	*c = w->inbox[w->iin++];
+	return 1;
+}
+
+static void *worker_main(void *arg)
+{
+	struct tickle_worker *w = arg;
+	struct tickle_conn c;
+	int ret;
+
+	for (;;) {
+		if (w->nheld && w->held[0].not_before <= now()) {
+			held_pop(w, &c);
+		} else {
+			ret = worker_next(w, &c, 0);
+			if (ret == 0) {
+				/* nothing to do right now: send what is queued */
+				if (engine_flush(&w->e)) {
+					goto failed;
+				}
+				ret = worker_next(w, &c, w->nheld ? w->held[0].not_before : -1);
+			}
+			if (ret == 0) {
+				continue;
+			}
+			if (ret < 0) {
+				if (!w->nheld) {
+					break;
+				}
+				if (engine_flush(&w->e)) {
+					goto failed;
+				}
+				sleep_until(w->held[0].not_before);
+				continue;
+			}
+			if (opts.subnet_rate > 0) {
+				if (subnet_reserve(w, &c)) {
+					goto failed;
+				}
+				if (c.not_before > now()) {
+					if (held_push(w, &c)) {
+						goto failed;
+					}
+					continue;
+				}
+			}
+		}
+		if (worker_send(w, &c)) {
+			goto failed;
+		}
+	}
+
+	if (engine_flush(&w->e) == 0) {
+		return NULL;
+	}
+failed:
+	w->failed = 1;
+	queue_close(&w->in);
+	return NULL;
+}
+
+struct tickle_pool {
+	struct tickle_worker *workers;
+	int n;
+};
+
+/*
+ * Hand a connection to the worker for its destination; all of a budget
+ * subnet goes to the same one.
+ */
+static int dispatch(const struct tickle_conn *c, void *arg)
+{
+	struct tickle_pool *pool = arg;
+	struct tickle_worker *w;
+	unsigned char key[17];
+
+	subnet_key(&c->dst, key);
+	w = &pool->workers[key_hash(key) % pool->n];
+	w->out[w->nout++] = *c;
+	if (w->nout == QUEUE_CHUNK) {
+		w->nout = 0;
+		return queue_push(&w->in, w->out, QUEUE_CHUNK);
+	}
+	return 0;
+}
+
+/* Local ports to dump, as ranges; none means all of them */
+struct port_set {
+	unsigned int n;
+	struct {
+		uint16_t lo, hi;
+	} r[MAX_PORT_RANGES];
+};
+
+/* port[,port...], where a port may be a range lo:hi, as for portblock */
+static int parse_ports(const char *s, struct port_set *ports)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	ports->n = 0;
+	for (;;) {
+		if (ports->n == MAX_PORT_RANGES) {
+			return -1;
+		}
+		lo = hi = strtoul(s, &end, 10);
+		if (end == s) {
+			return -1;
+		}
+		if (*end == ':' || *end == '-') {
+			s = end + 1;
+			hi = strtoul(s, &end, 10);
+			if (end == s) {
+				return -1;
+			}
+		}
+		if (lo > hi || hi > 65535) {
+			return -1;
+		}
+		ports->r[ports->n].lo = lo;
+		ports->r[ports->n].hi = hi;
+		ports->n++;
+		if (*end == 0) {
+			return 0;
+		}
+		if (*end != ',') {
+			return -1;
+		}
+		s = end + 1;
+	}
+}
+
+static int port_wanted(const struct port_set *ports, uint16_t port)
+{
+	unsigned int i;
+
+	if (ports->n == 0) {
+		return 1;
+	}
+	for (i = 0; i < ports->n; i++) {
+		if (port >= ports->r[i].lo && port <= ports->r[i].hi) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#ifdef TICKLE_SOCK_DIAG
+static void diag_addr(sock_addr *addr, int family, const uint32_t *a, uint16_t port)
+{
+	memset(addr, 0, sizeof(*addr));
+	if (family == AF_INET6 &&
+	    !IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)(const void *)a)) {
+		addr->ip6.sin6_family = AF_INET6;
+		memcpy(&addr->ip6.sin6_addr, a, 16);
+		addr->ip6.sin6_port = port;
+	} else {
+		/* IPv4, also when it came in on a dual stack socket */
+		addr->ip.sin_family = AF_INET;
+		addr->ip.sin_addr.s_addr = family == AF_INET6 ? a[3] : a[0];
+		addr->ip.sin_port = port;
+	}
+}
+
+/*
+ * Dump the established TCP sockets of one family with a local address
+ * of vip.  The kernel does the address match, with a one instruction
+ * filter program; the ports are checked here.
+ */
+static int diag_dump(int nl, int family, const sock_addr *vip,
+		     const struct port_set *ports, int swap,
+		     int (*fn)(const struct tickle_conn *c, void *arg), void *arg)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+		struct rtattr rta;
+		struct inet_diag_bc_op op;
+		struct inet_diag_hostcond cond;
+		uint32_t addr[4];
+	} req;
+	struct sockaddr_nl nladdr;
+	struct inet_diag_msg *m;
+	struct nlmsghdr *h;
+	struct tickle_conn c;
+	sock_addr local, remote;
+	static char buf[65536];
+	int alen, len, ret;
+
+	alen = vip->sa.sa_family == AF_INET6 ? 16 : 4;
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.r)) + RTA_LENGTH(sizeof(req.op) + sizeof(req.cond) + alen);
+	req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.r.sdiag_family = family;
+	req.r.sdiag_protocol = IPPROTO_TCP;
+	req.r.idiag_states = 1 << TCP_ESTABLISHED;
+
+	req.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+	req.rta.rta_len = RTA_LENGTH(sizeof(req.op) + sizeof(req.cond) + alen);
+	req.op.code = INET_DIAG_BC_S_COND;
+	req.op.yes = sizeof(req.op) + sizeof(req.cond) + alen;
+	req.op.no = req.op.yes + 4;	/* past the end: rejected */
+	req.cond.family = vip->sa.sa_family;
+	req.cond.prefix_len = alen * 8;
+	req.cond.port = -1;
+	if (alen == 16)
+		memcpy(req.addr, &vip->ip6.sin6_addr, 16);
+	else
+		req.addr[0] = vip->ip.sin_addr.s_addr;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	if (sendto(nl, &req, req.nlh.nlmsg_len, 0,
+		   (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0) {
+		fprintf(stderr, "Failed to send the sock_diag request (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		len = recv(nl, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read the sock_diag reply (%s)\n", strerror(errno));
+			return -1;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, (unsigned int)len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				return 0;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+
+				fprintf(stderr, "sock_diag failed (%s)\n", strerror(-err->error));
+				return -1;
+			}
+			m = NLMSG_DATA(h);
+			if (!port_wanted(ports, ntohs(m->id.idiag_sport))) {
+				continue;
+			}
+			diag_addr(&local, m->idiag_family, m->id.idiag_src, m->id.idiag_sport);
+			diag_addr(&remote, m->idiag_family, m->id.idiag_dst, m->id.idiag_dport);
+			c.src = swap ? remote : local;
+			c.dst = swap ? local : remote;
+			c.not_before = 0;
+			if ((ret = fn(&c, arg)) != 0) {
+				return ret;
+			}
+		}
+	}
+}
+
+/*
+ * Call fn for every established TCP connection on vip and one of the
+ * ports, with src the local end, or the remote end if swap is set.
+ */
+static int dump_established(const sock_addr *vip, const struct port_set *ports, int swap,
+			    int (*fn)(const struct tickle_conn *c, void *arg), void *arg)
+{
+	int nl, ret;
+
+	nl = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG);
+	if (nl == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(nl);
+
+	/* an IPv4 address may also be in use by IPv6 sockets, v4 mapped */
+	ret = diag_dump(nl, AF_INET6, vip, ports, swap, fn, arg);
+	if (ret == 0 && vip->sa.sa_family == AF_INET) {
+		ret = diag_dump(nl, AF_INET, vip, ports, swap, fn, arg);
+	}
+	close(nl);
+	return ret;
+}
+#endif /* TICKLE_SOCK_DIAG */
+
+static int write_conn(const struct tickle_conn *c, void *arg)
+{
+	char addr1[INET6_ADDRSTRLEN + 8], addr2[INET6_ADDRSTRLEN + 8];
+
+	format_ip_port(&c->src, addr1, sizeof(addr1));
+	format_ip_port(&c->dst, addr2, sizeof(addr2));
+	if (fprintf(arg, "%s\t%s\n", addr1, addr2) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * State files are written the way portblock did: to a new file first,
+ * synced, and renamed over the old one, so that a node taking over
+ * never finds one half written.
+ */
+static FILE *state_create(const char *path, char *tmp, size_t len)
+{
+	FILE *f;
+
+	if (snprintf(tmp, len, "%s.new", path) >= (int)len) {
+		fprintf(stderr, "State file name too long\n");
+		return NULL;
+	}
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to create %s (%s)\n", tmp, strerror(errno));
+	}
+	return f;
+}
 
-void set_nonblocking(int fd);
-void set_close_on_exec(int fd);
-static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin);
-static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr);
-int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr);
-int parse_ip_port(const char *addr, sock_addr *saddr);
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst);
-static void usage(void);
+/* Finish a file from state_create(), or throw it away if ret is set */
+static int state_commit(FILE *f, const char *tmp, const char *path, int ret)
+{
+	if (ret == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		ret = -1;
+	}
+	if (fclose(f) != 0 && ret == 0) {
+		fprintf(stderr, "Failed to write %s (%s)\n", tmp, strerror(errno));
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp, path) != 0) {
+		fprintf(stderr, "Failed to rename %s (%s)\n", tmp, strerror(errno));
+		ret = -1;
+	}
+	if (ret != 0) {
+		unlink(tmp);
+	}
+	return ret;
+}
+
+/*
+ * The binary state file.
+ *
+ * A snapshot is a header and the connections as fixed size records,
+ * sorted and without duplicates, so that it can be mapped and walked
+ * as it is.  A delta holds the records added and removed between two
+ * snapshots, which it names by their checksums.  The numbers are in
+ * network byte order, as the files go from node to node.
+ */
+#define STATE_MAGIC	"TKL1"
+#define STATE_SNAPSHOT	1
+#define STATE_DELTA	2
+#define STATE_SUM_INIT	14695981039346656037ULL	/* FNV-1a */
+
+struct state_hdr {
+	char magic[4];
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t nadd;		/* the records of a snapshot, or those added */
+	uint32_t ndel;		/* removed by a delta, after the added ones */
+	uint64_t base_sum;	/* the snapshot a delta applies to */
+	uint64_t sum;		/* the snapshot, or the one a delta makes */
+};
+
+/* Records are compared with memcmp(), so the fields are in sort order */
+struct state_rec {
+	uint8_t family;		/* 4 or 6 */
+	uint8_t pad[3];
+	uint8_t laddr[16];
+	uint16_t lport;
+	uint8_t raddr[16];
+	uint16_t rport;
+};
+
+struct state_recs {
+	struct state_rec *r;
+	size_t n, max;
+};
 
-static uint32_t uint16_checksum(uint16_t *data, size_t n)
+struct state_map {
+	void *map;
+	size_t len;
+	struct state_hdr h;
+	const struct state_rec *r;
+};
+
+static void conn_to_rec(const struct tickle_conn *c, struct state_rec *r)
 {
-	uint32_t sum=0;
-	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
-		n -= 2;
-	}                      
-	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
+	memset(r, 0, sizeof(*r));
+	if (c->src.sa.sa_family == AF_INET6) {
+		r->family = 6;
+		memcpy(r->laddr, &c->src.ip6.sin6_addr, 16);
+		memcpy(r->raddr, &c->dst.ip6.sin6_addr, 16);
+		r->lport = c->src.ip6.sin6_port;
+		r->rport = c->dst.ip6.sin6_port;
+	} else {
+		r->family = 4;
+		memcpy(r->laddr, &c->src.ip.sin_addr, 4);
+		memcpy(r->raddr, &c->dst.ip.sin_addr, 4);
+		r->lport = c->src.ip.sin_port;
+		r->rport = c->dst.ip.sin_port;
 	}
-	return sum;
-}       
+}
 
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
+static void rec_to_addr(int family, const uint8_t *a, uint16_t port, sock_addr *addr)
 {
-	uint32_t sum = uint16_checksum(data, n);
-	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
-	sum += ip->protocol + n;
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
+	memset(addr, 0, sizeof(*addr));
+	if (family == 6) {
+		addr->ip6.sin6_family = AF_INET6;
+		memcpy(&addr->ip6.sin6_addr, a, 16);
+		addr->ip6.sin6_port = port;
+	} else {
+		addr->ip.sin_family = AF_INET;
+		memcpy(&addr->ip.sin_addr, a, 4);
+		addr->ip.sin_port = port;
 	}
-	return sum2;
 }
 
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
+static void rec_to_conn(const struct state_rec *r, int swap, struct tickle_conn *c)
+{
+	rec_to_addr(r->family, r->laddr, r->lport, swap ? &c->dst : &c->src);
+	rec_to_addr(r->family, r->raddr, r->rport, swap ? &c->src : &c->dst);
+	c->not_before = 0;
+}
+
+static uint64_t state_sum(uint64_t h, const struct state_rec *r, size_t n)
 {
-	uint32_t phdr[2];
-	uint32_t sum = 0;
-	uint16_t sum2;
+	const unsigned char *p = (const unsigned char *)r;
+	size_t i;
 
-	memset(phdr, 0, sizeof(phdr));
+	for (i = 0; i < n * sizeof(*r); i++) {
+		h = (h ^ p[i]) * 1099511628211ULL;
+	}
+	return h;
+}
 
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
+static int rec_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct state_rec));
+}
 
-	phdr[0] = htonl(n);
-	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
+static int recs_add(const struct tickle_conn *c, void *arg)
+{
+	struct state_recs *rs = arg;
+	struct state_rec *r;
 
-	sum += uint16_checksum(data, n);
+	if (rs->n == rs->max) {
+		size_t n = rs->max ? 2 * rs->max : 1024;
 
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
+		r = realloc(rs->r, n * sizeof(*r));
+		if (!r) {
+			fprintf(stderr, "Failed to allocate %lu connections\n", (unsigned long)n);
+			return -1;
+		}
+		rs->r = r;
+		rs->max = n;
 	}
-	return sum2;
+	conn_to_rec(c, &rs->r[rs->n++]);
+	return 0;
 }
 
-void set_nonblocking(int fd)
+static void recs_sort(struct state_recs *rs)
 {
-	unsigned v;
-	v = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, v | O_NONBLOCK);
+	size_t i, n = 0;
+
+	qsort(rs->r, rs->n, sizeof(*rs->r), rec_cmp);
+	for (i = 0; i < rs->n; i++) {
+		if (n == 0 || rec_cmp(&rs->r[n - 1], &rs->r[i]) != 0) {
+			rs->r[n++] = rs->r[i];
+		}
+	}
+	rs->n = n;
 }
 
-void set_close_on_exec(int fd) 
-{               
-	unsigned v;
-	v = fcntl(fd, F_GETFD, 0);
-	fcntl(fd, F_SETFD, v | FD_CLOEXEC);
+static uint64_t be64(uint64_t v)
+{
+	if (htonl(1) == 1)
+		return v;
+	return ((uint64_t)htonl(v & 0xffffffff) << 32) | htonl(v >> 32);
+}
+
+static void state_unmap(struct state_map *m)
+{
+	if (m->map)
+		munmap(m->map, m->len);
+	m->map = NULL;
 }
 
-static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin)
+/*
+ * Map a binary state file of the given type.  Returns 1 if it is one,
+ * 0 if it is missing or not binary, which reads as an empty snapshot,
+ * and -1 if it is broken.
+ */
+static int state_map(const char *path, int type, struct state_map *m)
 {
-	sin->sin_family = AF_INET;
-	sin->sin_port   = htons(port);
+	struct stat st;
+	int fd;
+
+	memset(m, 0, sizeof(*m));
+	m->h.sum = STATE_SUM_INIT;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+	m->len = st.st_size;
+	m->map = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED) {
+		m->map = NULL;
+		fprintf(stderr, "Failed to map %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
 
-	if (inet_pton(AF_INET, s, &sin->sin_addr) != 1) {
-		fprintf(stderr, "Failed to translate %s into sin_addr\n", s);
+	if (memcmp(m->map, STATE_MAGIC, 4) != 0) {
+		state_unmap(m);
+		return 0;
+	}
+	if (m->len < sizeof(m->h)) {
+		fprintf(stderr, "%s is truncated\n", path);
+		state_unmap(m);
 		return -1;
 	}
+	memcpy(&m->h, m->map, sizeof(m->h));
+	m->h.nadd = ntohl(m->h.nadd);
+	m->h.ndel = ntohl(m->h.ndel);
+	m->h.base_sum = be64(m->h.base_sum);
+	m->h.sum = be64(m->h.sum);
+	if (m->h.type != type
+	||  (type == STATE_SNAPSHOT && m->h.ndel != 0)
+	||  m->len != sizeof(m->h) + ((size_t)m->h.nadd + m->h.ndel) * sizeof(struct state_rec)) {
+		fprintf(stderr, "%s is not a valid %s\n", path,
+			type == STATE_SNAPSHOT ? "snapshot" : "delta");
+		state_unmap(m);
+		return -1;
+	}
+	m->r = (const struct state_rec *)(const void *)((const char *)m->map + sizeof(m->h));
+	madvise(m->map, m->len, MADV_SEQUENTIAL);
+	return 1;
+}
 
-	return 0;
+static int state_write_hdr(FILE *f, int type, uint32_t nadd, uint32_t ndel,
+			   uint64_t base_sum, uint64_t sum)
+{
+	struct state_hdr h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, STATE_MAGIC, 4);
+	h.type = type;
+	h.nadd = htonl(nadd);
+	h.ndel = htonl(ndel);
+	h.base_sum = be64(base_sum);
+	h.sum = be64(sum);
+	return fwrite(&h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+static int state_write_recs(FILE *f, const struct state_rec *r, size_t n)
+{
+	return fwrite(r, sizeof(*r), n, f) == n ? 0 : -1;
 }
 
-static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr)
+/* Write the difference between the snapshot in old and cur to path */
+static int write_delta(const char *path, const struct state_map *old,
+		       const struct state_recs *cur, uint64_t sum)
 {
-	saddr->ip6.sin6_family   = AF_INET6;
-	saddr->ip6.sin6_port     = htons(port);
-	saddr->ip6.sin6_flowinfo = 0;
-	saddr->ip6.sin6_scope_id = 0;
+	struct state_rec *add, *del;
+	size_t i = 0, j = 0, nadd = 0, ndel = 0;
+	char tmp[PATH_MAX];
+	FILE *f;
+	int c, ret;
 
-	if (inet_pton(AF_INET6, s, &saddr->ip6.sin6_addr) != 1) {
-		fprintf(stderr, "Failed to translate %s into sin6_addr\n", s);
+	add = malloc((cur->n + 1) * sizeof(*add));
+	del = malloc((old->h.nadd + 1) * sizeof(*del));
+	if (!add || !del) {
+		fprintf(stderr, "Failed to allocate the delta\n");
+		free(add);
+		free(del);
 		return -1;
 	}
-
-	if (iface && IN6_IS_ADDR_LINKLOCAL(&saddr->ip6.sin6_addr)) {
-		saddr->ip6.sin6_scope_id = if_nametoindex(iface);
+	while (i < old->h.nadd || j < cur->n) {
+		c = i == old->h.nadd ? 1 : j == cur->n ? -1 : rec_cmp(&old->r[i], &cur->r[j]);
+		if (c < 0)
+			del[ndel++] = old->r[i++];
+		else if (c > 0)
+			add[nadd++] = cur->r[j++];
+		else
+			i++, j++;
 	}
 
-        return 0;
+	ret = -1;
+	if ((f = state_create(path, tmp, sizeof(tmp))) != NULL) {
+		ret = state_write_hdr(f, STATE_DELTA, nadd, ndel, old->h.sum, sum)
+		   || state_write_recs(f, add, nadd)
+		   || state_write_recs(f, del, ndel) ? -1 : 0;
+		ret = state_commit(f, tmp, path, ret);
+	}
+	free(add);
+	free(del);
+	return ret;
 }
 
-int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr)
+/* Turn the snapshot in path into the one the delta leads to */
+static int apply_delta(const char *delta, const char *path)
 {
-	char *p;
+	struct state_map base, d;
+	const struct state_rec *add, *del, *r;
+	size_t i = 0, j = 0, k = 0, n;
+	uint64_t sum = STATE_SUM_INIT;
+	char tmp[PATH_MAX];
+	FILE *f;
 	int ret;
 
-	p = index(addr, ':');
-	if (!p)
-		ret = parse_ipv4(addr, port, &saddr->ip);
-	else
-		ret = parse_ipv6(addr, iface, port, saddr);
+	if ((ret = state_map(delta, STATE_DELTA, &d)) != 1) {
+		if (ret == 0)
+			fprintf(stderr, "%s is not a delta\n", delta);
+		return -1;
+	}
+	if (state_map(path, STATE_SNAPSHOT, &base) < 0) {
+		state_unmap(&d);
+		return -1;
+	}
+	if (base.h.sum != d.h.base_sum) {
+		fprintf(stderr, "%s does not apply to %s\n", delta, path);
+		ret = -1;
+		goto out;
+	}
+	if ((f = state_create(path, tmp, sizeof(tmp))) == NULL) {
+		ret = -1;
+		goto out;
+	}
 
+	add = d.r;
+	del = d.r + d.h.nadd;
+	n = (size_t)base.h.nadd + d.h.nadd - d.h.ndel;
+	ret = state_write_hdr(f, STATE_SNAPSHOT, n, 0, 0, d.h.sum);
+	while (ret == 0 && (i < base.h.nadd || j < d.h.nadd)) {
+		if (i < base.h.nadd && k < d.h.ndel && rec_cmp(&base.r[i], &del[k]) == 0) {
+			i++, k++;
+			continue;
+		}
+		if (j == d.h.nadd || (i < base.h.nadd && rec_cmp(&base.r[i], &add[j]) < 0))
+			r = &base.r[i++];
+		else
+			r = &add[j++];
+		sum = state_sum(sum, r, 1);
+		ret = state_write_recs(f, r, 1);
+	}
+	if (ret == 0 && (k != d.h.ndel || sum != d.h.sum)) {
+		fprintf(stderr, "%s does not apply to %s\n", delta, path);
+		ret = -1;
+	}
+	ret = state_commit(f, tmp, path, ret);
+out:
+	state_unmap(&base);
+	state_unmap(&d);
 	return ret;
 }
 
-int parse_ip_port(const char *addr, sock_addr *saddr)
+static int read_text(int fd, int swap,
+		     int (*fn)(const struct tickle_conn *c, void *arg), void *arg)
 {
-	char *s, *p;
-	unsigned port;
-	char *endp = NULL;
+	struct tickle_reader *r;
+	struct tickle_conn c;
 	int ret;
 
-	s = strdup(addr);
-	if (!s) {
-		fprintf(stderr, "Failed strdup()\n");
+	r = malloc(sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "Failed to allocate the input buffer\n");
 		return -1;
 	}
+	tickle_reader_init(r, fd);
+	c.not_before = 0;
+	while ((ret = tickle_reader_next(r, swap ? &c.dst : &c.src,
+					 swap ? &c.src : &c.dst)) > 0) {
+		if (fn(&c, arg)) {
+			ret = -1;
+			break;
+		}
+	}
+	free(r);
+	return ret;
+}
+
+/* Hand the connections in a state file, binary or text, to fn */
+static int read_state_file(const char *path, int swap,
+			   int (*fn)(const struct tickle_conn *c, void *arg), void *arg)
+{
+	struct state_map m;
+	struct tickle_conn c;
+	size_t i;
+	int fd, ret;
 
-	p = rindex(s, ':');
-	if (!p) {
-		fprintf(stderr, "This addr: %s does not contain a port number\n", s);
-		free(s);
+	ret = state_map(path, STATE_SNAPSHOT, &m);
+	if (ret < 0) {
 		return -1;
 	}
-	
-	port = strtoul(p+1, &endp, 10);
-	if (!endp || *endp != 0) {
-		fprintf(stderr, "Trailing garbage after the port in %s\n", s);
-		free(s);
-		return -1;
+	if (ret == 1) {
+		for (i = 0, ret = 0; i < m.h.nadd && ret == 0; i++) {
+			rec_to_conn(&m.r[i], swap, &c);
+			ret = fn(&c, arg);
+		}
+		state_unmap(&m);
+		return ret;
 	}
-	*p = 0;
 
-	ret = parse_ip(s, NULL, port, saddr);
-	free(s);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	ret = read_text(fd, swap, fn, arg);
+	close(fd);
 	return ret;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+/* The connections to tickle: from the kernel, a state file, or stdin */
+static int read_conns(const sock_addr *vip, const struct port_set *ports,
+		      const char *state_in, int swap,
+		      int (*fn)(const struct tickle_conn *c, void *arg), void *arg)
 {
-	int s;
+#ifdef TICKLE_SOCK_DIAG
+	if (vip)
+		return dump_established(vip, ports, swap, fn, arg);
+#endif
+	if (state_in)
+		return read_state_file(state_in, swap, fn, arg);
+	return read_text(STDIN_FILENO, swap, fn, arg);
+}
+
+#ifdef TICKLE_SOCK_DIAG
+/*
+ * Save the connections on vip to the state file, as text or as a binary
+ * snapshot.  With delta set, the changes since the snapshot that was
+ * there before are written to it too.
+ */
+static int write_state_file(const char *path, const sock_addr *vip,
+			    const struct port_set *ports, int swap,
+			    int binary, const char *delta)
+{
+	struct state_recs rs;
+	struct state_map old;
+	char tmp[PATH_MAX];
+	uint64_t sum;
+	FILE *f;
 	int ret;
-	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
-	struct {
-		struct iphdr ip;
-		struct tcphdr tcp;
-	} ip4pkt;
-	struct {
-		struct ip6_hdr ip6;
-		struct tcphdr tcp;
-	} ip6pkt;
 
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
-		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
+	if (!binary) {
+		if ((f = state_create(path, tmp, sizeof(tmp))) == NULL) {
 			return -1;
 		}
+		ret = dump_established(vip, ports, swap, write_conn, f);
+		return state_commit(f, tmp, path, ret);
+	}
 
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
-			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
-			close(s);
-			return -1;
+	memset(&rs, 0, sizeof(rs));
+	if (dump_established(vip, ports, swap, recs_add, &rs) != 0) {
+		free(rs.r);
+		return -1;
+	}
+	recs_sort(&rs);
+	sum = state_sum(STATE_SUM_INIT, rs.r, rs.n);
+
+	ret = 0;
+	if (delta) {
+		/* a text file or none at all is taken as an empty snapshot */
+		ret = state_map(path, STATE_SNAPSHOT, &old) < 0
+		   || write_delta(delta, &old, &rs, sum) ? -1 : 0;
+		state_unmap(&old);
+	}
+	if (ret == 0 && (f = state_create(path, tmp, sizeof(tmp))) != NULL) {
+		ret = state_write_hdr(f, STATE_SNAPSHOT, rs.n, 0, 0, sum)
+		   || state_write_recs(f, rs.r, rs.n) ? -1 : 0;
+		ret = state_commit(f, tmp, path, ret);
+	} else {
+		ret = -1;
+	}
+	free(rs.r);
+	return ret;
+}
+#endif /* TICKLE_SOCK_DIAG */
+
+#ifdef TICKLE_VERIFY
+/*
+ * Verified tickling.  A tickle ACK is only worth sending until the peer
+ * answers it: with a challenge ACK if it still has the connection, which
+ * our kernel then resets, or with a RST if it does not.  The answers are
+ * taken from a packet socket, and every round of tickles goes only to
+ * the connections nobody answered for yet, at growing intervals, until
+ * the deadline.
+ */
+#define VERIFY_RESEND	0.1	/* the first resend, doubled after each */
+#define VERIFY_SNAPLEN	128	/* enough for the IP and TCP headers */
+#define VERIFY_RCVBUF	(4 * 1024 * 1024)
+
+struct verify_conn {
+	struct state_rec key;	/* as conn_to_rec() has it */
+	struct tickle_conn c;
+	int used, confirmed;
+};
+
+struct verify_table {
+	struct verify_conn *slots;
+	size_t max, n, confirmed;
+	/* the addresses answers go to: none, one (1) or several (2) */
+	int naddr4, naddr6;
+	uint8_t addr4[4], addr6[16];
+};
+
+static struct verify_conn *verify_find(struct verify_table *vt,
+				       const struct state_rec *key, int add)
+{
+	struct verify_conn *v, *old;
+	size_t i, oldmax;
+
+	if (add && 2 * (vt->n + 1) > vt->max) {
+		old = vt->slots;
+		oldmax = vt->max;
+		vt->max = oldmax ? 2 * oldmax : 1024;
+		vt->slots = calloc(vt->max, sizeof(*vt->slots));
+		if (!vt->slots) {
+			fprintf(stderr, "Failed to allocate %lu connections\n",
+				(unsigned long)vt->max);
+			vt->slots = old;
+			vt->max = oldmax;
+			return NULL;
+		}
+		vt->n = 0;
+		for (i = 0; i < oldmax; i++) {
+			if (old[i].used) {
+				v = verify_find(vt, &old[i].key, 1);
+				*v = old[i];
+			}
+		}
+		free(old);
+	}
+	if (vt->max == 0) {
+		return NULL;
+	}
+
+	i = state_sum(STATE_SUM_INIT, key, 1) & (vt->max - 1);
+	while (vt->slots[i].used && rec_cmp(&vt->slots[i].key, key) != 0) {
+		i = (i + 1) & (vt->max - 1);
+	}
+	v = &vt->slots[i];
+	if (!v->used) {
+		if (!add) {
+			return NULL;
 		}
+		v->key = *key;
+		v->used = 1;
+		vt->n++;
+	}
+	return v;
+}
+
+static void verify_note_addr(int *naddr, uint8_t *addr, const uint8_t *a, size_t len)
+{
+	if (*naddr == 0) {
+		memcpy(addr, a, len);
+		*naddr = 1;
+	} else if (*naddr == 1 && memcmp(addr, a, len) != 0) {
+		*naddr = 2;
+	}
+}
+
+static int verify_add(const struct tickle_conn *c, void *arg)
+{
+	struct verify_table *vt = arg;
+	struct verify_conn *v;
+	struct state_rec key;
+
+	conn_to_rec(c, &key);
+	v = verify_find(vt, &key, 1);
+	if (!v) {
+		return -1;
+	}
+	v->c = *c;
+	if (key.family == 6)
+		verify_note_addr(&vt->naddr6, vt->addr6, key.laddr, 16);
+	else
+		verify_note_addr(&vt->naddr4, vt->addr4, key.laddr, 4);
+	return 0;
+}
+
+/* Jumps to the labels are resolved once the program is complete */
+#define BPF_TO_V6	254
+#define BPF_TO_DROP	255
+
+static int bpf_op(struct sock_filter *f, int n, uint16_t code,
+		  uint32_t k, uint8_t jt, uint8_t jf)
+{
+	f[n].code = code;
+	f[n].jt = jt;
+	f[n].jf = jf;
+	f[n].k = k;
+	return n + 1;
+}
+
+/*
+ * A packet socket for TCP segments to the addresses the tickles are
+ * from.  When those are all one address per family, the VIP, the filter
+ * checks it; otherwise the hash table lookup sorts the answers out.
+ */
+static int verify_socket(const struct verify_table *vt)
+{
+	struct sock_filter f[24];
+	struct sock_fprog prog;
+	uint32_t w;
+	int s, n = 0, i, v6, drop, rcvbuf = VERIFY_RCVBUF;
 
-		set_nonblocking(s);
-		set_close_on_exec(s);
+	n = bpf_op(f, n, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0);
+	n = bpf_op(f, n, BPF_ALU | BPF_AND | BPF_K, 0xf0, 0, 0);
+	n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, 0x40, 0, BPF_TO_V6);
+	n = bpf_op(f, n, BPF_LD | BPF_B | BPF_ABS, 9, 0, 0);
+	n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, BPF_TO_DROP);
+	if (vt->naddr4 == 1) {
+		memcpy(&w, vt->addr4, 4);
+		n = bpf_op(f, n, BPF_LD | BPF_W | BPF_ABS, 16, 0, 0);
+		n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, ntohl(w), 0, BPF_TO_DROP);
+	}
+	n = bpf_op(f, n, BPF_RET | BPF_K, VERIFY_SNAPLEN, 0, 0);
+	v6 = n;
+	n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, 0x60, 0, BPF_TO_DROP);
+	n = bpf_op(f, n, BPF_LD | BPF_B | BPF_ABS, 6, 0, 0);
+	n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, BPF_TO_DROP);
+	if (vt->naddr6 == 1) {
+		for (i = 0; i < 4; i++) {
+			memcpy(&w, vt->addr6 + 4 * i, 4);
+			n = bpf_op(f, n, BPF_LD | BPF_W | BPF_ABS, 24 + 4 * i, 0, 0);
+			n = bpf_op(f, n, BPF_JMP | BPF_JEQ | BPF_K, ntohl(w), 0, BPF_TO_DROP);
+		}
+	}
+	n = bpf_op(f, n, BPF_RET | BPF_K, VERIFY_SNAPLEN, 0, 0);
+	drop = n;
+	n = bpf_op(f, n, BPF_RET | BPF_K, 0, 0, 0);
+	for (i = 0; i < n; i++) {
+		if (BPF_CLASS(f[i].code) != BPF_JMP)
+			continue;
+		if (f[i].jf == BPF_TO_V6)
+			f[i].jf = v6 - i - 1;
+		else if (f[i].jf == BPF_TO_DROP)
+			f[i].jf = drop - i - 1;
+	}
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
+	/* cooked, so that the data starts at the IP header on any link */
+	s = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+	if (s == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(s);
+	prog.len = n;
+	prog.filter = f;
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+		fprintf(stderr, "Failed to attach the packet filter (%s)\n", strerror(errno));
 		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	return s;
+}
+
+/* The connection a TCP segment belongs to, the other way round */
+static int verify_key(const unsigned char *p, size_t len, struct state_rec *r)
+{
+	size_t hl;
+
+	memset(r, 0, sizeof(*r));
+	if (len >= 20 && p[0] >> 4 == 4) {
+		hl = (p[0] & 0xf) * 4;
+		/* only the first fragment has the ports */
+		if (p[9] != IPPROTO_TCP || ((p[6] & 0x1f) | p[7]) != 0) {
 			return -1;
 		}
-		break;
-
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
-		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
+		r->family = 4;
+		memcpy(r->laddr, p + 16, 4);
+		memcpy(r->raddr, p + 12, 4);
+	} else if (len >= 40 && p[0] >> 4 == 6) {
+		hl = 40;
+		if (p[6] != IPPROTO_TCP) {
 			return -1;
-                }
+		}
+		r->family = 6;
+		memcpy(r->laddr, p + 24, 16);
+		memcpy(r->raddr, p + 8, 16);
+	} else {
+		return -1;
+	}
+	if (len < hl + 4) {
+		return -1;
+	}
+	memcpy(&r->rport, p + hl, 2);
+	memcpy(&r->lport, p + hl + 2, 2);
+	return 0;
+}
 
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+/* Take the answers that came in so far */
+static int verify_drain(struct verify_table *vt, int s)
+{
+	unsigned char buf[VERIFY_SNAPLEN];
+	struct verify_conn *v;
+	struct state_rec key;
+	ssize_t len;
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+	for (;;) {
+		len = recv(s, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			fprintf(stderr, "Failed to read the answers (%s)\n", strerror(errno));
+			return -1;
+		}
+		if ((size_t)len > sizeof(buf))
+			len = sizeof(buf);
+		if (verify_key(buf, len, &key) != 0)
+			continue;
+		v = verify_find(vt, &key, 0);
+		if (v && !v->confirmed) {
+			v->confirmed = 1;
+			vt->confirmed++;
+		}
+	}
+}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
+/* Send -n tickles to every connection that has not answered yet */
+static int verify_round(struct verify_table *vt, struct tickle_engine *e, int s,
+			unsigned long *packets)
+{
+	char addr1[INET6_ADDRSTRLEN + 8], addr2[INET6_ADDRSTRLEN + 8];
+	struct verify_conn *v;
+	size_t i, sent = 0;
+	int j;
+
+	for (i = 0; i < vt->max; i++) {
+		v = &vt->slots[i];
+		if (!v->used || v->confirmed)
+			continue;
+		for (j = 0; j < opts.num; j++) {
+			if (bucket_take(&opts.bucket, 1, 0) < 1) {
+				if (engine_flush(e)) {
+					return -1;
+				}
+				bucket_take(&opts.bucket, 1, 1);
+			}
+			if (engine_add(e, &v->c)) {
+				format_ip_port(&v->c.src, addr1, sizeof(addr1));
+				format_ip_port(&v->c.dst, addr2, sizeof(addr2));
+				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
+					addr1, addr2);
+				return -1;
+			}
+			(*packets)++;
+		}
+		/* answers to the start of the round spare the rest of it */
+		if (++sent % opts.batch == 0 && verify_drain(vt, s)) {
 			return -1;
 		}
-		break;
+	}
+	return engine_flush(e);
+}
 
-	default:
-		fprintf(stderr, "Not an ipv4/v6 address\n");
+static int verify_run(struct verify_table *vt, double timeout, unsigned long *packets)
+{
+	struct tickle_engine e;
+	struct pollfd pfd;
+	double t, next, deadline, interval = VERIFY_RESEND;
+	int s, ret = -1;
+
+	s = verify_socket(vt);
+	if (s == -1) {
 		return -1;
 	}
+	if (engine_init(&e)) {
+		goto out;
+	}
 
-	return 0;
+	t = now();
+	deadline = t + timeout;
+	next = t;
+	while (vt->confirmed < vt->n) {
+		t = now();
+		if (t >= next) {
+			if (t >= deadline)
+				break;
+			if (verify_round(vt, &e, s, packets))
+				goto out;
+			next = now() + interval;
+			interval *= 2;
+			if (next > deadline)
+				next = deadline;
+		}
+		pfd.fd = s;
+		pfd.events = POLLIN;
+		t = next - now();
+		if (poll(&pfd, 1, t > 0 ? (int)(t * 1000) + 1 : 0) == -1 && errno != EINTR) {
+			fprintf(stderr, "Failed poll (%s)\n", strerror(errno));
+			goto out;
+		}
+		if (verify_drain(vt, s))
+			goto out;
+	}
+	ret = 0;
+out:
+	engine_free(&e);
+	close(s);
+	return ret;
 }
+#endif /* TICKLE_VERIFY */
 
 static void usage(void)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -b batch ]"
+	       " [ -I iface -M nexthop_mac ]\n");
+	printf("       [ -t threads ] [ -r pps ] [ -S pps[/plen4[/plen6]] ]\n");
+	printf("       [ -d vip [ -p port[,port...] ] [ -w statefile [ -B ] [ -u delta ] ] ]\n");
+	printf("       [ -f statefile ] [ -x ] [ -v secs ] | [ -a delta -w statefile ]\n");
 	printf("Please note that this program need to read the list of\n");
-	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("{local_ip:port remote_ip:port} from stdin, or from statefile\n");
+	printf("with -f.\n");
+#ifdef TICKLE_SOCK_DIAG
+	printf("With -d, the established TCP connections to vip (and the\n");
+	printf("given ports or port ranges) are taken from the kernel instead.\n");
+	printf("With -w, they are written to statefile rather than tickled,\n");
+	printf("as a binary snapshot with -B, and with -u the changes since\n");
+	printf("the snapshot that was there are written to delta.\n");
+#endif
+	printf("-x swaps local and remote; -a applies a delta to statefile.\n");
+	printf("The tickle ACKs are sent in batches of 'batch' packets"
+	       " (default %d).\n", DEFAULT_BATCH);
+#ifdef TICKLE_TX_RING
+	printf("With -I, they are written as Ethernet frames to nexthop_mac\n");
+	printf("through a TX ring of 'batch' frames on iface.\n");
+#endif
+	printf("They are sent by 'threads' workers (default 1), at most 'pps'\n");
+	printf("packets per second in all with -r, and per destination subnet\n");
+	printf("with -S (default /%d and /%d).\n", DEFAULT_PLEN4, DEFAULT_PLEN6);
+#ifdef TICKLE_VERIFY
+	printf("With -v, the tickles are sent again, at growing intervals for\n");
+	printf("'secs' seconds, to the peers that have not answered them yet.\n");
+#endif
 	exit(1);
 }
 
-#define OPTION_STRING "n:h"
+#define OPTION_STRING "n:b:I:M:t:r:S:d:p:xw:Bu:a:f:v:h"
+
+static double elapsed(const struct timespec *from)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) +
+		(now.tv_nsec - from->tv_nsec) / 1e9;
+}
 
 int main(int argc, char *argv[])
 {
-	int optchar, i, num = 1, cont = 1;
-	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
+	int optchar, i, cont = 1;
+	int nworkers = 1, ninit = 0, started = 0, failed = 0;
+	struct tickle_worker *workers, *w;
+	struct tickle_pool pool;
+	double rate = 0, verify = 0;
+	const char *dump_vip = NULL, *state_file = NULL;
+	const char *state_in = NULL, *delta = NULL, *apply = NULL;
+	struct port_set ports;
+	int swap = 0, binary = 0;
+	sock_addr vip;
+#ifdef TICKLE_TX_RING
+	int have_mac = 0;
+#endif
+	unsigned long conns = 0, packets = 0;
+	struct timespec start;
+	double secs;
+
+	opts.num = 1;
+	opts.batch = DEFAULT_BATCH;
+	opts.plen4 = DEFAULT_PLEN4;
+	opts.plen6 = DEFAULT_PLEN6;
+	ports.n = 0;
 
 	while(cont) {
 		optchar = getopt(argc, argv, OPTION_STRING);
 		switch(optchar) {
 		case 'n':
-			num = atoi(optarg);
+			opts.num = atoi(optarg);
+			break;
+		case 'b':
+			opts.batch = atoi(optarg);
+			if (opts.batch < 1) {
+				fprintf(stderr, "The batch size must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'I':
+			opts.ring_if = optarg;
+			break;
+#ifdef TICKLE_TX_RING
+		case 'M':
+			if (parse_mac(optarg, opts.ring_mac)) {
+				fprintf(stderr, "Bad MAC address '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			have_mac = 1;
+			break;
+#endif
+		case 't':
+			nworkers = atoi(optarg);
+			if (nworkers < 1 || nworkers > MAX_WORKERS) {
+				fprintf(stderr, "The number of threads must be 1 to %d\n",
+					MAX_WORKERS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			rate = atof(optarg);
+			if (rate <= 0) {
+				fprintf(stderr, "Bad packets per second '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			i = sscanf(optarg, "%lf/%d/%d", &opts.subnet_rate,
+				   &opts.plen4, &opts.plen6);
+			if (i < 1 || opts.subnet_rate <= 0
+			||  opts.plen4 < 0 || opts.plen4 > 32
+			||  opts.plen6 < 0 || opts.plen6 > 128) {
+				fprintf(stderr, "Bad subnet budget '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+#ifdef TICKLE_SOCK_DIAG
+		case 'd':
+			dump_vip = optarg;
+			if (parse_ip(optarg, NULL, 0, &vip)) {
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			if (parse_ports(optarg, &ports)) {
+				fprintf(stderr, "Bad ports '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'B':
+			binary = 1;
+			break;
+		case 'u':
+			delta = optarg;
+			break;
+#endif
+		case 'w':
+			state_file = optarg;
 			break;
+		case 'x':
+			swap = 1;
+			break;
+		case 'f':
+			state_in = optarg;
+			break;
+		case 'a':
+			apply = optarg;
+			break;
+#ifdef TICKLE_VERIFY
+		case 'v':
+			verify = atof(optarg);
+			if (verify <= 0) {
+				fprintf(stderr, "Bad verification time '%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+#endif
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -355,26 +2473,134 @@ int main(int argc, char *argv[])
 		};
 	}
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
+	if (opts.ring_if) {
+#ifdef TICKLE_TX_RING
+		if (!have_mac) {
+			fprintf(stderr, "-I needs the MAC address of the next hop (-M)\n");
+			exit(EXIT_FAILURE);
+		}
+#else
+		fprintf(stderr, "The TX ring engine is not supported on this platform\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	if (apply) {
+		if (!state_file || dump_vip || state_in) {
+			fprintf(stderr, "-a needs -w, and only that\n");
+			exit(EXIT_FAILURE);
+		}
+		return apply_delta(apply, state_file) ? -1 : 0;
+	}
+	if ((ports.n || state_file) && !dump_vip) {
+		fprintf(stderr, "-p and -w only go with -d\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((binary || delta) && !state_file) {
+		fprintf(stderr, "-B and -u only go with -w\n");
+		exit(EXIT_FAILURE);
+	}
+	if (delta && !binary) {
+		fprintf(stderr, "-u needs a binary state file (-B)\n");
+		exit(EXIT_FAILURE);
+	}
+	if (dump_vip && state_in) {
+		fprintf(stderr, "-d and -f do not go together\n");
+		exit(EXIT_FAILURE);
+	}
+	if (verify > 0 && (nworkers > 1 || opts.subnet_rate > 0 || state_file)) {
+		fprintf(stderr, "-v does not go with -t, -S or -w\n");
+		exit(EXIT_FAILURE);
+	}
+#ifdef TICKLE_SOCK_DIAG
+	if (state_file) {
+		return write_state_file(state_file, &vip, &ports, swap,
+					binary, delta) ? -1 : 0;
+	}
+#endif
+	bucket_init(&opts.bucket, rate);
+
+#ifdef TICKLE_VERIFY
+	if (verify > 0) {
+		struct verify_table vt;
 
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
-			return -1;
+		memset(&vt, 0, sizeof(vt));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		failed = read_conns(dump_vip ? &vip : NULL, &ports, state_in, swap,
+				    verify_add, &vt) != 0;
+		if (!failed && vt.n > 0) {
+			failed = verify_run(&vt, verify, &packets) != 0;
 		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
+		free(vt.slots);
+		if (failed) {
 			return -1;
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
-				return -1;
-			}
+		secs = elapsed(&start);
+		fprintf(stderr, "Sent %lu tickle ACKs to %lu connections in %.3f s"
+			" (%.0f packets/s), %lu confirmed\n", packets,
+			(unsigned long)vt.n, secs, secs > 0 ? packets / secs : 0.0,
+			(unsigned long)vt.confirmed);
+		return 0;
+	}
+#endif
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Failed to allocate %d workers\n", nworkers);
+		return -1;
+	}
+	for (i = 0; i < nworkers; i++) {
+		w = &workers[i];
+		ninit++;
+		if (engine_init(&w->e) || queue_init(&w->in, QUEUE_LEN)) {
+			failed = 1;
+			break;
 		}
+		if (pthread_create(&w->tid, NULL, worker_main, w) != 0) {
+			fprintf(stderr, "Failed to start a worker thread\n");
+			queue_free(&w->in);
+			failed = 1;
+			break;
+		}
+		started++;
+	}
+
+	pool.workers = workers;
+	pool.n = started;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!failed) {
+		failed = read_conns(dump_vip ? &vip : NULL, &ports, state_in, swap,
+				    dispatch, &pool) != 0;
 	}
+
+	for (i = 0; i < started; i++) {
+		w = &workers[i];
+		if (!failed && w->nout) {
+			failed = queue_push(&w->in, w->out, w->nout) != 0;
+		}
+		queue_close(&w->in);
+	}
+	for (i = 0; i < started; i++) {
+		w = &workers[i];
+		pthread_join(w->tid, NULL);
+		failed |= w->failed;
+		conns += w->conns;
+		packets += w->packets;
+		queue_free(&w->in);
+		free(w->held);
+		free(w->subnets);
+	}
+	for (i = 0; i < ninit; i++) {
+		engine_free(&workers[i].e);
+	}
+	free(workers);
+	if (failed) {
+		return -1;
+	}
+
+	secs = elapsed(&start);
+	fprintf(stderr, "Sent %lu tickle ACKs to %lu connections in %.3f s"
+		" (%.0f packets/s)\n", packets, conns, secs,
+		secs > 0 ? packets / secs : 0.0);
 	return 0;
 }